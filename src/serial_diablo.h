@@ -7,6 +7,138 @@
 
 namespace diablo
 {
+  /*
+   * Gets told about every command a Diablo sends.  Hook one up with Diablo::observe().
+   * Times are micros().  The metrics in serial_diablo_metrics.h are built on this.
+   */
+  class CommandObserver
+  {
+  public:
+    virtual ~CommandObserver()
+    {}
+
+    // The request bytes for `name` have been handed to the serial port.
+    // queued_at = when it was defer()'d, or 0 if it was invoked directly.
+    virtual void sent(const char * /*name*/, uint32_t /*bytes*/, uint32_t /*queued_at*/,
+                      uint32_t /*write_start*/, uint32_t /*write_end*/)
+    {}
+
+    // We've collected the ACK for `name` (or given up on it).  at = when we noticed, which for
+    //   non-blocking commands is whenever the next command or advance() came looking.
+    virtual void acked(const char * /*name*/, bool /*ok*/, uint32_t /*at*/)
+    {}
+
+    // Return true to have the Diablo's system timer read right behind this command, pipelined.
+    // The Diablo runs the read as soon as the command finishes, so device_time() tells you
+    //   when (on the device's clock) that was.
+    virtual bool want_device_time(const char * /*name*/)
+    { return false; }
+
+    // Low 16 bits of the device's millisecond timer, read right after `name` finished.
+    virtual void device_time(const char * /*name*/, uint16_t /*device_ms*/)
+    {}
+
+    // Something other than an ACK came back for `name` (response: 0x15 is a NAK), or nothing
+    //   did (response -1: the ACK or a response word timed out).
+    virtual void link_error(const char * /*name*/, int /*response*/)
+    {}
+  };
+
+  /*
+   * Takes over commands while something other than the serial environment owns the wire
+   *   (the bytecode interpreter in serial_diablo_bytecode.h).  Hook one up with Diablo::encode_with().
+   */
+  class CommandEncoder
+  {
+  public:
+    virtual ~CommandEncoder()
+    {}
+
+    // command = the bytes the command would have sent, opcode first.  False if it can't be encoded.
+    virtual bool encode(const uint8_t *command, size_t length) = 0;
+  };
+
+  /*
+   * Takes log lines instead of the Logger, to print later (the ring in serial_diablo_log_ring.h).
+   * Hook one up with Diablo::log_to().
+   * format is the event: always a string literal.  values are its arguments, integers and
+   *   strings squeezed into intptr_t; strings by pointer, so they'd better be literals too.
+   */
+  class LogRecorder
+  {
+  public:
+    virtual ~LogRecorder()
+    {}
+
+    // False if it had no room.  Never blocks.
+    virtual bool record(const Logger &logger, LogLevel level, const char *format, const intptr_t *values, uint8_t count) = 0;
+  };
+
+  /*
+   * What Diablo logs through: a Logger, unless a LogRecorder has been hooked up.
+   * Same calls as Logger, so nothing at the call sites changes.
+   */
+  class DiabloLogger
+  {
+  public:
+    explicit DiabloLogger(const char *name) :
+        logger(name)
+    {}
+
+    void record_to(LogRecorder *log_recorder)
+    { recorder = log_recorder; }
+
+    const Logger &wrapped() const
+    { return logger; }
+
+    template<typename... Args>
+    void operator()(LogLevel level, const char *format, Args... args) const
+    {
+      if (recorder)
+      {
+        const intptr_t values[] = {(intptr_t) args...};
+        record(level, format, values, sizeof...(args));
+        return;
+      }
+      logger(level, format, args...);
+    }
+
+    void operator()(LogLevel level, const char *format) const
+    {
+      if (recorder)
+      {
+        record(level, format, nullptr, 0);
+        return;
+      }
+      logger(level, "%s", format);
+    }
+
+    template<typename... Args>
+    void trace(const char *format, Args... args) const
+    { (*this)(LOG_LEVEL_TRACE, format, args...); }
+
+    template<typename... Args>
+    void info(const char *format, Args... args) const
+    { (*this)(LOG_LEVEL_INFO, format, args...); }
+
+    template<typename... Args>
+    void warn(const char *format, Args... args) const
+    { (*this)(LOG_LEVEL_WARN, format, args...); }
+
+    template<typename... Args>
+    void error(const char *format, Args... args) const
+    { (*this)(LOG_LEVEL_ERROR, format, args...); }
+
+  private:
+    const Logger logger;
+    LogRecorder *recorder = nullptr;
+
+    void record(LogLevel level, const char *format, const intptr_t *values, uint8_t count) const
+    {
+      if (logger.isLevelEnabled(level)) recorder->record(logger, level, format, values, count);
+    }
+  };
+
   /*
    * An implementation of the Diablo16 serial environment command set:
    * http://www.4dsystems.com.au/productpages/DIABLO16/downloads/DIABLO16_serialcmdmanual_R_2_0.pdf
@@ -20,6 +152,77 @@ namespace diablo
   {
   public:
     typedef std::function<void()> Runnable;
+    // Tags deferred things so a whole page's worth can be dropped at once.  See invalidate().
+    typedef uint8_t Scope;
+    static const Scope GLOBAL_SCOPE = 0;
+
+    /*
+     * Setters for boot(), which sends them all in one burst.  Applied in the order they're added.
+     *
+     * diablo16.boot(diablo::Diablo::BootSettings().contrast(15).screen_mode(0).outline_color(0).lazy_media());
+     */
+    class BootSettings
+    {
+    public:
+      BootSettings &outline_color(uint16_t setting)
+      { return add({0xFF41, setting}); }
+
+      BootSettings &contrast(uint16_t setting)
+      { return add({0xFF40, setting}); }
+
+      BootSettings &line_pattern(uint16_t pattern)
+      { return add({0xFF3F, pattern}); }
+
+      BootSettings &screen_mode(uint16_t setting)
+      { return add({0xFF42, setting}); }
+
+      BootSettings &transparency(bool enabled)
+      { return add({0xFF44, enabled ? (uint16_t) 1 : (uint16_t) 0}); }
+
+      BootSettings &transparent_color(uint16_t color)
+      { return add({0xFF45, color}); }
+
+      BootSettings &graphics_parameter(uint16_t function, uint16_t value)
+      { return add({0xFF83, function, value}); }
+
+      BootSettings &text_foreground(uint16_t color)
+      { return add({0xFFE7, color}); }
+
+      BootSettings &text_background(uint16_t color)
+      { return add({0xFFE6, color}); }
+
+      BootSettings &text_opacity(uint16_t opaque)
+      { return add({0xFFDF, opaque}); }
+
+      // Changes when the settings do: for remembering what's been applied across a reset.
+      uint32_t hash() const
+      {
+        uint32_t hash = 2166136261UL;
+        for (const std::vector<uint16_t> &command : commands)
+        {
+          for (uint16_t word : command) hash = (hash ^ word) * 16777619UL;
+        }
+        return hash;
+      }
+
+      // Don't init the card now; see media_init_lazy().
+      BootSettings &lazy_media()
+      {
+        media = true;
+        return *this;
+      }
+
+    private:
+      friend class Diablo;
+      std::vector<std::vector<uint16_t>> commands;
+      bool media = false;
+
+      BootSettings &add(std::vector<uint16_t> command)
+      {
+        commands.push_back(command);
+        return *this;
+      }
+    };
     Diablo(Stream &serial) :
         log("app.diablo"),
         pending_ack(false),
@@ -51,18 +254,105 @@ namespace diablo
        */
       void defer(String name, Runnable thing)
       {
-        std::deque<std::pair<String, Runnable>>::iterator duplicate = std::find_if(std::begin(request_queue), std::end(request_queue), [&name](const std::pair<String, Runnable>& pair){return name == pair.first;});
+        defer(GLOBAL_SCOPE, name, thing);
+      }
+
+      /**
+       * Same as defer(name, thing), but the thing belongs to a scope (a page, usually).
+       * invalidate(scope) throws away everything the scope has waiting, without waiting on it.
+       *
+       * diablo->defer(PAGE_TRENDS, "trend 1", [diablo](){draw_trend(1);});
+       * ...user switches pages...
+       * diablo->invalidate(PAGE_TRENDS);  // The trend redraws never happen.
+       *
+       * urgent:  pace() doesn't hold it back.  It goes out as soon as the link is free, ahead of paced
+       *   things waiting in front of it.  For touch polls and alarms, which are what end the pacing.
+       */
+      void defer(Scope scope, String name, Runnable thing, bool urgent = false)
+      {
+        if(scope >= generations.size())
+        {
+            generations.resize(scope + 1, 0);
+        }
+        std::deque<Deferred>::iterator duplicate = std::find_if(std::begin(request_queue), std::end(request_queue), [&name](const Deferred& deferred){return name == deferred.name;});
         if(duplicate != std::end(request_queue))
         {
-            (*duplicate).second = thing;
+            if(stale(*duplicate))
+            {
+                // The old one was invalidated, so this is a fresh request: it just gets the old one's place in line.
+                (*duplicate).queued_at = micros();
+            }
+            else
+            {
+                // Keeps its place in line, and its queued_at: the screen has been waiting on this name since then.
+                coalesced++;
+            }
+            (*duplicate).thing = thing;
+            (*duplicate).scope = scope;
+            (*duplicate).generation = generations[scope];
+            (*duplicate).urgent = urgent;
         }
         else
         {
-            request_queue.push_back({name, thing});
+            request_queue.push_back({name, thing, (uint32_t) micros(), scope, generations[scope], urgent});
         }
         advance();
       }
 
+      /**
+       * defer(name, thing), unpaced.  See defer(scope, name, thing, urgent).
+       */
+      void defer_urgent(String name, Runnable thing)
+      {
+        defer(GLOBAL_SCOPE, name, thing, true);
+      }
+
+      /**
+       * Drops everything deferred under scope so far, in O(1): the scope's generation goes up, and
+       *   advance() skips the old generation's things as it comes across them.
+       * Things deferred under the scope after this run as usual.
+       *
+       * Also starts the time-to-first-paint clock: the next deferred thing of scope `showing` (the page
+       *   coming up; the same scope, by default) that actually runs logs how long it took to get through
+       *   (or past) the backlog.  Touch polls and the like in other scopes don't count.
+       *
+       * diablo->invalidate(PAGE_TRENDS, PAGE_ALARMS);  // Times the first alarms page redraw.
+       */
+      void invalidate(Scope scope)
+      {
+        invalidate(scope, scope);
+      }
+
+      void invalidate(Scope scope, Scope showing)
+      {
+        if(scope >= generations.size())
+        {
+            generations.resize(scope + 1, 0);
+        }
+        generations[scope]++;
+        invalidated_at = micros();
+        first_paint_pending = true;
+        first_paint_scope = showing;
+        skipped_since_invalidate = 0;
+      }
+
+      /**
+       * Microseconds from the last invalidate() to the first deferred thing of the scope it was showing
+       *   that ran after it.
+       */
+      uint32_t last_first_paint_us() const
+      {
+        return first_paint_us;
+      }
+
+      /**
+       * Deferred things that were thrown away by invalidate().
+       */
+      uint32_t skipped_count() const
+      {
+        return skipped;
+      }
+
       /**
        * NOTE:  Don't bother with this unless you use defer()
        * If you defer often enough, maybe you don't even care about calling advance yourself.
@@ -71,8 +361,25 @@ namespace diablo
        */
       void advance()
       {
-        if(request_queue.empty() ||
-            (pending_ack && serial->available() < outstanding_words))
+        if(burst_pending)
+        {
+            // Scoop up any burst answers that have landed, so async callbacks fire promptly.
+            collect_burst(false);
+        }
+        if(pending_ack && !burst_pending
+           && serial->available() >= 1 + 2 * outstanding_words + (device_time_pending ? 3 : 0))
+        {
+            // The last command's answer is all here: take it now rather than at the next command, so
+            //   whoever's counting ACKs (commands_completed(), observers) hears about it promptly.
+            settle();
+        }
+        if(request_queue.empty() && media == MEDIA_WANTED && !busy())
+        {
+            // Nothing else to do: get the card going in the background.
+            start_media_init();
+            return;
+        }
+        if(request_queue.empty() || busy())
         {
             // Still waiting for the ack to come back.
             // Maybe still waiting for the rest of the response too.
@@ -80,9 +387,204 @@ namespace diablo
             //   on the screen.  Let's just unblock the loop and rock on!
             return;
         }
-        std::pair<String, Runnable> deferred = request_queue.front();
-        request_queue.pop_front(); // lulz, pop doesn't return what it removed.  Smooth, Stroustrup.
-        deferred.second();
+        while(!request_queue.empty() && stale(request_queue.front()))
+        {
+            // Invalidated.  Costs nothing to skip, nothing went out on the wire.
+            request_queue.pop_front();
+            skipped++;
+            skipped_since_invalidate++;
+        }
+        if(request_queue.empty())
+        {
+            return;
+        }
+        std::deque<Deferred>::iterator next = std::begin(request_queue);
+        bool paced = pace_ms && millis() - last_dispatch_ms < pace_ms;
+        if(paced)
+        {
+            // Paced: whatever gets deferred in the meantime dedupes into what's waiting.  Urgent things
+            //   don't wait.
+            next = std::find_if(next, std::end(request_queue), [this](const Deferred& deferred){return deferred.urgent && !stale(deferred);});
+            if(next == std::end(request_queue))
+            {
+                return;
+            }
+        }
+        Deferred deferred = *next;
+        request_queue.erase(next); // lulz, erase doesn't return what it removed.  Smooth, Stroustrup.
+        if(first_paint_pending && deferred.scope == first_paint_scope)
+        {
+            first_paint_pending = false;
+            first_paint_us = micros() - invalidated_at;
+            log.info("First paint after invalidate: %lums, %lu stale skipped",
+                     (unsigned long) (first_paint_us / 1000), (unsigned long) skipped_since_invalidate);
+        }
+        dispatch_queued_at = deferred.queued_at;
+        if(!deferred.urgent)
+        {
+            last_dispatch_ms = millis();
+        }
+        deferred.thing();
+        dispatch_queued_at = 0;
+        dispatched++;
+      }
+
+      /**
+       * Spaces deferred things out: advance() runs at most one every interval_ms.  0 (the default) runs
+       *   them as fast as the link takes them.
+       * Nothing is dropped, it's just that a name deferred again while it waits dedupes, so a slower
+       *   pace means fewer redraws of fresher state.  See RefreshGovernor in serial_diablo_refresh.h.
+       * Urgent things (defer_urgent()) aren't paced, and don't count against it.
+       */
+      void pace(uint32_t interval_ms)
+      {
+        pace_ms = interval_ms;
+      }
+
+      /**
+       * How many deferred things are waiting their turn.
+       * Invalidated things count until advance() gets around to skipping them.
+       */
+      size_t queued() const
+      {
+        return request_queue.size();
+      }
+
+      /**
+       * How long the oldest deferred thing has been waiting, in microseconds.  0 when nothing is.
+       * Deduping keeps a name's place in line, so this is how stale the stalest part of the screen is.
+       */
+      uint32_t queue_lag_us() const
+      {
+        return request_queue.empty() ? 0 : micros() - request_queue.front().queued_at;
+      }
+
+      /**
+       * Deferred things run so far.  Diff two reads for a drain rate.
+       */
+      uint32_t dispatched_count() const
+      {
+        return dispatched;
+      }
+
+      /**
+       * Deferred things that got deduped into a newer one before they ever ran.
+       */
+      uint32_t coalesced_count() const
+      {
+        return coalesced;
+      }
+
+      /**
+       * Commands written so far, each burst command counted on its own.  A command's number is the
+       *   count right after it went out.
+       */
+      uint32_t commands_sent() const
+      {
+        return sent_sequence;
+      }
+
+      /**
+       * Every command up to this number has been ACK'd, refused or written off.
+       */
+      uint32_t commands_completed() const
+      {
+        return completed_sequence;
+      }
+
+      /**
+       * The number of the latest command that wasn't ACK'd, 0 if none has failed.
+       *   Everything in (a, b] went through if commands_completed() >= b and this is <= a.
+       */
+      uint32_t last_failed_command() const
+      {
+        return failed_sequence;
+      }
+
+      /**
+       * True if any command in (after, through] wasn't ACK'd.  Tells failures apart, where
+       *   last_failed_command() only has the latest.  The last FAILURES_REMEMBERED failures are kept;
+       *   a range older than that counts as failed, to be safe.
+       */
+      bool failed_between(uint32_t after, uint32_t through) const
+      {
+        uint8_t kept = std::min<uint32_t>(failure_count, FAILURES_REMEMBERED);
+        for (uint8_t i = 0; i < kept; i++)
+        {
+          const Failure &f = failures[i];
+          if ((int32_t) (f.through - after) > 0 && (int32_t) (through - f.after) > 0) return true;
+        }
+        // Forgotten ones all came before the oldest kept one.
+        const Failure &oldest = failures[failure_count % FAILURES_REMEMBERED];
+        return failure_count > FAILURES_REMEMBERED && (int32_t) (after - oldest.after) < 0;
+      }
+
+      static const uint8_t FAILURES_REMEMBERED = 16;
+
+      /**
+       * True while the previous command's ACK (and any response words) haven't made it
+       *   back off the serial bus yet.  Sending now would block in ack().
+       * A command that's been silent past the ACK give-up time doesn't count as busy anymore;
+       *   the next invoke gets to sort it out (and log about it).
+       */
+      bool busy()
+      {
+        static uint16_t give_up_length = 1000;
+        if (burst_pending && millis() - burst.since < give_up_length)
+        { return true; }
+        return pending_ack
+               && serial->available() < 1 + 2 * outstanding_words + (device_time_pending ? 3 : 0)
+               && millis() - pending_since < give_up_length;
+      }
+
+      /**
+       * Hook up something that wants to hear about every command (metrics, usually).
+       * nullptr to unhook.  The Diablo doesn't own it.
+       */
+      void observe(CommandObserver *command_observer)
+      {
+        observer = command_observer;
+      }
+
+      /**
+       * Send log lines to a recorder (a LogRing, say) instead of straight out through the Logger, so
+       *   TRACE doesn't eat into the latencies it's reporting.  nullptr to log directly again.
+       */
+      void log_to(LogRecorder *log_recorder)
+      {
+        log.record_to(log_recorder);
+      }
+
+      /**
+       * Routes every command to an encoder instead of the wire.  nullptr to go back to the serial
+       *   environment.  Commands the encoder can't take are dropped (and logged), and return nothing.
+       */
+      void encode_with(CommandEncoder *command_encoder)
+      {
+        encoder = command_encoder;
+      }
+
+      /**
+       * Sends bytes as they are, as one command with one ACK (and no response words).
+       * For protocols layered on top of the serial port, like bytecode batches.
+       * False if they didn't go out (the previous command never answered), or, blocking, weren't ACK'd.
+       *   Not blocking, it's up to the caller to watch last_failed_command().
+       */
+      bool write_raw(const char *name, const uint8_t *bytes, size_t length,
+                     LogLevel log_level = LOG_LEVEL_TRACE, bool blocking = false)
+      {
+        struct Raw { const uint8_t *bytes; size_t length; } raw = {bytes, length};
+        const Raw *r = &raw;
+        std::function<void ()> request = [this, r]() -> void {
+          for (size_t i = 0; i < r->length; i++) write_byte(r->bytes[i]);
+        };
+        CommandEncoder *was = encoder;
+        encoder = nullptr;
+        uint32_t before = sent_sequence;
+        invoke<AckOnly>(name, log_level, blocking, request);
+        encoder = was;
+        if (sent_sequence == before) return false;
+        return !blocking || (completed_sequence == sent_sequence && failed_sequence != sent_sequence);
       }
 
     /**
@@ -218,6 +720,40 @@ namespace diablo
       invoke_graphics<AckOnly>("draw_rectangle_filled", log_level, blocking, words);
     }
 
+    /*
+     * n filled rectangles of one color in one burst: corners is x1, y1, x2, y2 for each.
+     * One round trip instead of n.  Falls back to one command each while an encoder has the wire.
+     *
+     * NOTE:  The ACKs come back while the rest is still being written, and Photon's Serial1 receive
+     *   buffer is 64 bytes.  So it actually goes out RECTANGLES_PER_BURST at a time, each lot's ACKs
+     *   collected before the next is written: one round trip per lot.
+     */
+    void draw_rectangles_filled(const uint16_t *corners,
+                                uint16_t n,
+                                uint16_t color = 0xFFFF,
+                                LogLevel log_level = LOG_LEVEL_TRACE,
+                                bool blocking = false)
+    {
+      if (encoder)
+      {
+        for (uint16_t i = 0; i < n; i++, corners += 4)
+        { draw_rectangle_filled(corners[0], corners[1], corners[2], corners[3], color, log_level, blocking); }
+        return;
+      }
+      std::vector<std::vector<uint16_t>> commands;
+      for (uint16_t done = 0; done < n; done += commands.size())
+      {
+        commands.clear();
+        for (uint16_t i = done; i < n && commands.size() < RECTANGLES_PER_BURST; i++, corners += 4)
+        { commands.push_back({0xFF79, corners[0], corners[1], corners[2], corners[3], color}); }
+        // The next lot's settle() collects this one's ACKs.
+        invoke_burst("draw_rectangles_filled", log_level, blocking, commands, 0, nullptr);
+      }
+    }
+
+    // 48 ACKs in the receive buffer, with room left over for anything else that lands.
+    static const uint16_t RECTANGLES_PER_BURST = 48;
+
     /*
      * The Draw Polyline command plots lines between points specified by a pair of arrays using the specified colour.
      * Lines may be tessellated with the “Line Pattern” command.
@@ -288,6 +824,41 @@ namespace diablo
       invoke_graphics_compound_request<AckOnly>("draw_polygon_filled", log_level, blocking, compound_words);
     }
 
+    /*
+     * Allocation-free flavors of the poly commands, for vertex arrays that already live somewhere
+     *   (like the constexpr shapes in serial_diablo_shapes.h, which sit in flash).
+     *
+     * vertices:  x1, x2, [...], xn, y1, y2, [...], yn.  2n words.
+     * n:  Number of vertices, not words.
+     * 5.2.8, 5.2.9, 5.2.10
+     */
+    void draw_polyline(const uint16_t *vertices,
+                       uint16_t n,
+                       uint16_t color = 0xFFFF,
+                       LogLevel log_level = LOG_LEVEL_TRACE,
+                       bool blocking = false)
+    {
+      invoke_vertices("draw_polyline", 0x0015, vertices, n, color, log_level, blocking);
+    }
+
+    void draw_polygon(const uint16_t *vertices,
+                      uint16_t n,
+                      uint16_t color = 0xFFFF,
+                      LogLevel log_level = LOG_LEVEL_TRACE,
+                      bool blocking = false)
+    {
+      invoke_vertices("draw_polygon", 0x0013, vertices, n, color, log_level, blocking);
+    }
+
+    void draw_polygon_filled(const uint16_t *vertices,
+                             uint16_t n,
+                             uint16_t color = 0xFFFF,
+                             LogLevel log_level = LOG_LEVEL_TRACE,
+                             bool blocking = false)
+    {
+      invoke_vertices("draw_polygon_filled", 0x0014, vertices, n, color, log_level, blocking);
+    }
+
     /*
      * The Draw Triangle command draws a triangle outline between vertices x1,y1 , x2,y2 and x3,y3 using the specified colour.
      * Line may be tessellated with the “Line Pattern” command.
@@ -471,22 +1042,248 @@ namespace diablo
                                        [this]() -> uint16_t { return read_word(); }, 1);
     }
 
-    /////////////////////////////////////    5.3 Media Commands    /////////////////////////////////////
+    /*
+     * All of setup()'s setters in one burst: one round trip instead of one each.  True if every one took.
+     * Blocks, since you'll want them in before the first pixel anyway.
+     */
+    bool boot(const BootSettings &settings, LogLevel log_level = LOG_LEVEL_INFO)
+    {
+      bool ok = true;
+      if (!settings.commands.empty())
+      {
+        ok = false;
+        invoke_burst("boot", log_level, true, settings.commands, 1,
+                     [&ok](bool burst_ok, const std::vector<uint16_t> &) { ok = burst_ok; });
+      }
+      if (settings.media) media_init_lazy();
+      return ok;
+    }
 
     /*
-     * The Media Init command initialises a uSD/SD/SDHC memory card for further operations.
-     * The SD card is connected to the SPI (serial peripheral interface) of the Diablo16 Processor.
+     * The Blit Com to Display command copies a width x height block of RGB565 pixels from the serial
+     *   port straight onto the screen at x, y.  It's a full framebuffer push, so it's big: 2 bytes per pixel.
      *
-     * 5.3.1
-     * True if init successful.
+     * pixels:  Row-major RGB565, stride words between the starts of consecutive rows
+     *   (0 means tightly packed, stride == width).  Lets you push a dirty rectangle out of a bigger
+     *   framebuffer without copying it out first.
+     */
+    void blit_com_to_display(uint16_t x,
+                             uint16_t y,
+                             uint16_t width,
+                             uint16_t height,
+                             const uint16_t *pixels,
+                             uint16_t stride = 0,
+                             LogLevel log_level = LOG_LEVEL_TRACE,
+                             bool blocking = false)
+    {
+      struct Block { uint16_t x, y, width, height, stride; const uint16_t *pixels; } block = {
+          x, y, width, height, stride ? stride : width, pixels
+      };
+      const Block *b = &block;
+      std::function<void ()> request = [this, b]() -> void {
+        write_word(0x0023);
+        write_word(b->x);
+        write_word(b->y);
+        write_word(b->width);
+        write_word(b->height);
+        for (uint16_t row = 0; row < b->height; row++)
+        {
+          const uint16_t *line = b->pixels + (size_t) row * b->stride;
+          for (uint16_t col = 0; col < b->width; col++) write_word(line[col]);
+        }
+      };
+      invoke<AckOnly>("blit_com_to_display", log_level, blocking, request);
+    }
+
+    /*
+     * Same command, with pixels that are already big-endian RGB565 - the order they go down the wire -
+     *   like the ones in an AssetPack.  They're handed to the serial port as they are, in one write.
+     */
+    void blit_com_to_display(uint16_t x,
+                             uint16_t y,
+                             uint16_t width,
+                             uint16_t height,
+                             const uint8_t *wire_pixels,
+                             LogLevel log_level = LOG_LEVEL_TRACE,
+                             bool blocking = false)
+    {
+      std::function<void ()> request = [this, x, y, width, height, wire_pixels]() -> void {
+        write_word(0x0023);
+        write_word(x);
+        write_word(y);
+        write_word(width);
+        write_word(height);
+        write_raw(wire_pixels, (size_t) width * height * 2);
+      };
+      invoke<AckOnly>("blit_com_to_display", log_level, blocking, request);
+    }
+
+    /////////////////////////////////////    5.1 Text and String Commands    /////////////////////////////////////
+
+    /*
+     * Moves the text cursor to a line and column, in character cells of the current font.
+     */
+    void move_cursor(uint16_t line, uint16_t column, LogLevel log_level = LOG_LEVEL_TRACE, bool blocking = false)
+    {
+      std::vector<uint16_t> words = {
+          0xFFF0,
+          line, column
+      };
+      invoke_graphics<AckOnly>("move_cursor", log_level, blocking, words);
+    }
+
+    /*
+     * Prints one character at the text cursor and moves it along.
+     */
+    void put_character(char c, LogLevel log_level = LOG_LEVEL_TRACE, bool blocking = false)
+    {
+      std::vector<uint16_t> words = {
+          0xFFFE,
+          (uint16_t) (uint8_t) c
+      };
+      invoke_graphics<AckOnly>("put_character", log_level, blocking, words);
+    }
+
+    /*
+     * Prints a string at the text cursor.  One byte per character on the wire, plus the terminator.
+     * length = how many characters to send, or -1 for all of them.
+     * The Diablo answers with the length it printed, which only makes it back when blocking.
+     */
+    uint16_t put_string(const char *text, int16_t length = -1, LogLevel log_level = LOG_LEVEL_TRACE, bool blocking = false)
+    {
+      struct Text { const char *text; size_t length; } t = {text, length < 0 ? strlen(text) : (size_t) length};
+      const Text *p = &t;
+      std::function<void ()> request = [this, p]() -> void {
+        write_word(0x0018);
+        for (size_t i = 0; i < p->length; i++) write_byte((uint8_t) p->text[i]);
+        write_byte(0);
+      };
+      return invoke<uint16_t>("put_string", log_level, blocking, request,
+                              [this]() -> uint16_t { return read_word(); }, 1);
+    }
+
+    /*
+     * Size in pixels of a character in the current font.  Each is a round trip: measure once and keep
+     *   the answer (diablo::TextLayout does).
+     */
+    uint16_t char_width(char c, LogLevel log_level = LOG_LEVEL_TRACE)
+    { return char_size("char_width", 0x001E, c, log_level); }
+
+    uint16_t char_height(char c, LogLevel log_level = LOG_LEVEL_TRACE)
+    { return char_size("char_height", 0x001D, c, log_level); }
+
+    /*
+     * Text colors.  Each returns the previous setting.
+     */
+    uint16_t text_foreground(uint16_t color, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      std::vector<uint16_t> words = {
+          0xFFE7,
+          color
+      };
+      return invoke_graphics<uint16_t>("text_foreground", log_level, true, words,
+                                       [this]() -> uint16_t { return read_word(); }, 1);
+    }
+
+    uint16_t text_background(uint16_t color, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      std::vector<uint16_t> words = {
+          0xFFE6,
+          color
+      };
+      return invoke_graphics<uint16_t>("text_background", log_level, true, words,
+                                       [this]() -> uint16_t { return read_word(); }, 1);
+    }
+
+    /*
+     * 0 = transparent (only the glyph is drawn), 1 = opaque (the background color fills the cell).
+     * Returns the previous setting.
+     */
+    uint16_t text_opacity(uint16_t opaque, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      std::vector<uint16_t> words = {
+          0xFFDF,
+          opaque
+      };
+      return invoke_graphics<uint16_t>("text_opacity", log_level, true, words,
+                                       [this]() -> uint16_t { return read_word(); }, 1);
+    }
+
+    typedef std::function<void(bool ok, uint16_t foreground, uint16_t background, uint16_t opaque)> TextColorsHandler;
+
+    /*
+     * text_foreground(), text_background() and text_opacity() in one burst: one round trip instead of
+     *   three, and it doesn't wait for it.  done gets the previous settings once they're back (from
+     *   advance(), or the next command), or ok = false if they never came.
+     */
+    void text_colors(uint16_t foreground, uint16_t background, uint16_t opaque, TextColorsHandler done = nullptr,
+                     LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      invoke_burst("text_colors", log_level, false, {{0xFFE7, foreground}, {0xFFE6, background}, {0xFFDF, opaque}}, 1,
+                   [done](bool ok, const std::vector<uint16_t> &previous) {
+                     if (!done) return;
+                     if (ok && previous.size() == 3) done(true, previous[0], previous[1], previous[2]);
+                     else done(false, 0, 0, 0);
+                   });
+    }
+
+    // Font ids for text_font().
+    static const uint16_t FONT_SYSTEM = 0;
+    static const uint16_t FONT_MEDIA = 7;
+
+    /*
+     * Picks the font text gets printed in.  Returns the previous one.
+     * FONT_MEDIA reads the font off the card at the current media address: media_set_sector() to the
+     *   font first.  diablo::Fonts (serial_diablo_fonts.h) does both.
+     */
+    uint16_t text_font(uint16_t id, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      std::vector<uint16_t> words = {
+          0xFFE5,
+          id
+      };
+      return invoke_graphics<uint16_t>("text_font", log_level, true, words,
+                                       [this]() -> uint16_t { return read_word(); }, 1);
+    }
+
+    /////////////////////////////////////    5.3 Media Commands    /////////////////////////////////////
+
+    /*
+     * The Media Init command initialises a uSD/SD/SDHC memory card for further operations.
+     * The SD card is connected to the SPI (serial peripheral interface) of the Diablo16 Processor.
+     *
+     * 5.3.1
+     * True if init successful.
      */
     bool media_init(LogLevel log_level = LOG_LEVEL_INFO)
     {
       std::vector<uint16_t> words = {
           0xFF25
       };
-      return invoke_graphics<bool>("media_init", log_level, true, words,
-                                   [this]() -> bool { return 1 == read_word(); }, 1);
+      bool ok = invoke_graphics<bool>("media_init", log_level, true, words,
+                                      [this]() -> bool { return 1 == read_word(); }, 1);
+      media = ok ? MEDIA_READY : MEDIA_FAILED;
+      return ok;
+    }
+
+    /*
+     * media_init() when it's needed instead of now: card init takes hundreds of ms, and the first
+     *   screen usually doesn't need the card.
+     * The first media command runs media_init() first if it hasn't happened yet.  Until then, advance()
+     *   starts it in the background as soon as the deferral queue runs dry, so it's usually done
+     *   by the time anyone asks.
+     */
+    void media_init_lazy()
+    {
+      if (media != MEDIA_READY) media = MEDIA_WANTED;
+    }
+
+    /*
+     * Whether the card is up: after media_init(), or once a lazy init has finished.
+     */
+    bool media_ready() const
+    {
+      return media == MEDIA_READY;
     }
 
     /*
@@ -497,6 +1294,7 @@ namespace diablo
      */
     void media_set_byte(uint32_t address, LogLevel log_level = LOG_LEVEL_TRACE, bool blocking = false)
     {
+      media_needed();
       std::vector<uint16_t> words = {
           0xFF2F,
           (uint16_t)(address >> 16),
@@ -512,6 +1310,7 @@ namespace diablo
      */
     void media_set_sector(uint32_t address, LogLevel log_level = LOG_LEVEL_TRACE, bool blocking = false)
     {
+      media_needed();
       std::vector<uint16_t> words = {
           0xFF2E,
           (uint16_t)(address >> 16),
@@ -520,6 +1319,70 @@ namespace diablo
       invoke_graphics<AckOnly>("media_set_sector", log_level, blocking, words);
     }
 
+    /*
+     * The Read Sector command reads 512 bytes (256 words) from the uSD card into sector.
+     * After the read the Sect pointer is automatically incremented by 1
+     *
+     * 5.3.4
+     * True if the card came through.
+     */
+    bool media_read_sector(std::vector<uint8_t> &sector, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      media_needed();
+      std::vector<uint16_t> words = {
+          0x0016
+      };
+      return invoke_graphics<bool>("media_read_sector", log_level, true, words,
+                                   [this, &sector]() -> bool {
+                                     bool ok = 0 != read_word();
+                                     sector.resize(512);
+                                     for (uint16_t i = 0; i < 256; i++)
+                                     {
+                                       uint16_t word = read_word();
+                                       sector[2 * i] = word >> 8;
+                                       sector[2 * i + 1] = word & 0xFF;
+                                     }
+                                     return ok && !read_timed_out;
+                                   }, 257);
+    }
+
+    /*
+     * Reads count consecutive sectors starting at address in one pipelined burst: one round trip,
+     *   no matter how many.  Empty if the card (or the Diablo) choked on any of them.
+     *
+     * NOTE:  Each sector is 515 bytes back, way past the Photon's 64 byte receive buffer, so this
+     *   always blocks and reads them off the wire as they arrive.
+     */
+    std::vector<std::vector<uint8_t>> media_read_sectors(uint32_t address,
+                                                         uint16_t count,
+                                                         LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      std::vector<std::vector<uint8_t>> sectors;
+      media_set_sector(address, log_level);
+      std::vector<std::vector<uint16_t>> commands(count, std::vector<uint16_t>(1, 0x0016));
+      invoke_burst("media_read_sectors", log_level, true, commands, 257,
+                   [&sectors, count](bool ok, const std::vector<uint16_t> &responses) {
+                     if (!ok) return;
+                     for (uint16_t s = 0; s < count; s++)
+                     {
+                       const uint16_t *words = &responses[s * 257];
+                       if (words[0] == 0)
+                       {
+                         sectors.clear();
+                         return;
+                       }
+                       std::vector<uint8_t> sector(512);
+                       for (uint16_t i = 0; i < 256; i++)
+                       {
+                         sector[2 * i] = words[1 + i] >> 8;
+                         sector[2 * i + 1] = words[1 + i] & 0xFF;
+                       }
+                       sectors.push_back(sector);
+                     }
+                   });
+      return sectors;
+    }
+
     /*
      * The Write Sector command writes 512 bytes (256 words) from a source memory block into the uSD card.
      * After the write the Sect pointer is automatically incremented by 1
@@ -527,21 +1390,14 @@ namespace diablo
      * 5.3.5
      */
     bool media_write_sector(std::vector<uint8_t> &sector, LogLevel log_level = LOG_LEVEL_TRACE, bool blocking = true)
-    {
-      std::function<void ()> request = [&sector, this]()->void {
-        write_word(0x0017);
-        write_bytes(sector);
-      };
-      bool success;
-      int attempt = 0;
-      do
-      {
-        success = invoke<bool>("media_set_sector", log_level, blocking, request,
-                               [this]() -> bool { return 1 == read_word(); }, 1);
-        attempt ++;
-      } while(blocking && !success && attempt < 10);
-      return success;
-    }
+    { return write_sector(sector.data(), sector.size(), log_level, blocking); }
+
+    /*
+     * Same, straight from 512 bytes of memory: a mapped file, flash, wherever they already are.
+     *   They go to the serial port as one write, no staging copy.
+     */
+    bool media_write_sector(const uint8_t *sector, LogLevel log_level = LOG_LEVEL_TRACE, bool blocking = true)
+    { return write_sector(sector, 512, log_level, blocking); }
 
     /*
      * Displays an image from the media storage at the specified co-ordinates.
@@ -554,6 +1410,7 @@ namespace diablo
      */
     void media_image_raw(uint16_t x, uint16_t y, LogLevel log_level = LOG_LEVEL_TRACE, bool blocking = false)
     {
+      media_needed();
       std::vector<uint16_t> words = {0xFF27,
                                      x, y
       };
@@ -589,16 +1446,494 @@ namespace diablo
       media_image_raw(x, y, log_level, blocking);
     }
 
+    /////////////////////////////////////    5.4 FAT16 File Commands    /////////////////////////////////////
+
+    /*
+     * Mounts the FAT16 file system on the card (file_Mount).  True if it worked.
+     */
+    bool file_mount(LogLevel log_level = LOG_LEVEL_INFO)
+    {
+      media_needed();
+      std::vector<uint16_t> words = {
+          0xFF03
+      };
+      return invoke_graphics<bool>("file_mount", log_level, true, words,
+                                   [this]() -> bool { return 0 != read_word(); }, 1);
+    }
+
+    /*
+     * Loads and runs a 4DGL program (.4XE) off the card (file_Run).
+     *
+     * The serial environment doesn't ACK file_Run until the program exits, and the program owns the serial
+     *   port until then.  So this writes the request and waits for the *program* to say it's listening:
+     *   your program needs to serout(0x06) once it's ready.  True once it has.
+     * Call file_run_result() to collect the real ACK and the return value after the program exits.
+     */
+    bool file_run(const char *filename, const std::vector<uint16_t> &arguments = {}, LogLevel log_level = LOG_LEVEL_INFO)
+    {
+      log.trace("Invoking: file_run");
+      if (!settle())
+      { return false; }
+      unsigned long start = millis();
+      write_word(0x000D);
+      for (const char *c = filename; *c; c++) write_byte((uint8_t) *c);
+      write_byte(0);
+      write_word(arguments.size());
+      for (uint16_t argument : arguments) write_word(argument);
+      flush_writes();
+      previous_command = "file_run";
+      bool ready = ack();
+      log(log_level, "Latency file_run: %dms", (int) (millis() - start));
+      return ready;
+    }
+
+    /*
+     * Waits for a program started by file_run() to exit, and returns what it returned (0xDEAD if it never did).
+     */
+    uint16_t file_run_result(LogLevel log_level = LOG_LEVEL_INFO)
+    {
+      unsigned long start = millis();
+      if (!settle() || !ack())
+      { return 0xDEAD; }
+      uint16_t value = read_word();
+      log(log_level, "Latency file_run_result: %dms", (int) (millis() - start));
+      return value;
+    }
+
+    /////////////////////////////////////    Memory Commands    /////////////////////////////////////
+
+    // System register holding the low / high words of the Diablo16's millisecond timer.
+    // Check the system registers table for your PmmC if the timer reads look like nonsense.
+    static const uint16_t SYSTEM_TIMER_LO = 2;
+    static const uint16_t SYSTEM_TIMER_HI = 3;
+
+    /*
+     * Reads a word from the Diablo16's system memory (peekM).
+     */
+    uint16_t peek_memory(uint16_t address, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      std::vector<uint16_t> words = {
+          0x0027,
+          address
+      };
+      return invoke_graphics<uint16_t>("peek_memory", log_level, true, words,
+                                       [this]() -> uint16_t { return read_word(); }, 1);
+    }
+
+    /*
+     * Reads several words in one pipelined burst, in order.  Empty if the Diablo choked.
+     */
+    std::vector<uint16_t> peek_memory(const std::vector<uint16_t> &addresses, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      std::vector<uint16_t> values;
+      invoke_burst("peek_memory_batch", log_level, true, word_commands(0x0027, addresses), 1,
+                   [&values](bool ok, const std::vector<uint16_t> &responses) { if (ok) values = responses; });
+      return values;
+    }
+
+    /////////////////////////////////////    GPIO Commands    /////////////////////////////////////
+
+    /*
+     * The Set Pin command sets the mode of a spare GPIO pin on the display module.
+     * See the manual for the pin numbers and modes your module supports (pin_Set).
+     *
+     * True if the pin/mode combination was accepted.
+     */
+    bool pin_set(uint16_t mode, uint16_t pin, LogLevel log_level = LOG_LEVEL_INFO)
+    {
+      std::vector<uint16_t> words = {
+          0xFFCF,
+          mode, pin
+      };
+      return invoke_graphics<bool>("pin_set", log_level, true, words,
+                                   [this]() -> bool { return 0 != read_word(); }, 1);
+    }
+
+    /*
+     * Drives an output pin high (pin_HI).
+     * True if the pin is a valid output.
+     */
+    bool pin_hi(uint16_t pin, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      std::vector<uint16_t> words = {
+          0xFFD2,
+          pin
+      };
+      return invoke_graphics<bool>("pin_hi", log_level, true, words,
+                                   [this]() -> bool { return 0 != read_word(); }, 1);
+    }
+
+    /*
+     * Drives an output pin low (pin_LO).
+     * True if the pin is a valid output.
+     */
+    bool pin_lo(uint16_t pin, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      std::vector<uint16_t> words = {
+          0xFFD1,
+          pin
+      };
+      return invoke_graphics<bool>("pin_lo", log_level, true, words,
+                                   [this]() -> bool { return 0 != read_word(); }, 1);
+    }
+
+    /*
+     * Reads an input pin (pin_Read).  0 or 1 for digital pins, the conversion for analogue ones.
+     */
+    uint16_t pin_read(uint16_t pin, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      std::vector<uint16_t> words = {
+          0xFFD0,
+          pin
+      };
+      return invoke_graphics<uint16_t>("pin_read", log_level, true, words,
+                                       [this]() -> uint16_t { return read_word(); }, 1);
+    }
+
+    /*
+     * Reads the 8 bit bus (bus_Read8).  The bus pins need to be inputs.
+     */
+    uint16_t bus_read8(LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      std::vector<uint16_t> words = {
+          0xFF86
+      };
+      return invoke_graphics<uint16_t>("bus_read8", log_level, true, words,
+                                       [this]() -> uint16_t { return read_word(); }, 1);
+    }
+
+    /*
+     * Writes the low 8 bits of bits to the bus (bus_Write8).  The bus pins need to be outputs.
+     */
+    void bus_write8(uint16_t bits, LogLevel log_level = LOG_LEVEL_TRACE, bool blocking = false)
+    {
+      std::vector<uint16_t> words = {
+          0xFF87,
+          bits
+      };
+      invoke_graphics<AckOnly>("bus_write8", log_level, blocking, words);
+    }
+
+    //////////////////////////////////    Batched GPIO    //////////////////////////////////
+    // One pipelined burst per call: every pin command goes out back to back, and the answers are
+    //   collected together.  A 16 button scan costs one round trip instead of 16.
+    //
+    // NOTE:  Each pin_read answer is 3 bytes (ACK + word) and they all arrive at once.
+    //   Photon's Serial1 receive buffer is 64 bytes, so keep async reads to ~20 pins per burst
+    //   or make sure advance() gets called often.
+
+    typedef std::function<void(bool ok, const std::vector<uint16_t> &values)> PinsHandler;
+
+    /*
+     * Reads all the pins in one round trip.  Values come back in the order of pins.
+     * Empty if the Diablo choked.
+     */
+    std::vector<uint16_t> pin_read(const std::vector<uint16_t> &pins, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      std::vector<uint16_t> values;
+      invoke_burst("pin_read_batch", log_level, true, word_commands(0xFFD0, pins), 1,
+                   [&values](bool ok, const std::vector<uint16_t> &responses) { if (ok) values = responses; });
+      return values;
+    }
+
+    /*
+     * Fires off a read of all the pins and returns right away.
+     * done gets the values once they're all back: from advance(), or from the next command, which
+     *   collects them before it goes out.
+     *
+     * diablo->pin_read({BUTTON_UP, BUTTON_DOWN, BUTTON_OK}, [](bool ok, const std::vector<uint16_t> &v) {
+     *   if (ok) handle_buttons(v[0], v[1], v[2]);
+     * });
+     */
+    void pin_read(const std::vector<uint16_t> &pins, PinsHandler done, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      invoke_burst("pin_read_batch", log_level, false, word_commands(0xFFD0, pins), 1, done);
+    }
+
+    /*
+     * Drives a set of output pins high or low, {pin, high} each, in one burst.
+     * Not blocking by default: the ACKs get collected in the background like any other command.
+     */
+    void pin_write(const std::vector<std::pair<uint16_t, bool>> &pins,
+                   LogLevel log_level = LOG_LEVEL_TRACE,
+                   bool blocking = false)
+    {
+      std::vector<std::vector<uint16_t>> commands;
+      commands.reserve(pins.size());
+      for (const auto &pin : pins)
+      { commands.push_back({pin.second ? (uint16_t) 0xFFD2 : (uint16_t) 0xFFD1, pin.first}); }
+      invoke_burst("pin_write_batch", log_level, blocking, commands, 1, nullptr);
+    }
+
+    /*
+     * Sets the mode of a set of pins in one burst.  True if every pin took it.
+     */
+    bool pin_set(uint16_t mode, const std::vector<uint16_t> &pins, LogLevel log_level = LOG_LEVEL_INFO)
+    {
+      std::vector<std::vector<uint16_t>> commands;
+      commands.reserve(pins.size());
+      for (uint16_t pin : pins) commands.push_back({0xFFCF, mode, pin});
+      bool all_ok = false;
+      invoke_burst("pin_set_batch", log_level, true, commands, 1,
+                   [&all_ok](bool ok, const std::vector<uint16_t> &responses) {
+                     all_ok = ok && std::find(responses.begin(), responses.end(), 0) == responses.end();
+                   });
+      return all_ok;
+    }
+
+    /////////////////////////////////////    Touch Commands    /////////////////////////////////////
+
+    // touch_set modes
+    static const uint16_t TOUCH_ENABLE = 0;
+    static const uint16_t TOUCH_DISABLE = 1;
+    static const uint16_t TOUCH_RESET_REGION = 2;
+
+    // touch_get modes
+    static const uint16_t TOUCH_STATUS = 0;
+    static const uint16_t TOUCH_GETX = 1;
+    static const uint16_t TOUCH_GETY = 2;
+
+    // touch_get(TOUCH_STATUS) answers
+    static const uint16_t TOUCH_INVALID = 0;
+    static const uint16_t TOUCH_PRESSED = 1;
+    static const uint16_t TOUCH_RELEASED = 2;
+    static const uint16_t TOUCH_MOVING = 3;
+
+    /*
+     * Only touches inside this window are reported (touch_DetectRegion).
+     * touch_set(TOUCH_RESET_REGION) puts it back to the whole screen.
+     */
+    void touch_detect_region(uint16_t x1,
+                             uint16_t y1,
+                             uint16_t x2,
+                             uint16_t y2,
+                             LogLevel log_level = LOG_LEVEL_TRACE,
+                             bool blocking = false)
+    {
+      std::vector<uint16_t> words = {
+          0xFF39,
+          x1, y1, x2, y2
+      };
+      invoke_graphics<AckOnly>("touch_detect_region", log_level, blocking, words);
+    }
+
+    /*
+     * Enables, disables or resets the touch screen (touch_Set).  Touch is off until you enable it.
+     */
+    void touch_set(uint16_t mode, LogLevel log_level = LOG_LEVEL_INFO, bool blocking = false)
+    {
+      std::vector<uint16_t> words = {
+          0xFF38,
+          mode
+      };
+      invoke_graphics<AckOnly>("touch_set", log_level, blocking, words);
+    }
+
+    /*
+     * Status or coordinates of the last touch (touch_Get).
+     */
+    uint16_t touch_get(uint16_t mode, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      std::vector<uint16_t> words = {
+          0xFF37,
+          mode
+      };
+      return invoke_graphics<uint16_t>("touch_get", log_level, true, words,
+                                       [this]() -> uint16_t { return read_word(); }, 1);
+    }
+
+    typedef std::function<void(bool ok, uint16_t status, uint16_t x, uint16_t y)> TouchHandler;
+
+    /*
+     * Status, x and y in one pipelined burst that doesn't block.
+     * done gets them from advance() or ahead of the next command, same as the async pin_read.
+     */
+    void touch_poll(TouchHandler done, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      invoke_burst("touch_poll", log_level, false, word_commands(0xFF37, {TOUCH_STATUS, TOUCH_GETX, TOUCH_GETY}), 1,
+                   [done](bool ok, const std::vector<uint16_t> &responses) {
+                     if (ok) done(true, responses[0], responses[1], responses[2]);
+                     else done(false, TOUCH_INVALID, 0, 0);
+                   });
+    }
+
+    /////////////////////////////////////    Serial Link    /////////////////////////////////////
+
+    typedef std::function<void(uint32_t baud)> BaudHandler;
+
+    /*
+     * setbaudWait: moves the Diablo to another baud rate.  The ACK comes back at the new rate, so
+     *   host_baud has to move our end in between (Serial1.begin(baud), usually).
+     * Only the manual's rates work, 110 to 600000.  False for anything else, or if no ACK arrived at
+     *   the new rate.  In that case the Diablo could be on either rate; ping() both to find out.
+     *
+     * Whatever the previous command still owed gets written off first: the new rate can't read it.
+     */
+    bool set_baud(uint32_t baud, BaudHandler host_baud, LogLevel log_level = LOG_LEVEL_INFO)
+    {
+      // Diablo16 takes the clock divisor, not an index: 3000000 / baud - 1, rounded.  (The index is Picaso's.)
+      static const struct { uint32_t baud; uint16_t divisor; } rates[] = {
+          {110, 27272}, {300, 9999}, {600, 4999}, {1200, 2499}, {2400, 1249}, {4800, 624}, {9600, 312},
+          {14400, 207}, {19200, 155}, {31250, 95}, {38400, 77}, {56000, 53}, {57600, 51}, {115200, 25},
+          {128000, 22}, {256000, 11}, {300000, 9}, {375000, 7}, {500000, 5}, {600000, 4}};
+      size_t i = 0;
+      while (i < sizeof(rates) / sizeof(rates[0]) && rates[i].baud != baud) i++;
+      if (i == sizeof(rates) / sizeof(rates[0]) || encoder)
+      {
+        log.error("Can't switch to %lu baud", (unsigned long) baud);
+        return false;
+      }
+      settle();
+      resync();
+      std::vector<uint16_t> words = {
+          0x0026,
+          rates[i].divisor
+      };
+      invoke_graphics<AckOnly>("set_baud", log_level, false, words);
+      serial->flush(); // Out of the UART before it changes speed underneath them.
+      host_baud(baud);
+      bool ok = settle();
+      if (!ok) resync();
+      log(ok ? log_level : LOG_LEVEL_ERROR, "Baud %lu: %s", (unsigned long) baud, ok ? "ok" : "no ACK");
+      return ok;
+    }
+
+    /*
+     * Forgets the ACK and responses the previous command still owes, and empties the receive buffer.
+     *   For after a baud change or a glitch that left the two ends out of step.  A burst in
+     *   flight is handed back failed.
+     */
+    void resync()
+    {
+      flush_writes();
+      // Whatever was still owed is written off.
+      if (completed_sequence != sent_sequence) complete(false, sent_sequence);
+      pending_ack = false;
+      outstanding_words = 0;
+      device_time_pending = false;
+      if (burst_pending) finish_burst(false);
+      while (serial->available() > 0) serial->read();
+    }
+
+    /*
+     * True if the Diablo answers a harmless read (its timer) at the current rate.
+     */
+    bool ping(LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      std::vector<uint16_t> words = {
+          0x0027,
+          SYSTEM_TIMER_LO
+      };
+      bool ok = invoke_graphics<bool>("ping", log_level, true, words,
+                                      [this]() -> bool { read_word(); return !read_timed_out; }, 1);
+      if (!ok) resync();
+      return ok;
+    }
+
   private:
     typedef uint8_t AckOnly;
 
-    const Logger log;
+    enum MediaState
+    {
+      MEDIA_UNKNOWN,  // Nobody said: leave it to the app.
+      MEDIA_WANTED,   // media_init_lazy(), not started.
+      MEDIA_STARTING, // media_init out in the background.
+      MEDIA_READY,
+      MEDIA_FAILED
+    };
+    MediaState media = MEDIA_UNKNOWN;
+
+    void start_media_init()
+    {
+      if (encoder) return;
+      media = MEDIA_STARTING;
+      std::vector<std::vector<uint16_t>> commands(1, std::vector<uint16_t>(1, 0xFF25));
+      invoke_burst("media_init", LOG_LEVEL_INFO, false, commands, 1,
+                   [this](bool ok, const std::vector<uint16_t> &responses) {
+                     media = ok && responses[0] == 1 ? MEDIA_READY : MEDIA_FAILED;
+                     if (media == MEDIA_FAILED) log.error("Lazy media_init failed");
+                   });
+    }
+
+    // Top of every media command: finishes a lazy media_init first.
+    void media_needed()
+    {
+      if (media == MEDIA_WANTED) start_media_init();
+      if (media == MEDIA_STARTING) settle();
+    }
+    typedef std::function<void(bool ok, const std::vector<uint16_t> &responses)> BurstHandler;
+
+    DiabloLogger log;
 
     bool pending_ack;
-    uint8_t outstanding_words;
+    unsigned long pending_since = 0;
+    uint16_t outstanding_words;
+    bool read_timed_out = false;
     const char *previous_command = "";
     Stream *serial;
-    std::deque<std::pair<String, Runnable>> request_queue;
+    struct Deferred
+    {
+      String name;
+      Runnable thing;
+      uint32_t queued_at;
+      Scope scope;
+      uint32_t generation;
+      bool urgent;
+    };
+    std::deque<Deferred> request_queue;
+    uint32_t dispatch_queued_at = 0;
+    uint32_t dispatched = 0;
+    uint32_t pace_ms = 0;
+    unsigned long last_dispatch_ms = 0;
+    std::vector<uint32_t> generations = std::vector<uint32_t>(1, 0);
+    uint32_t skipped = 0;
+    uint32_t skipped_since_invalidate = 0;
+    uint32_t invalidated_at = 0;
+    uint32_t first_paint_us = 0;
+    bool first_paint_pending = false;
+    Scope first_paint_scope = GLOBAL_SCOPE;
+
+    bool stale(const Deferred &deferred) const
+    { return deferred.generation != generations[deferred.scope]; }
+    uint32_t coalesced = 0;
+
+    CommandObserver *observer = nullptr;
+    uint32_t bytes_written = 0;
+    CommandEncoder *encoder = nullptr;
+    bool capturing = false;
+    std::vector<uint8_t> captured;
+    // Requests go out in chunks this big rather than a byte at a time: one write() per command, or per
+    //   64 bytes of a big one (the Photon's serial transmit buffer is 64 bytes, more would just block in there).
+    static const uint16_t STAGING_BYTES = 64;
+    uint8_t staging[STAGING_BYTES];
+    uint16_t staged = 0;
+    bool device_time_pending = false;
+
+    // The one pipelined burst allowed in flight.
+    struct Burst
+    {
+      const char *name = "";
+      uint16_t commands = 0;
+      uint16_t received = 0;
+      uint16_t reported = 0; // ACKs handed to the observer.
+      uint16_t response_words = 0;
+      uint32_t first = 0;  // Sequence number of its first command.
+      unsigned long since = 0;
+      std::vector<uint16_t> responses;
+      BurstHandler done;
+    } burst;
+    bool burst_pending = false;
+    uint32_t sent_sequence = 0;
+    uint32_t completed_sequence = 0;
+    uint32_t failed_sequence = 0;
+    // Recent failures, as (after, through] ranges of commands, round robin.
+    struct Failure
+    {
+      uint32_t after;
+      uint32_t through;
+    } failures[FAILURES_REMEMBERED] = {};
+    uint32_t failure_count = 0;
+    bool ack_refused = false; // The last ack() got something that wasn't an ACK, rather than nothing.
 
     static AckOnly no_response()
     { return 0; }
@@ -611,7 +1946,7 @@ namespace diablo
                                               bool blocking,
                                               std::vector <std::vector<uint16_t>> &compound_body,
                                               Responder responder = no_response,
-                                              uint8_t response_words = 0)
+                                              uint16_t response_words = 0)
     {
       std::function<void ()> request = [&compound_body, this]() -> void { write_compound_words(compound_body); };
       return invoke<Response>(name, level, blocking, request, responder, response_words);
@@ -625,46 +1960,67 @@ namespace diablo
                     bool blocking,
                     std::function<void ()> &request,
                     Responder responder = no_response,
-                    uint8_t response_words = 0)
+                    uint16_t response_words = 0)
     {
       log.trace("Invoking: %s", name);
-      unsigned long start = millis();
 
-      // Handle leftover state
-      if (pending_ack)
+      if (encoder)
       {
-        if (!ack())
-        { return Response(); }
-        pending_ack = false;
-        log.trace("Previous command ack. Command: %s, %dms", previous_command, (int) (millis() - start));
-        start = millis();
-      }
-      while (outstanding_words > 0)
-      {
-        uint16_t garbage = read_word();
-        if (garbage == 0xDEAD)
-        {
-          log.error("Error waiting for response from: %s", previous_command);
-          return Response();
-        }
-        outstanding_words--;
+        // Someone else owns the wire: the command goes to the encoder instead.
+        captured.clear();
+        capturing = true;
+        request();
+        capturing = false;
+        if (!encoder->encode(captured.data(), captured.size()))
+        { log.error("Can't encode %s, dropped", name); }
+        return Response();
       }
 
+      // Handle leftover state
+      if (!settle())
+      { return Response(); }
+      unsigned long start = millis();
+      bool stamp = observer && observer->want_device_time(name);
 
       log.trace("Writing request");
+      uint32_t write_start = micros();
+      bytes_written = 0;
       request();
+      uint32_t request_bytes = bytes_written;
+      if (stamp)
+      {
+        // Rides right behind the request, so the Diablo reads its timer the moment this command is done.
+        write_word(0x0027);
+        write_word(SYSTEM_TIMER_LO);
+        device_time_pending = true;
+      }
+      flush_writes();
+      sent_sequence++;
+      if (observer) observer->sent(name, request_bytes, dispatch_queued_at, write_start, micros());
+      previous_command = name;
 
+      bool refused = false;
       if (blocking)
       {
         log.trace("Blocking for ACK");
-        if (!ack())
+        bool ok = ack();
+        if (observer) observer->acked(name, ok, micros());
+        if (ok || ack_refused) complete(ok, sent_sequence);
+        refused = !ok && ack_refused;
+        if (refused)
+        {
+          // A NAK (or noise) is the whole answer: nothing else is coming for this one.
+          resync();
+        }
+        else if (!ok)
         {
           pending_ack = true;
+          pending_since = millis();
         }
       } else
       {
         pending_ack = true;
-        previous_command = name;
+        pending_since = millis();
       }
 
       // Get the response.
@@ -674,22 +2030,228 @@ namespace diablo
       {
         outstanding_words += response_words;
         r = Response();
+      } else if (refused)
+      {
+        r = Response();
       } else
       {
         log.trace("Getting response");
         r = responder();
+        if (device_time_pending) collect_device_time();
       }
       log(level, "Latency %s: %dms", name, (int) (millis() - start));
       return r;
     }
 
+    // Collects whatever the previous command (or burst) still owes us.
+    // False if the Diablo never came through with it.
+    bool settle()
+    {
+      unsigned long start = millis();
+      if (pending_ack)
+      {
+        bool ok = ack();
+        if (observer) observer->acked(previous_command, ok, micros());
+        if (!ok && !ack_refused)
+        { return false; }
+        complete(ok, sent_sequence);
+        if (!ok)
+        {
+          // Refused, so it owes us nothing more: start clean with the next one.
+          resync();
+          return true;
+        }
+        pending_ack = false;
+        log.trace("Previous command ack. Command: %s, %dms", previous_command, (int) (millis() - start));
+      }
+      while (outstanding_words > 0)
+      {
+        read_word();
+        if (read_timed_out)
+        {
+          log.error("Error waiting for response from: %s", previous_command);
+          return false;
+        }
+        outstanding_words--;
+      }
+      if (device_time_pending && !collect_device_time())
+      { return false; }
+      if (burst_pending && !collect_burst(true))
+      { return false; }
+      return true;
+    }
+
+    // The timer read that rode along behind the last command: ACK + 1 word.
+    bool collect_device_time()
+    {
+      device_time_pending = false;
+      if (!ack())
+      { return false; }
+      uint16_t device_ms = read_word();
+      if (read_timed_out)
+      {
+        log.error("Error waiting for device time after: %s", previous_command);
+        return false;
+      }
+      if (observer) observer->device_time(previous_command, device_ms);
+      return true;
+    }
+
+    /*
+     * Writes a run of commands back to back without waiting on any ACKs in between, then collects
+     *   every ACK (+ response_words each) in order.  n commands, one round trip.
+     * blocking:  Collect before returning.  Otherwise the answers trickle in through advance(), or
+     *   get collected before the next command goes out, whichever comes first.
+     * done gets every response word in command order, or ok = false if the Diablo choked partway.
+     */
+    void invoke_burst(const char *name,
+                      LogLevel level,
+                      bool blocking,
+                      const std::vector<std::vector<uint16_t>> &commands,
+                      uint16_t response_words,
+                      BurstHandler done)
+    {
+      log.trace("Invoking burst: %s x%d", name, (int) commands.size());
+      if (encoder)
+      { log.error("Can't encode burst %s, dropped", name); }
+      if (encoder || !settle())
+      {
+        if (done) done(false, std::vector<uint16_t>());
+        return;
+      }
+      unsigned long start = millis();
+      log.trace("Writing burst");
+      uint32_t write_start = micros();
+      for (const std::vector<uint16_t> &command : commands)
+      {
+        for (uint16_t word : command) write_word(word);
+      }
+      flush_writes();
+      if (observer)
+      {
+        // Each one counts on its own, same as if it had been invoked.
+        uint32_t write_end = micros();
+        for (const std::vector<uint16_t> &command : commands)
+        { observer->sent(name, 2 * command.size(), dispatch_queued_at, write_start, write_end); }
+      }
+      burst.name = name;
+      burst.commands = commands.size();
+      burst.received = 0;
+      burst.reported = 0;
+      burst.first = sent_sequence + 1;
+      sent_sequence += commands.size();
+      burst.response_words = response_words;
+      burst.responses.clear();
+      burst.responses.reserve(commands.size() * response_words);
+      burst.done = done;
+      burst.since = millis();
+      burst_pending = true;
+      previous_command = name;
+      if (blocking)
+      { collect_burst(true); }
+      log(level, "Latency %s: %dms", name, (int) (millis() - start));
+    }
+
+    // Pull in whatever part of the outstanding burst has arrived.  True once the whole thing is in.
+    bool collect_burst(bool wait)
+    {
+      while (burst_pending)
+      {
+        if (burst.received == burst.commands)
+        {
+          finish_burst(true);
+          break;
+        }
+        if (!wait && serial->available() < 1 + 2 * burst.response_words)
+        { return false; }
+        bool ok = ack();
+        if (observer) observer->acked(burst.name, ok, micros());
+        burst.reported++;
+        if (!ok)
+        {
+          log.error("Burst %s died after %d of %d", burst.name, (int) burst.received, (int) burst.commands);
+          finish_burst(false);
+          return false;
+        }
+        for (uint16_t i = 0; i < burst.response_words; i++)
+        {
+          // Sector data can be 0xDEAD for real, so go by the timeout rather than the value.
+          uint16_t word = read_word();
+          if (read_timed_out)
+          {
+            log.error("Error waiting for burst response from: %s", burst.name);
+            finish_burst(false);
+            return false;
+          }
+          burst.responses.push_back(word);
+        }
+        burst.received++;
+      }
+      return true;
+    }
+
+    void finish_burst(bool ok)
+    {
+      complete(ok, burst.first + burst.commands - 1);
+      if (observer)
+      {
+        // The ones we never heard back about.
+        for (; burst.reported < burst.commands; burst.reported++) observer->acked(burst.name, false, micros());
+      }
+      burst_pending = false;
+      BurstHandler done = burst.done;
+      burst.done = nullptr;
+      if (done) done(ok, burst.responses);
+    }
+
+    // Commands up to `through` are done with.  A failure marks the last of them, and remembers all
+    //   the ones it could have been: everything since the last completion.
+    void complete(bool ok, uint32_t through)
+    {
+      if (!ok)
+      {
+        failures[failure_count++ % FAILURES_REMEMBERED] = {completed_sequence, through};
+        if ((int32_t) (through - failed_sequence) > 0) failed_sequence = through;
+      }
+      if ((int32_t) (through - completed_sequence) > 0) completed_sequence = through;
+    }
+
+    // One {opcode, argument} command per argument, ready for invoke_burst().
+    static std::vector<std::vector<uint16_t>> word_commands(uint16_t opcode, const std::vector<uint16_t> &arguments)
+    {
+      std::vector<std::vector<uint16_t>> commands;
+      commands.reserve(arguments.size());
+      for (uint16_t argument : arguments) commands.push_back({opcode, argument});
+      return commands;
+    }
+
+    // Poly commands straight out of a caller's array: no vectors, no copies.
+    void invoke_vertices(const char *name,
+                         uint16_t opcode,
+                         const uint16_t *vertices,
+                         uint16_t n,
+                         uint16_t color,
+                         LogLevel level,
+                         bool blocking)
+    {
+      struct Poly { uint16_t opcode; const uint16_t *vertices; uint16_t n; uint16_t color; } poly = {opcode, vertices, n, color};
+      const Poly *p = &poly; // Keeps the capture small enough that std::function doesn't allocate.
+      std::function<void ()> request = [this, p]() -> void {
+        write_word(p->opcode);
+        write_word(p->n);
+        for (uint16_t i = 0; i < 2 * p->n; i++) write_word(p->vertices[i]);
+        write_word(p->color);
+      };
+      invoke<AckOnly>(name, level, blocking, request);
+    }
+
     template<typename Response, typename Responder = std::function < Response()>>
     Response invoke_graphics(const char *name,
                              LogLevel level,
                              bool blocking,
                              std::vector <uint16_t> &request,
                              Responder responder = no_response,
-                             uint8_t response_words = 0)
+                             uint16_t response_words = 0)
     {
       std::vector<std::vector<uint16_t>> compound_request = {request};
       return invoke_graphics_compound_request < Response >
@@ -699,11 +2261,13 @@ namespace diablo
     // Block for ACK byte.
     bool ack()
     {
+      flush_writes();
       static uint8_t timeout_length = 100;
       static uint16_t give_up_length = 1000;
       unsigned long timeout = millis() + timeout_length;
       unsigned long give_up = millis() + give_up_length;
       int response = -1;
+      ack_refused = false;
       do
       {
         if (millis() > timeout)
@@ -723,13 +2287,56 @@ namespace diablo
       } else
       {
         log.error("Failed ack: %d", response);
+        ack_refused = response != -1;
+        if (observer) observer->link_error(previous_command, response);
         return false;
       }
     }
 
     void write_bytes(std::vector<uint8_t> &raw_request)
     {
-      for(uint8_t b : raw_request) serial->write(b);
+      for(uint8_t b : raw_request) write_byte(b);
+    }
+
+    // Big payloads that are already in wire order skip the staging buffer: whatever's staged goes first.
+    void write_raw(const uint8_t *bytes, size_t length)
+    {
+      if (capturing)
+      {
+        captured.insert(captured.end(), bytes, bytes + length);
+        return;
+      }
+      flush_writes();
+      serial->write(bytes, length);
+      bytes_written += length;
+    }
+
+    bool write_sector(const uint8_t *sector, size_t length, LogLevel log_level, bool blocking)
+    {
+      media_needed();
+      std::function<void ()> request = [sector, length, this]()->void {
+        write_word(0x0017);
+        write_raw(sector, length);
+      };
+      bool success;
+      int attempt = 0;
+      do
+      {
+        success = invoke<bool>("media_write_sector", log_level, blocking, request,
+                               [this]() -> bool { return 1 == read_word(); }, 1);
+        attempt ++;
+      } while(blocking && !success && attempt < 10);
+      return success;
+    }
+
+    // charwidth/charheight: the opcode, then the character as one byte.
+    uint16_t char_size(const char *name, uint16_t opcode, char c, LogLevel log_level)
+    {
+      std::function<void ()> request = [opcode, c, this]() -> void {
+        write_word(opcode);
+        write_byte((uint8_t) c);
+      };
+      return invoke<uint16_t>(name, log_level, true, request, [this]() -> uint16_t { return read_word(); }, 1);
     }
 
     void write_compound_words(std::vector<std::vector <uint16_t>> &compound_request)
@@ -749,22 +2356,46 @@ namespace diablo
 
     inline void write_word(uint16_t word)
     {
-      serial->write((uint8_t)(word >> 8));
-      serial->write((uint8_t)(word & 0xFF));
+      write_byte((uint8_t)(word >> 8));
+      write_byte((uint8_t)(word & 0xFF));
+    }
+
+    inline void write_byte(uint8_t b)
+    {
+      if (capturing)
+      { captured.push_back(b); }
+      else
+      {
+        staging[staged++] = b;
+        if (staged == STAGING_BYTES) flush_writes();
+      }
+      bytes_written++;
+    }
+
+    // Hands whatever's staged to the serial port in one write.
+    void flush_writes()
+    {
+      if (staged == 0) return;
+      serial->write(staging, staged);
+      staged = 0;
     }
 
     uint16_t read_word()
     {
+      flush_writes();
       static uint8_t timeout_length = 100;
       static uint16_t give_up_length = 1000;
       unsigned long timeout = millis() + timeout_length;
       unsigned long give_up = millis() + give_up_length;
+      read_timed_out = false;
       while (serial->available() < 2)
       {
         if (millis() > timeout)
         {
           if (millis() > give_up)
           {
+            read_timed_out = true;
+            if (observer) observer->link_error(previous_command, -1);
             return 0xDEAD;
           }
           log.warn("Timing out waiting for response :-(");
@@ -0,0 +1,295 @@
+#pragma once
+
+#include <functional>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "serial_diablo.h"
+
+namespace diablo
+{
+  /*
+   * One thing in an AssetPack.  data points into the pack itself; nothing gets copied out.
+   */
+  struct Asset
+  {
+    const uint8_t *data = nullptr;
+    uint32_t length = 0;   // Bytes.  The pack pads it with zeros out to a whole sector.
+    uint32_t sector = 0;   // Where it starts, in sectors from the start of the pack.
+    uint16_t width = 0;    // Non-zero for pixels: width x height big-endian RGB565, ready for blit.
+    uint16_t height = 0;
+
+    bool valid() const
+    { return data != nullptr; }
+
+    bool is_pixels() const
+    { return width != 0; }
+
+    uint32_t sectors() const
+    { return (length + 511) / 512; }
+  };
+
+  /*
+   * Pre-converted images and uSD payloads, packed into one file that's used where it lies:
+   *   uploads and blits go from the pack's memory straight to the serial port.
+   *
+   *   sector 0:     header  "DAP1", version, entry count, index offset
+   *   index:        16 byte entries sorted by name hash: hash, sector, length, width, height
+   *   the rest:     entries, each starting on a sector boundary and zero padded to the next one
+   *
+   * Everything is little-endian, except pixels, which are big-endian RGB565 - the order they go down
+   *   the wire, and the order media_image_raw wants them in on the card.  tools/asset_pack.py builds them.
+   *
+   * Opening reads the header and nothing else, and find() is a binary search over the index: a
+   *   handful of cache lines (or pages, mapped) whatever the pack's size.
+   *
+   * diablo::AssetPack assets(pack_bytes, sizeof(pack_bytes)); // Or a MappedAssetPack on Linux.
+   * assets.blit(diablo16, assets.find("logo"), 10, 10);
+   * assets.upload(diablo16, assets.find("splash"), 2048);
+   * diablo16.media_image_raw(0, 0, 2048);
+   */
+  class AssetPack
+  {
+  public:
+    // Where the next bytes the pack is about to send live.  MappedAssetPack turns it into madvise().
+    typedef std::function<void(const uint8_t *data, size_t length)> ReadaheadHandler;
+
+    AssetPack() :
+        log("app.diablo.assets")
+    {}
+
+    AssetPack(const void *data, size_t size) :
+        AssetPack()
+    {
+      open(data, size);
+    }
+
+    /*
+     * Points at a pack.  False (and an empty pack) if it isn't one.
+     */
+    bool open(const void *data, size_t size)
+    {
+      bytes = (const uint8_t *) data;
+      length = size;
+      entries = 0;
+      opened = false;
+      if (!bytes || length < HEADER || get32(0) != MAGIC || get16(4) != VERSION)
+      {
+        log.error("Not an asset pack");
+        return false;
+      }
+      uint32_t count = get32(8);
+      uint32_t index = get32(12);
+      if (index < HEADER || index > length || (length - index) / ENTRY < count)
+      {
+        log.error("Asset pack index doesn't fit: %lu entries", (unsigned long) count);
+        return false;
+      }
+      index_at = index;
+      entries = count;
+      opened = true;
+      return true;
+    }
+
+    bool ok() const
+    { return opened; }
+
+    uint32_t size() const
+    { return entries; }
+
+    /*
+     * By name, or by hash(name).  An invalid Asset if it isn't there.
+     */
+    Asset find(const char *name) const
+    { return find(hash(name)); }
+
+    Asset find(uint32_t name_hash) const
+    {
+      uint32_t low = 0;
+      uint32_t high = entries;
+      while (low < high)
+      {
+        uint32_t middle = low + (high - low) / 2;
+        uint32_t h = get32(index_at + middle * ENTRY);
+        if (h == name_hash) return at(middle);
+        if (h < name_hash) low = middle + 1;
+        else high = middle;
+      }
+      return Asset();
+    }
+
+    // The i'th entry, in hash order.
+    Asset at(uint32_t i) const
+    {
+      Asset a;
+      if (i >= entries) return a;
+      size_t entry = index_at + (size_t) i * ENTRY;
+      uint32_t sector = get32(entry + 4);
+      uint32_t asset_length = get32(entry + 8);
+      uint16_t width = get16(entry + 12);
+      uint16_t height = get16(entry + 14);
+      uint64_t end = ((uint64_t) sector + (asset_length + 511) / 512) * 512;
+      if (end > length || (width && (uint32_t) width * height * 2 != asset_length))
+      {
+        log.error("Asset %lu is broken", (unsigned long) i);
+        return a;
+      }
+      a.data = bytes + (size_t) sector * 512;
+      a.length = asset_length;
+      a.sector = sector;
+      a.width = width;
+      a.height = height;
+      return a;
+    }
+
+    /*
+     * Writes the asset to the card from first_sector on, a sector at a time, each straight out of the
+     *   pack.  Blocks; false if the card refused a sector.  media_init() first.
+     */
+    bool upload(Diablo &diablo, const Asset &asset, uint32_t first_sector, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      if (!asset.valid()) return false;
+      uint32_t count = asset.sectors();
+      diablo.media_set_sector(first_sector, log_level);
+      for (uint32_t s = 0; s < count; s++)
+      {
+        if (s % READAHEAD_SECTORS == 0) readahead(asset, s * 512);
+        if (!diablo.media_write_sector(asset.data + (size_t) s * 512, log_level))
+        {
+          log.error("Upload failed at sector %lu of %lu", (unsigned long) s, (unsigned long) count);
+          return false;
+        }
+      }
+      return true;
+    }
+
+    /*
+     * Blits a pixels asset with its top left at x, y.  Big ones go in bands of rows, so the readahead
+     *   for the next band is in flight while this one's on the wire.
+     */
+    bool blit(Diablo &diablo, const Asset &asset, uint16_t x, uint16_t y, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      if (!asset.valid() || !asset.is_pixels()) return false;
+      uint32_t row_bytes = (uint32_t) asset.width * 2;
+      uint16_t band = (uint16_t) std::max<uint32_t>(1, std::min<uint32_t>(asset.height, READAHEAD_BYTES / row_bytes));
+      readahead(asset, 0);
+      for (uint16_t row = 0; row < asset.height; row += band)
+      {
+        uint16_t rows = std::min<uint16_t>(band, asset.height - row);
+        if (row + rows < asset.height) readahead(asset, (uint32_t) (row + rows) * row_bytes);
+        diablo.blit_com_to_display(x, y + row, asset.width, rows, asset.data + (size_t) row * row_bytes, log_level);
+      }
+      return true;
+    }
+
+    void on_readahead(ReadaheadHandler handler)
+    { readahead_handler = handler; }
+
+    // FNV-1a, same as the packer.
+    static uint32_t hash(const char *name)
+    {
+      uint32_t h = 2166136261UL;
+      for (; *name; name++)
+      {
+        h ^= (uint8_t) *name;
+        h *= 16777619UL;
+      }
+      return h;
+    }
+
+  protected:
+    Logger log;
+
+  private:
+    static const uint32_t MAGIC = 0x31504144; // "DAP1"
+    static const uint16_t VERSION = 1;
+    static const size_t HEADER = 16;
+    static const size_t ENTRY = 16;
+    static const uint32_t READAHEAD_BYTES = 32768;
+    static const uint32_t READAHEAD_SECTORS = READAHEAD_BYTES / 512;
+
+    const uint8_t *bytes = nullptr;
+    size_t length = 0;
+    size_t index_at = 0;
+    uint32_t entries = 0;
+    bool opened = false;
+    ReadaheadHandler readahead_handler;
+
+    void readahead(const Asset &asset, uint32_t offset) const
+    {
+      if (!readahead_handler || offset >= asset.length) return;
+      readahead_handler(asset.data + offset, std::min<uint32_t>(READAHEAD_BYTES, asset.length - offset));
+    }
+
+    uint32_t get32(size_t at) const
+    { return bytes[at] | (uint32_t) bytes[at + 1] << 8 | (uint32_t) bytes[at + 2] << 16 | (uint32_t) bytes[at + 3] << 24; }
+
+    uint16_t get16(size_t at) const
+    { return bytes[at] | bytes[at + 1] << 8; }
+  };
+
+#if defined(__linux__)
+  /*
+   * An AssetPack file mapped read only, for a Linux gateway with a few hundred MB of them.  Opening it
+   *   costs the same for 1MB or 1GB: nothing's read until it's touched.
+   *
+   * The mapping is MADV_RANDOM, so looking something up doesn't drag in the kernel's guess at what's
+   *   next, and upload()/blit() ask for the window they're about to send with MADV_WILLNEED instead.
+   *
+   * diablo::MappedAssetPack assets("/opt/panel/assets.pack");
+   * if (!assets.ok()) ...
+   */
+  class MappedAssetPack : public AssetPack
+  {
+  public:
+    explicit MappedAssetPack(const char *path)
+    {
+      int fd = ::open(path, O_RDONLY);
+      if (fd < 0)
+      {
+        log.error("Can't open %s", path);
+        return;
+      }
+      struct stat st;
+      if (fstat(fd, &st) == 0 && st.st_size > 0)
+      {
+        void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped != MAP_FAILED)
+        {
+          memory = mapped;
+          mapped_length = st.st_size;
+          madvise(memory, mapped_length, MADV_RANDOM);
+        }
+      }
+      close(fd);
+      if (!memory) return;
+      on_readahead([](const uint8_t *data, size_t size) {
+        // madvise wants a page aligned start.
+        static const uintptr_t page = sysconf(_SC_PAGESIZE);
+        uintptr_t start = (uintptr_t) data & ~(page - 1);
+        madvise((void *) start, (uintptr_t) data + size - start, MADV_WILLNEED);
+      });
+      open(memory, mapped_length);
+    }
+
+    ~MappedAssetPack()
+    {
+      if (memory) munmap(memory, mapped_length);
+    }
+
+    MappedAssetPack(const MappedAssetPack &) = delete;
+    MappedAssetPack &operator=(const MappedAssetPack &) = delete;
+
+  private:
+    void *memory = nullptr;
+    size_t mapped_length = 0;
+  };
+#endif
+}
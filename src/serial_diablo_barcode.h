@@ -0,0 +1,657 @@
+#pragma once
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "serial_diablo.h"
+
+namespace diablo
+{
+  /*
+   * QR codes and Code 128 barcodes, encoded on the host and drawn as a handful of filled rectangles.
+   *
+   * One draw_rectangle_filled per dark module is thousands of round trips for a QR code.  Here the dark
+   *   modules are covered with merged rectangles (runs along a row, stacked down while they line up, or the
+   *   same thing turned sideways, whichever comes out smaller), over one light rectangle for the background
+   *   and quiet zone, and the lot goes out as a single burst.  A version 5 QR code's 714 dark modules are 303
+   *   rectangles: ~200ms at 200k baud.
+   *
+   * diablo::barcode::Modules code = diablo::barcode::qr("https://service.example.com/unit/42");
+   * diablo::barcode::draw(diablo16, code, 300, 140, 5, 5);
+   *
+   * diablo::barcode::Modules serial = diablo::barcode::code128("SN-001234567");
+   * diablo::barcode::draw(diablo16, serial, 100, 400, 2, 60, 0x0000, 0xFFFF, 10);
+   *
+   * QR is byte mode only (any bytes, UTF-8 is fine), versions 1 - 40.  Code 128 takes printable ASCII and
+   *   switches to code set C for runs of digits.
+   */
+  namespace barcode
+  {
+    /*
+     * A symbol: width x height modules, dark or light.  Code 128 is one row tall.
+     */
+    struct Modules
+    {
+      uint16_t width = 0;
+      uint16_t height = 0;
+      std::vector<uint8_t> dark;
+
+      Modules()
+      {}
+
+      Modules(uint16_t width, uint16_t height) :
+          width(width),
+          height(height),
+          dark((size_t) width * height, 0)
+      {}
+
+      bool empty() const
+      { return dark.empty(); }
+
+      bool operator()(uint16_t x, uint16_t y) const
+      { return dark[(size_t) y * width + x] != 0; }
+
+      void set(uint16_t x, uint16_t y, bool on)
+      { dark[(size_t) y * width + x] = on; }
+    };
+
+    // In modules.
+    struct Rect
+    {
+      uint16_t x;
+      uint16_t y;
+      uint16_t width;
+      uint16_t height;
+    };
+
+    // Error correction: recovers ~7%, 15%, 25%, 30% of the symbol.
+    enum Ecc
+    {
+      LOW, MEDIUM, QUARTILE, HIGH
+    };
+
+    namespace detail
+    {
+      // Index [ecc][version], version 0 unused.  ISO/IEC 18004 table 9.
+      static const int8_t ECC_CODEWORDS_PER_BLOCK[4][41] = {
+          {-1, 7, 10, 15, 20, 26, 18, 20, 24, 30, 18, 20, 24, 26, 30, 22, 24, 28, 30, 28, 28, 28, 28, 30, 30, 26, 28, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30},
+          {-1, 10, 16, 26, 18, 24, 16, 18, 22, 22, 26, 30, 22, 22, 24, 24, 28, 28, 26, 26, 26, 26, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28},
+          {-1, 13, 22, 18, 26, 18, 24, 18, 22, 20, 24, 28, 26, 24, 20, 30, 24, 28, 28, 26, 30, 28, 30, 30, 30, 30, 28, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30},
+          {-1, 17, 28, 22, 16, 22, 28, 26, 26, 24, 28, 24, 28, 22, 24, 24, 30, 28, 28, 26, 28, 30, 24, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30},
+      };
+      static const int8_t ECC_BLOCKS[4][41] = {
+          {-1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 4, 4, 4, 4, 4, 6, 6, 6, 6, 7, 8, 8, 9, 9, 10, 12, 12, 12, 13, 14, 15, 16, 17, 18, 19, 19, 20, 21, 22, 24, 25},
+          {-1, 1, 1, 1, 2, 2, 4, 4, 4, 5, 5, 5, 8, 9, 9, 10, 10, 11, 13, 14, 16, 17, 17, 18, 20, 21, 23, 25, 26, 28, 29, 31, 33, 35, 37, 38, 40, 43, 45, 47, 49},
+          {-1, 1, 1, 2, 2, 4, 4, 6, 6, 8, 8, 8, 10, 12, 16, 12, 17, 16, 18, 21, 20, 23, 23, 25, 27, 29, 34, 34, 35, 38, 40, 43, 45, 48, 51, 53, 56, 59, 62, 65, 68},
+          {-1, 1, 1, 2, 4, 4, 4, 5, 6, 8, 8, 11, 11, 16, 16, 18, 16, 19, 21, 25, 25, 25, 34, 30, 32, 35, 37, 40, 42, 45, 48, 51, 54, 57, 60, 63, 66, 70, 74, 77, 81},
+      };
+      // What the format information calls L, M, Q, H.
+      static const uint8_t ECC_FORMAT_BITS[4] = {1, 0, 3, 2};
+
+      // Modules left for data + error correction once the function patterns are in.
+      inline uint16_t raw_data_modules(uint8_t version)
+      {
+        uint32_t result = (16 * version + 128) * version + 64;
+        if (version >= 2)
+        {
+          uint32_t alignments = version / 7 + 2;
+          result -= (25 * alignments - 10) * alignments - 55;
+          if (version >= 7) result -= 36;
+        }
+        return result;
+      }
+
+      inline uint16_t data_codewords(uint8_t version, Ecc ecc)
+      {
+        return raw_data_modules(version) / 8 - ECC_CODEWORDS_PER_BLOCK[ecc][version] * ECC_BLOCKS[ecc][version];
+      }
+
+      inline std::vector<uint8_t> alignment_positions(uint8_t version)
+      {
+        std::vector<uint8_t> result;
+        if (version == 1) return result;
+        uint8_t alignments = version / 7 + 2;
+        uint8_t step = version == 32 ? 26 : (version * 4 + alignments * 2 + 1) / (alignments * 2 - 2) * 2;
+        result.resize(alignments);
+        result[0] = 6;
+        for (uint8_t i = alignments - 1, position = version * 4 + 10; i >= 1; i--, position -= step) result[i] = position;
+        return result;
+      }
+
+      // GF(2^8) with the QR polynomial, 0x11D.
+      inline uint8_t multiply(uint8_t x, uint8_t y)
+      {
+        uint16_t z = 0;
+        for (int8_t i = 7; i >= 0; i--)
+        {
+          z = (z << 1) ^ ((z >> 7) * 0x11D);
+          z ^= ((y >> i) & 1) * x;
+        }
+        return (uint8_t) z;
+      }
+
+      inline std::vector<uint8_t> reed_solomon_divisor(uint8_t degree)
+      {
+        std::vector<uint8_t> result(degree, 0);
+        result[degree - 1] = 1;
+        uint8_t root = 1;
+        for (uint8_t i = 0; i < degree; i++)
+        {
+          for (uint8_t j = 0; j < degree; j++)
+          {
+            result[j] = multiply(result[j], root);
+            if (j + 1 < degree) result[j] ^= result[j + 1];
+          }
+          root = multiply(root, 0x02);
+        }
+        return result;
+      }
+
+      inline std::vector<uint8_t> reed_solomon_remainder(const uint8_t *data, size_t length, const std::vector<uint8_t> &divisor)
+      {
+        std::vector<uint8_t> result(divisor.size(), 0);
+        for (size_t i = 0; i < length; i++)
+        {
+          uint8_t factor = data[i] ^ result[0];
+          result.erase(result.begin());
+          result.push_back(0);
+          for (size_t j = 0; j < result.size(); j++) result[j] ^= multiply(divisor[j], factor);
+        }
+        return result;
+      }
+
+      class QrBuilder
+      {
+      public:
+        QrBuilder(uint8_t version) :
+            version(version),
+            size(version * 4 + 17),
+            symbol(size, size),
+            function(size, size)
+        {}
+
+        Modules build(const std::vector<uint8_t> &data, Ecc ecc, int8_t mask)
+        {
+          function_patterns(ecc);
+          codewords(interleave(data, ecc));
+          if (mask < 0)
+          {
+            // Try them all, keep the least ugly.
+            uint32_t best = UINT32_MAX;
+            for (uint8_t m = 0; m < 8; m++)
+            {
+              apply_mask(m);
+              format_bits(ecc, m);
+              uint32_t score = penalty();
+              if (score < best)
+              {
+                best = score;
+                mask = m;
+              }
+              apply_mask(m);
+            }
+          }
+          apply_mask(mask);
+          format_bits(ecc, mask);
+          return symbol;
+        }
+
+      private:
+        uint8_t version;
+        uint8_t size;
+        Modules symbol;
+        Modules function;
+
+        void function_module(uint8_t x, uint8_t y, bool dark)
+        {
+          symbol.set(x, y, dark);
+          function.set(x, y, true);
+        }
+
+        void function_patterns(Ecc ecc)
+        {
+          for (uint8_t i = 0; i < size; i++)
+          {
+            function_module(6, i, i % 2 == 0);
+            function_module(i, 6, i % 2 == 0);
+          }
+          finder(3, 3);
+          finder(size - 4, 3);
+          finder(3, size - 4);
+          std::vector<uint8_t> positions = alignment_positions(version);
+          uint8_t last = positions.size() - 1;
+          for (uint8_t i = 0; i < positions.size(); i++)
+          {
+            for (uint8_t j = 0; j < positions.size(); j++)
+            {
+              // Not on top of the finders.
+              if ((i == 0 && j == 0) || (i == 0 && j == last) || (i == last && j == 0)) continue;
+              for (int8_t dy = -2; dy <= 2; dy++)
+              {
+                for (int8_t dx = -2; dx <= 2; dx++)
+                { function_module(positions[i] + dx, positions[j] + dy, std::max(abs(dx), abs(dy)) != 1); }
+              }
+            }
+          }
+          format_bits(ecc, 0); // Placeholder: reserves the area.
+          version_bits();
+        }
+
+        void finder(uint8_t x, uint8_t y)
+        {
+          for (int8_t dy = -4; dy <= 4; dy++)
+          {
+            for (int8_t dx = -4; dx <= 4; dx++)
+            {
+              int16_t fx = x + dx, fy = y + dy;
+              if (fx < 0 || fx >= size || fy < 0 || fy >= size) continue;
+              uint8_t distance = std::max(abs(dx), abs(dy));
+              function_module(fx, fy, distance != 2 && distance != 4);
+            }
+          }
+        }
+
+        void format_bits(Ecc ecc, uint8_t mask)
+        {
+          uint16_t data = ECC_FORMAT_BITS[ecc] << 3 | mask;
+          uint16_t remainder = data;
+          for (uint8_t i = 0; i < 10; i++) remainder = (remainder << 1) ^ ((remainder >> 9) * 0x537);
+          uint16_t bits = (data << 10 | remainder) ^ 0x5412;
+          auto bit = [bits](uint8_t i) { return ((bits >> i) & 1) != 0; };
+          for (uint8_t i = 0; i <= 5; i++) function_module(8, i, bit(i));
+          function_module(8, 7, bit(6));
+          function_module(8, 8, bit(7));
+          function_module(7, 8, bit(8));
+          for (uint8_t i = 9; i < 15; i++) function_module(14 - i, 8, bit(i));
+          for (uint8_t i = 0; i < 8; i++) function_module(size - 1 - i, 8, bit(i));
+          for (uint8_t i = 8; i < 15; i++) function_module(8, size - 15 + i, bit(i));
+          function_module(8, size - 8, true);
+        }
+
+        void version_bits()
+        {
+          if (version < 7) return;
+          uint32_t remainder = version;
+          for (uint8_t i = 0; i < 12; i++) remainder = (remainder << 1) ^ ((remainder >> 11) * 0x1F25);
+          uint32_t bits = (uint32_t) version << 12 | remainder;
+          for (uint8_t i = 0; i < 18; i++)
+          {
+            bool dark = ((bits >> i) & 1) != 0;
+            uint8_t a = size - 11 + i % 3, b = i / 3;
+            function_module(a, b, dark);
+            function_module(b, a, dark);
+          }
+        }
+
+        // Splits into blocks, appends each block's error correction, interleaves.
+        std::vector<uint8_t> interleave(const std::vector<uint8_t> &data, Ecc ecc)
+        {
+          uint8_t blocks = ECC_BLOCKS[ecc][version];
+          uint8_t ecc_length = ECC_CODEWORDS_PER_BLOCK[ecc][version];
+          uint16_t raw_codewords = raw_data_modules(version) / 8;
+          uint8_t short_blocks = blocks - raw_codewords % blocks;
+          uint16_t short_length = raw_codewords / blocks;
+          std::vector<uint8_t> divisor = reed_solomon_divisor(ecc_length);
+          std::vector<std::vector<uint8_t>> split;
+          size_t k = 0;
+          for (uint8_t i = 0; i < blocks; i++)
+          {
+            size_t length = short_length - ecc_length + (i < short_blocks ? 0 : 1);
+            std::vector<uint8_t> block(data.begin() + k, data.begin() + k + length);
+            std::vector<uint8_t> check = reed_solomon_remainder(&data[k], length, divisor);
+            k += length;
+            if (i < short_blocks) block.push_back(0); // Spacer, skipped below.
+            block.insert(block.end(), check.begin(), check.end());
+            split.push_back(block);
+          }
+          std::vector<uint8_t> result;
+          result.reserve(raw_codewords);
+          for (size_t i = 0; i < split[0].size(); i++)
+          {
+            for (uint8_t j = 0; j < blocks; j++)
+            {
+              if (i != (size_t) (short_length - ecc_length) || j >= short_blocks) result.push_back(split[j][i]);
+            }
+          }
+          return result;
+        }
+
+        // Two module wide columns, zigzagging up and down from the bottom right.
+        void codewords(const std::vector<uint8_t> &data)
+        {
+          size_t i = 0;
+          for (int16_t right = size - 1; right >= 1; right -= 2)
+          {
+            if (right == 6) right = 5; // Hop the vertical timing pattern.
+            for (uint8_t vertical = 0; vertical < size; vertical++)
+            {
+              for (uint8_t j = 0; j < 2; j++)
+              {
+                uint8_t x = right - j;
+                bool upward = ((right + 1) & 2) == 0;
+                uint8_t y = upward ? size - 1 - vertical : vertical;
+                if (function(x, y) || i >= data.size() * 8) continue;
+                symbol.set(x, y, ((data[i >> 3] >> (7 - (i & 7))) & 1) != 0);
+                i++;
+              }
+            }
+          }
+        }
+
+        // XOR, so doing it twice undoes it.
+        void apply_mask(uint8_t mask)
+        {
+          for (uint8_t y = 0; y < size; y++)
+          {
+            for (uint8_t x = 0; x < size; x++)
+            {
+              bool invert;
+              switch (mask)
+              {
+                case 0: invert = (x + y) % 2 == 0; break;
+                case 1: invert = y % 2 == 0; break;
+                case 2: invert = x % 3 == 0; break;
+                case 3: invert = (x + y) % 3 == 0; break;
+                case 4: invert = (x / 3 + y / 2) % 2 == 0; break;
+                case 5: invert = x * y % 2 + x * y % 3 == 0; break;
+                case 6: invert = (x * y % 2 + x * y % 3) % 2 == 0; break;
+                default: invert = ((x + y) % 2 + x * y % 3) % 2 == 0; break;
+              }
+              if (invert && !function(x, y)) symbol.set(x, y, !symbol(x, y));
+            }
+          }
+        }
+
+        // ISO/IEC 18004 7.8.3: long runs, 2x2 blocks, finder lookalikes, dark/light imbalance.
+        uint32_t penalty() const
+        {
+          uint32_t result = 0;
+          uint32_t dark = 0;
+          for (uint8_t pass = 0; pass < 2; pass++)
+          {
+            for (uint8_t a = 0; a < size; a++)
+            {
+              auto at = [this, pass, a](uint8_t b) { return pass == 0 ? symbol(b, a) : symbol(a, b); };
+              uint8_t run = 0;
+              bool previous = false;
+              uint16_t window = 0;
+              for (uint8_t b = 0; b < size; b++)
+              {
+                bool here = at(b);
+                if (b > 0 && here == previous)
+                { run++; }
+                else
+                {
+                  if (run >= 5) result += run - 2;
+                  run = 1;
+                }
+                previous = here;
+                window = ((window << 1) | here) & 0x7FF;
+                if (b >= 10 && (window == 0x5D0 || window == 0x05D)) result += 40;
+                if (pass == 0 && here) dark++;
+              }
+              if (run >= 5) result += run - 2;
+            }
+          }
+          for (uint8_t y = 0; y + 1 < size; y++)
+          {
+            for (uint8_t x = 0; x + 1 < size; x++)
+            {
+              bool c = symbol(x, y);
+              if (c == symbol(x + 1, y) && c == symbol(x, y + 1) && c == symbol(x + 1, y + 1)) result += 3;
+            }
+          }
+          uint32_t total = (uint32_t) size * size;
+          result += 10 * ((uint32_t) abs((int32_t) (dark * 20) - (int32_t) (total * 10)) / total);
+          return result;
+        }
+      };
+
+      // Widths of bar, space, bar, space, bar, space: 11 modules each.  106 is stop (+ final bar).
+      static const char CODE128_PATTERNS[107][7] = {
+          "212222", "222122", "222221", "121223", "121322", "131222", "122213", "122312", "132212", "221213",
+          "221312", "231212", "112232", "122132", "122231", "113222", "123122", "123221", "223211", "221132",
+          "221231", "213212", "223112", "312131", "311222", "321122", "321221", "312212", "322112", "322211",
+          "212123", "212321", "232121", "111323", "131123", "131321", "112313", "132113", "132311", "211313",
+          "231113", "231311", "112133", "112331", "132131", "113123", "113321", "133121", "313121", "211331",
+          "231131", "213113", "213311", "213131", "311123", "311321", "331121", "312113", "312311", "332111",
+          "314111", "221411", "431111", "111224", "111422", "121124", "121421", "141122", "141221", "112214",
+          "112412", "122114", "122411", "142112", "142211", "241211", "221114", "413111", "241112", "134111",
+          "111242", "121142", "121241", "114212", "124112", "124211", "411212", "421112", "421211", "212141",
+          "214121", "412121", "111143", "111341", "131141", "114113", "114311", "411113", "411311", "113141",
+          "114131", "311141", "411131", "211412", "211214", "211232", "233111",
+      };
+      static const uint8_t CODE128_CODE_B = 100;
+      static const uint8_t CODE128_CODE_C = 99;
+      static const uint8_t CODE128_START_B = 104;
+      static const uint8_t CODE128_START_C = 105;
+      static const uint8_t CODE128_STOP = 106;
+
+      inline size_t digits_at(const char *text, size_t i)
+      {
+        size_t n = 0;
+        while (text[i + n] >= '0' && text[i + n] <= '9') n++;
+        return n;
+      }
+    }
+
+    /*
+     * QR code for length bytes of data.  Empty if it doesn't fit in max_version.
+     * Picks the smallest version that fits.  mask = -1 picks the mask by the standard's penalty score.
+     */
+    inline Modules qr(const uint8_t *data,
+                      size_t length,
+                      Ecc ecc = MEDIUM,
+                      uint8_t min_version = 1,
+                      uint8_t max_version = 40,
+                      int8_t mask = -1)
+    {
+      uint8_t version = std::max<uint8_t>(min_version, 1);
+      for (; version <= std::min<uint8_t>(max_version, 40); version++)
+      {
+        uint8_t count_bits = version <= 9 ? 8 : 16;
+        if (length < (1u << count_bits) && 4 + count_bits + length * 8 <= detail::data_codewords(version, ecc) * 8u) break;
+      }
+      if (version > std::min<uint8_t>(max_version, 40)) return Modules();
+
+      // Byte mode: 0100, count, bytes.  Then terminator, padding to a byte, pad codewords.
+      uint16_t capacity = detail::data_codewords(version, ecc);
+      std::vector<uint8_t> codewords(capacity, 0);
+      uint32_t bit = 0;
+      auto append = [&codewords, &bit](uint32_t value, uint8_t bits) {
+        for (int8_t i = bits - 1; i >= 0; i--, bit++)
+        { codewords[bit >> 3] |= ((value >> i) & 1) << (7 - (bit & 7)); }
+      };
+      append(0x4, 4);
+      append(length, version <= 9 ? 8 : 16);
+      for (size_t i = 0; i < length; i++) append(data[i], 8);
+      bit += std::min<uint32_t>(4, capacity * 8 - bit);
+      bit = (bit + 7) & ~7u;
+      for (uint8_t pad = 0xEC; bit < capacity * 8u; pad ^= 0xEC ^ 0x11) append(pad, 8);
+
+      return detail::QrBuilder(version).build(codewords, ecc, mask);
+    }
+
+    inline Modules qr(const char *text, Ecc ecc = MEDIUM, uint8_t min_version = 1, uint8_t max_version = 40)
+    { return qr((const uint8_t *) text, strlen(text), ecc, min_version, max_version); }
+
+    /*
+     * Code 128, one row of modules with the 10 module quiet zones left to draw().
+     * Empty if text has anything outside printable ASCII.
+     * Runs of digits go in code set C (two digits a symbol) when that's shorter: 4+ at either end, 6+ inside.
+     */
+    inline Modules code128(const char *text)
+    {
+      std::vector<uint8_t> values;
+      size_t length = strlen(text);
+      bool c = false;
+      for (size_t i = 0; i < length;)
+      {
+        size_t digits = detail::digits_at(text, i);
+        bool edge = i == 0 || i + digits == length;
+        if (digits >= (edge ? 4u : 6u) || (c && digits >= 2))
+        {
+          // An odd run spends its first digit in B so C gets pairs; at the end, the last one instead.
+          if (digits % 2 && i == 0 && digits != length)
+          { digits--; }
+          else if (digits % 2)
+          {
+            if (!c)
+            {
+              if (values.empty()) values.push_back(detail::CODE128_START_B);
+              values.push_back(text[i] - 32);
+              i++;
+            }
+            digits--;
+          }
+          if (!c) values.push_back(values.empty() ? detail::CODE128_START_C : detail::CODE128_CODE_C);
+          c = true;
+          for (size_t end = i + digits; i < end; i += 2) values.push_back((text[i] - '0') * 10 + text[i + 1] - '0');
+          continue;
+        }
+        uint8_t ch = (uint8_t) text[i];
+        if (ch < 32 || ch > 127) return Modules();
+        if (values.empty())
+        { values.push_back(detail::CODE128_START_B); }
+        else if (c)
+        { values.push_back(detail::CODE128_CODE_B); }
+        c = false;
+        values.push_back(ch - 32);
+        i++;
+      }
+      if (values.empty()) values.push_back(detail::CODE128_START_B);
+
+      uint32_t checksum = values[0];
+      for (size_t i = 1; i < values.size(); i++) checksum += i * values[i];
+      values.push_back(checksum % 103);
+      values.push_back(detail::CODE128_STOP);
+
+      std::vector<uint8_t> widths;
+      for (uint8_t value : values)
+      {
+        for (const char *w = detail::CODE128_PATTERNS[value]; *w; w++) widths.push_back(*w - '0');
+      }
+      widths.push_back(2); // Stop's final bar.
+      uint16_t total = 0;
+      for (uint8_t w : widths) total += w;
+      Modules symbol(total, 1);
+      uint16_t x = 0;
+      for (size_t i = 0; i < widths.size(); i++)
+      {
+        for (uint8_t j = 0; j < widths[i]; j++, x++) symbol.set(x, 0, i % 2 == 0);
+      }
+      return symbol;
+    }
+
+    /*
+     * Covers the dark modules with rectangles.
+     * Runs along each row, stacked onto the rectangle above when they line up exactly; then the same
+     *   with columns and rows swapped.  Keeps whichever needed fewer.  Not the minimum cover (that's
+     *   a hard problem), but QR codes come out at roughly a third of their dark module count.
+     */
+    inline std::vector<Rect> rectangles(const Modules &symbol)
+    {
+      auto cover = [&symbol](bool transpose) {
+        uint16_t across = transpose ? symbol.height : symbol.width;
+        uint16_t down = transpose ? symbol.width : symbol.height;
+        auto at = [&symbol, transpose](uint16_t a, uint16_t d) { return transpose ? symbol(d, a) : symbol(a, d); };
+        std::vector<Rect> result;
+        std::vector<size_t> open; // Rects from the previous line that could still grow.
+        for (uint16_t d = 0; d < down; d++)
+        {
+          std::vector<size_t> next_open;
+          uint16_t a = 0;
+          while (a < across)
+          {
+            if (!at(a, d))
+            {
+              a++;
+              continue;
+            }
+            uint16_t end = a;
+            while (end < across && at(end, d)) end++;
+            bool grown = false;
+            for (size_t index : open)
+            {
+              Rect &above = result[index];
+              if (above.x == a && above.width == end - a)
+              {
+                above.height++;
+                next_open.push_back(index);
+                grown = true;
+                break;
+              }
+            }
+            if (!grown)
+            {
+              result.push_back({a, d, (uint16_t) (end - a), 1});
+              next_open.push_back(result.size() - 1);
+            }
+            a = end;
+          }
+          open.swap(next_open);
+        }
+        if (transpose)
+        {
+          for (Rect &r : result)
+          {
+            std::swap(r.x, r.y);
+            std::swap(r.width, r.height);
+          }
+        }
+        return result;
+      };
+      std::vector<Rect> rows = cover(false);
+      if (symbol.height == 1) return rows;
+      std::vector<Rect> columns = cover(true);
+      return columns.size() < rows.size() ? columns : rows;
+    }
+
+    /*
+     * Draws a symbol with its top left module at x, y, module_width x module_height pixels a module.
+     * quiet = light modules of margin all round (QR wants 4, Code 128 wants 10 on the sides); the margin
+     *   and every light module come from one light rectangle, drawn first, so whatever was underneath
+     *   doesn't matter.  The dark rectangles follow in one burst.
+     * Returns how many dark rectangles that took.  0, and nothing drawn, if the quiet zone would hang off
+     *   the top or left of the screen (or the symbol off 65535): a code without its margin won't scan anyway.
+     */
+    inline uint16_t draw(Diablo &diablo,
+                         const Modules &symbol,
+                         uint16_t x,
+                         uint16_t y,
+                         uint16_t module_width,
+                         uint16_t module_height,
+                         uint16_t dark = 0x0000,
+                         uint16_t light = 0xFFFF,
+                         uint16_t quiet = 4,
+                         LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      if (symbol.empty()) return 0;
+      uint16_t vertical_quiet = symbol.height == 1 ? 0 : quiet;
+      if ((uint32_t) quiet * module_width > x || (uint32_t) vertical_quiet * module_height > y ||
+          x + ((uint32_t) symbol.width + quiet) * module_width > 0x10000 ||
+          y + ((uint32_t) symbol.height + vertical_quiet) * module_height > 0x10000)
+      { return 0; }
+      diablo.draw_rectangle_filled(x - quiet * module_width,
+                                   y - vertical_quiet * module_height,
+                                   x + (symbol.width + quiet) * module_width - 1,
+                                   y + (symbol.height + vertical_quiet) * module_height - 1,
+                                   light, log_level);
+      std::vector<Rect> cover = rectangles(symbol);
+      std::vector<uint16_t> corners;
+      corners.reserve(cover.size() * 4);
+      for (const Rect &r : cover)
+      {
+        corners.push_back(x + r.x * module_width);
+        corners.push_back(y + r.y * module_height);
+        corners.push_back(x + (r.x + r.width) * module_width - 1);
+        corners.push_back(y + (r.y + r.height) * module_height - 1);
+      }
+      diablo.draw_rectangles_filled(corners.data(), cover.size(), dark, log_level);
+      return cover.size();
+    }
+  }
+}
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+
+#include "serial_diablo.h"
+
+namespace diablo
+{
+  /*
+   * When to give up on a baud rate, and when to try the next one up again.
+   */
+  struct BaudPolicy
+  {
+    // Errors are counted over the last `window` commands.
+    uint16_t window = 200;
+    // Step down when more than this fraction of them had an error...
+    float max_error_rate = 0.02f;
+    // ...or this many in a row did: a rate that doesn't work at all shouldn't take a whole window to notice.
+    uint8_t max_consecutive = 3;
+    // No verdict on the error rate until a rate has carried this many commands.
+    uint16_t min_commands = 50;
+    // Clean time at a rate before probing the next one up.  Doubles every time a probe fails.
+    uint32_t probe_ms = 60000;
+    uint32_t max_probe_ms = 3600000;
+  };
+
+  /*
+   * How the link has done at one rate, ever.
+   */
+  struct BaudStats
+  {
+    uint32_t baud = 0;
+    uint32_t ms = 0;           // Time spent at it.
+    uint32_t commands = 0;
+    uint32_t bytes = 0;
+    uint32_t errors = 0;       // Commands that got a NAK, garbage or a timeout.
+    uint16_t switches = 0;     // Times we moved to it.
+    uint16_t failed_switches = 0;
+
+    // Request bytes per second while at this rate: how much actually got through, not the line rate.
+    uint32_t throughput() const
+    { return ms ? (uint32_t) ((uint64_t) bytes * 1000 / ms) : 0; }
+
+    float error_rate() const
+    { return commands ? (float) errors / commands : 0; }
+  };
+
+  /*
+   * Moves the link down a baud rate when it gets noisy, and back up when it's had a quiet spell.
+   *
+   * It watches every command for errors (failed ACKs, NAKs, timeouts) over a sliding window.
+   *   Past the error rate, update() coordinates a switch to the next rate down with set_baud():
+   *   the Diablo first, then our end through host_baud.  After probe_ms clean at a rate, it tries
+   *   the next one up.  A probe that fails drops straight back down and doubles the wait before
+   *   the next one, so a cable that really can't do 600k isn't hammered with attempts every minute.
+   *
+   * It's a CommandObserver, and passes everything through to `next`, so metrics keep working:
+   *
+   * diablo::Metrics metrics(600000);
+   * diablo::AdaptiveBaud link(diablo16, {600000, 500000, 375000, 256000, 115200}, 600000,
+   *                           [](uint32_t baud) { Serial1.begin(baud); metrics.set_baud(baud); },
+   *                           diablo::BaudPolicy(), &metrics);
+   * diablo16.observe(&link);
+   *
+   * void loop()
+   * {
+   *   diablo16.advance();
+   *   link.update();
+   * }
+   *
+   * link.print(Log) has throughput and error rate for every rate it's been on.
+   *
+   * NOTE:  A switch blocks for a round trip at each end of it, and longer if it goes wrong (set_baud
+   *   and then ping() on both rates to find the Diablo).  update() only starts one when nothing's in flight.
+   */
+  class AdaptiveBaud : public CommandObserver
+  {
+  public:
+    AdaptiveBaud(Diablo &diablo,
+                 std::vector<uint32_t> rates,
+                 uint32_t current,
+                 Diablo::BaudHandler host_baud,
+                 BaudPolicy policy = BaudPolicy(),
+                 CommandObserver *next = nullptr) :
+        log("app.diablo.baud"),
+        diablo(&diablo),
+        host_baud(host_baud),
+        policy(policy),
+        next(next),
+        outcomes(std::max<uint16_t>(policy.window, 1)),
+        probe_ms(policy.probe_ms)
+    {
+      std::sort(rates.begin(), rates.end(), [](uint32_t a, uint32_t b) { return a > b; });
+      for (uint32_t baud : rates)
+      {
+        by_rate.push_back(BaudStats());
+        by_rate.back().baud = baud;
+        if (baud == current) at = by_rate.size() - 1;
+      }
+      if (by_rate.empty() || by_rate[at].baud != current) log.error("%lu baud isn't one of the rates", (unsigned long) current);
+      since = last_update = millis();
+    }
+
+    // Call from loop().
+    void update()
+    {
+      unsigned long now = millis();
+      if (by_rate.empty()) return;
+      by_rate[at].ms += now - last_update;
+      last_update = now;
+      if (diablo->busy()) return;
+
+      if (failing())
+      {
+        if (probing) probe_ms = std::min(probe_ms * 2, policy.max_probe_ms);
+        probing = false;
+        if (at + 1 < by_rate.size())
+        {
+          log.warn("%d%% errors at %lu baud, stepping down", (int) (100 * error_rate()), (unsigned long) by_rate[at].baud);
+          shift(at + 1);
+        }
+        else
+        { reset_window(); } // Nowhere lower to go.
+        return;
+      }
+      if (probing && count >= policy.min_commands)
+      {
+        log.info("%lu baud holding up", (unsigned long) by_rate[at].baud);
+        probing = false;
+        probe_ms = policy.probe_ms;
+      }
+      if (!probing && at > 0 && now - since >= probe_ms && count >= policy.min_commands &&
+          error_rate() <= policy.max_error_rate / 2)
+      {
+        log.info("Probing %lu baud", (unsigned long) by_rate[at - 1].baud);
+        probing = shift(at - 1);
+      }
+    }
+
+    uint32_t baud() const
+    { return by_rate.empty() ? 0 : by_rate[at].baud; }
+
+    // Errors over the window at the current rate.
+    float error_rate() const
+    { return count ? (float) errors / count : 0; }
+
+    // Fastest first.
+    const std::vector<BaudStats> &stats() const
+    { return by_rate; }
+
+    void print(const Logger &out, LogLevel level = LOG_LEVEL_INFO) const
+    {
+      for (const BaudStats &s : by_rate)
+      {
+        if (s.commands == 0 && s.switches == 0) continue;
+        out(level, "%s%lu baud: %lus, %lu B/s, %lu commands, %lu errors (%d.%02d%%), %u switches (%u failed)",
+            &s == &by_rate[at] ? "*" : "", (unsigned long) s.baud, (unsigned long) (s.ms / 1000),
+            (unsigned long) s.throughput(), (unsigned long) s.commands, (unsigned long) s.errors,
+            (int) (s.error_rate() * 100), (int) (s.error_rate() * 10000) % 100, s.switches, s.failed_switches);
+      }
+    }
+
+    ////////////////////////////////////    CommandObserver    ////////////////////////////////////
+    void sent(const char *name, uint32_t bytes, uint32_t queued_at, uint32_t write_start, uint32_t write_end) override
+    {
+      if (!by_rate.empty())
+      {
+        // A command that went through clean breaks the run of errors.
+        if (count > 0 && !outcomes[newest()]) consecutive = 0;
+        if (count == outcomes.size()) errors -= outcomes[head];
+        else count++;
+        outcomes[head] = 0;
+        head = (head + 1) % outcomes.size();
+        by_rate[at].commands++;
+        by_rate[at].bytes += bytes;
+      }
+      if (next) next->sent(name, bytes, queued_at, write_start, write_end);
+    }
+
+    void acked(const char *name, bool ok, uint32_t at_us) override
+    {
+      if (next) next->acked(name, ok, at_us);
+    }
+
+    bool want_device_time(const char *name) override
+    { return next && next->want_device_time(name); }
+
+    void device_time(const char *name, uint16_t device_ms) override
+    {
+      if (next) next->device_time(name, device_ms);
+    }
+
+    // Lands on the latest command sent: its ACK and response are collected before the next one goes.
+    void link_error(const char *name, int response) override
+    {
+      // A stuck ACK fails every command after it without sending them, so each failure counts toward the run.
+      consecutive++;
+      if (count > 0 && !outcomes[newest()])
+      {
+        outcomes[newest()] = 1;
+        errors++;
+        by_rate[at].errors++;
+      }
+      if (next) next->link_error(name, response);
+    }
+
+  private:
+    Logger log;
+    Diablo *diablo;
+    Diablo::BaudHandler host_baud;
+    BaudPolicy policy;
+    CommandObserver *next;
+    std::vector<BaudStats> by_rate;
+    size_t at = 0;
+    std::vector<uint8_t> outcomes; // 1 = that command had an error.
+    uint16_t head = 0;
+    uint16_t count = 0;
+    uint16_t errors = 0;
+    uint8_t consecutive = 0;
+    bool probing = false;
+    uint32_t probe_ms;
+    unsigned long since;
+    unsigned long last_update;
+
+    uint16_t newest() const
+    { return (head + outcomes.size() - 1) % outcomes.size(); }
+
+    bool failing() const
+    {
+      return consecutive >= policy.max_consecutive ||
+             (count >= policy.min_commands && error_rate() > policy.max_error_rate);
+    }
+
+    void reset_window()
+    {
+      head = count = errors = consecutive = 0;
+      since = millis();
+    }
+
+    // Moves both ends to by_rate[to].  If the Diablo didn't ACK, find out which rate it's on.
+    bool shift(size_t to)
+    {
+      size_t from = at;
+      by_rate[to].switches++;
+      bool moved = diablo->set_baud(by_rate[to].baud, host_baud);
+      if (!moved && !diablo->ping())
+      {
+        host_baud(by_rate[from].baud);
+        if (!diablo->ping())
+        {
+          // Neither answers: leave our end where it was and let the errors bring us back here.
+          log.error("Lost the Diablo switching %lu -> %lu baud", (unsigned long) by_rate[from].baud,
+                    (unsigned long) by_rate[to].baud);
+        }
+        by_rate[to].failed_switches++;
+      }
+      else
+      { moved = true; }
+      at = moved ? to : from;
+      reset_window();
+      return moved;
+    }
+  };
+}
@@ -0,0 +1,411 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <vector>
+
+#include "serial_diablo.h"
+#include "serial_diablo_cost.h"
+#include "serial_diablo_metrics.h"
+
+namespace diablo
+{
+  /*
+   * Benchmarks for defer() / advance(): synthetic workloads against a simulated link, in virtual time.
+   *
+   * Change something in the deferral queue, run the suite before and after, diff the output.  Everything
+   *   but the enqueue cost runs on the simulated clock from a fixed seed, so the same build prints the
+   *   same numbers every time.  Enqueue cost is real CPU time on whatever runs it.
+   *
+   * diablo::bench::run_suite(Log);
+   *
+   * or one workload of your own:
+   *
+   * diablo::bench::Workload w;
+   * w.keys = 512;
+   * w.updates_per_second = 3000;
+   * w.expensive_fraction = 0.2f;
+   * diablo::bench::run(w).print(Log);
+   */
+  namespace bench
+  {
+    /*
+     * A Diablo16 on the end of a serial link, on a virtual clock.
+     *
+     * Commands are decoded with a RecordingStream.  Bytes cross the wire at the baud rate (8N1),
+     *   the Diablo runs each command once it has all of it (and has finished the last one) for as long
+     *   as its fill takes, then the ACK and response bytes come back at the baud rate.
+     * Nothing moves unless you advance_to().  Except: something spinning on available() is blocked
+     *   waiting for the Diablo (a blocking command, say), so after SPIN_POLLS empty polls in a row
+     *   the clock skips ahead to the next byte.
+     */
+    class SimulatedLink : public Stream
+    {
+    public:
+      static const uint32_t SPIN_POLLS = 10000;
+
+      explicit SimulatedLink(uint32_t baud, uint16_t screen_width = 800, uint16_t screen_height = 480) :
+          baud(baud),
+          byte_ns(10000000000ULL / baud),
+          recorder(screen_width, screen_height)
+      {}
+
+      uint64_t now_ns() const
+      { return now; }
+
+      uint32_t now_us() const
+      { return (uint32_t) (now / 1000); }
+
+      void advance_to_us(uint32_t us)
+      {
+        uint64_t ns = (uint64_t) us * 1000;
+        if (ns > now) now = ns;
+        idle_polls = 0;
+      }
+
+      // Commands the Diablo has been sent.
+      size_t commands() const
+      { return acks.size(); }
+
+      // When command index's ACK lands back on the host, in virtual micros.
+      uint32_t ack_us(size_t index) const
+      { return (uint32_t) (acks[index] / 1000); }
+
+      // Time the wire (host to Diablo) has spent busy, in virtual micros.
+      uint32_t wire_busy_us() const
+      { return (uint32_t) (wire_busy / 1000); }
+
+      ////////////////////////////////////////    Stream    ////////////////////////////////////////
+      size_t write(uint8_t b) override
+      {
+        idle_polls = 0;
+        uint64_t arrived = std::max(now, wire_free) + byte_ns;
+        wire_free = arrived;
+        wire_busy += byte_ns;
+        recorder.write(b);
+        if (recorder.recorded() > decoded)
+        {
+          Cost c = recorder.cost(decoded++, baud);
+          uint64_t done = std::max(arrived, device_free)
+                          + (uint64_t) (c.fill_pixels * 1000000000.0 / RecordingStream::FILL_RATE);
+          device_free = done;
+          acks.push_back(done + byte_ns);
+          while (recorder.available() > 0)
+          {
+            uint64_t at = std::max(done, back_free) + byte_ns;
+            back_free = at;
+            inbox.push_back({at, (uint8_t) recorder.read()});
+          }
+        }
+        return 1;
+      }
+
+      int available() override
+      {
+        int ready = landed();
+        if (ready == 0 && !inbox.empty() && ++idle_polls >= SPIN_POLLS)
+        {
+          now = std::max(now, inbox.front().at);
+          idle_polls = 0;
+          ready = landed();
+        }
+        return ready;
+      }
+
+      int read() override
+      {
+        idle_polls = 0;
+        if (landed() == 0) return -1;
+        uint8_t b = inbox.front().b;
+        inbox.pop_front();
+        return b;
+      }
+
+      int peek() override
+      { return landed() == 0 ? -1 : inbox.front().b; }
+
+      void flush() override
+      {}
+
+    private:
+      struct Landing
+      {
+        uint64_t at;
+        uint8_t b;
+      };
+
+      uint32_t baud;
+      uint64_t byte_ns;
+      RecordingStream recorder;
+      size_t decoded = 0;
+      uint64_t now = 0;
+      uint64_t wire_free = 0;
+      uint64_t wire_busy = 0;
+      uint64_t device_free = 0;
+      uint64_t back_free = 0;
+      std::vector<uint64_t> acks;
+      std::deque<Landing> inbox;
+      uint32_t idle_polls = 0;
+
+      int landed() const
+      {
+        int n = 0;
+        for (const Landing &l : inbox)
+        {
+          if (l.at > now) break;
+          n++;
+        }
+        return n;
+      }
+    };
+
+    /*
+     * Keys get updates at Zipf distributed rates (rank r gets 1 / r^zipf of the traffic; 0 is uniform).
+     * Updates arrive as a Poisson process in bursts of burst_size, each update deferred under its key's
+     *   name.  A key's draw is a small rectangle, or for expensive_fraction of the keys a big one.
+     * The app loop calls advance() every loop_us.
+     */
+    struct Workload
+    {
+      const char *name = "custom";
+      uint32_t seed = 12345;
+      uint32_t duration_ms = 10000;
+      uint32_t baud = 200000;
+      uint16_t keys = 256;
+      float zipf = 1.1f;
+      float updates_per_second = 1000;
+      uint16_t burst_size = 1;
+      float expensive_fraction = 0;
+      uint16_t cheap_pixels = 20;     // Square, this many on a side.
+      uint16_t expensive_pixels = 200;
+      uint32_t loop_us = 100;
+      uint32_t sample_ms = 100;       // Queue depth sampling.
+    };
+
+    struct KeyStats
+    {
+      uint32_t updates = 0;
+      uint32_t draws = 0;
+      uint64_t stale_sum_us = 0;
+      uint32_t stale_max_us = 0;
+
+      uint32_t stale_mean_us() const
+      { return draws ? (uint32_t) (stale_sum_us / draws) : 0; }
+    };
+
+    struct Result
+    {
+      Workload workload;
+      uint32_t updates = 0;
+      uint32_t draws = 0;
+      uint32_t coalesced = 0;
+      Histogram enqueue_ns;      // Real time, per defer().
+      Histogram latency_us;      // Update to ACK, per update.
+      Histogram staleness_us;    // Oldest waiting update to ACK, per draw.
+      Histogram depth;           // Queue depth, per sample.
+      std::vector<uint16_t> depth_over_time; // Max depth in each tenth of the run.
+      std::vector<KeyStats> keys; // By popularity rank: keys[0] is the hottest.
+      uint32_t wire_busy_us = 0;
+
+      // Updates that never got drawn on their own because a newer one for the same key replaced them.
+      float dedupe_rate() const
+      { return updates ? (float) coalesced / updates : 0; }
+
+      void print(const Logger &out, LogLevel level = LOG_LEVEL_INFO) const
+      {
+        out(level, "%s: %lu keys, zipf %d.%02d, %lu updates/s, bursts of %u, %d%% expensive, %lu baud",
+            workload.name, (unsigned long) workload.keys, (int) workload.zipf, (int) (workload.zipf * 100) % 100,
+            (unsigned long) workload.updates_per_second, (unsigned) workload.burst_size,
+            (int) (workload.expensive_fraction * 100), (unsigned long) workload.baud);
+        out(level, "  %lu updates, %lu draws, dedupe %d%%, wire %d%% busy",
+            (unsigned long) updates, (unsigned long) draws, (int) (dedupe_rate() * 100),
+            (int) (wire_busy_us / (workload.duration_ms * 10.0f)));
+        out(level, "  enqueue ns: mean %lu p99 %lu max %lu", (unsigned long) enqueue_ns.mean(),
+            (unsigned long) enqueue_ns.percentile(0.99f), (unsigned long) enqueue_ns.max());
+        print_percentiles(out, level, "latency ms", latency_us);
+        print_percentiles(out, level, "staleness ms", staleness_us);
+        char series[64] = "";
+        size_t used = 0;
+        for (uint16_t d : depth_over_time)
+        {
+          if (used < sizeof(series)) used += snprintf(series + used, sizeof(series) - used, " %u", (unsigned) d);
+        }
+        out(level, "  depth: mean %lu max %lu, by tenth:%s", (unsigned long) depth.mean(), (unsigned long) depth.max(), series);
+        for (size_t rank : {(size_t) 0, (size_t) 1, keys.size() / 2, keys.size() - 1})
+        {
+          if (rank >= keys.size()) continue;
+          const KeyStats &k = keys[rank];
+          out(level, "  key rank %u: %lu updates, %lu draws, stale mean %lums max %lums", (unsigned) rank + 1,
+              (unsigned long) k.updates, (unsigned long) k.draws, (unsigned long) (k.stale_mean_us() / 1000),
+              (unsigned long) (k.stale_max_us / 1000));
+        }
+      }
+
+    private:
+      static void print_percentiles(const Logger &out, LogLevel level, const char *what, const Histogram &h)
+      {
+        out(level, "  %s: p50 %lu p90 %lu p99 %lu max %lu", what,
+            (unsigned long) (h.percentile(0.5f) / 1000), (unsigned long) (h.percentile(0.9f) / 1000),
+            (unsigned long) (h.percentile(0.99f) / 1000), (unsigned long) (h.max() / 1000));
+      }
+    };
+
+    // Same numbers on every platform: no std:: distributions.
+    class Random
+    {
+    public:
+      explicit Random(uint32_t seed) :
+          state(seed)
+      {}
+
+      // [0, 1)
+      double uniform()
+      {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        return (state >> 11) * (1.0 / 9007199254740992.0);
+      }
+
+      // Mean 1.
+      double exponential()
+      { return -std::log(1.0 - uniform()); }
+
+    private:
+      uint64_t state;
+    };
+
+    /*
+     * Runs one workload to the end of its virtual duration.
+     */
+    inline Result run(const Workload &w)
+    {
+      Result result;
+      result.workload = w;
+      result.keys.resize(w.keys);
+
+      SimulatedLink link(w.baud);
+      Diablo diablo(link);
+      Random random(w.seed);
+
+      std::vector<double> cdf(w.keys);
+      double total = 0;
+      for (uint16_t k = 0; k < w.keys; k++) cdf[k] = total += 1.0 / std::pow(k + 1.0, (double) w.zipf);
+      std::vector<String> names;
+      std::vector<bool> expensive;
+      for (uint16_t k = 0; k < w.keys; k++)
+      {
+        names.push_back(String("key ") + String(k));
+        expensive.push_back(random.uniform() < w.expensive_fraction);
+      }
+      std::vector<std::deque<uint32_t>> waiting(w.keys); // Update times not drawn yet, per key.
+
+      uint32_t end_us = w.duration_ms * 1000;
+      double events_per_us = w.updates_per_second / std::max<uint16_t>(w.burst_size, 1) / 1000000.0;
+      double next_event = random.exponential() / events_per_us;
+      uint32_t next_loop = 0;
+      uint32_t next_sample = 0;
+      result.depth_over_time.assign(10, 0);
+
+      auto draw = [&](uint16_t k) {
+        uint16_t side = expensive[k] ? w.expensive_pixels : w.cheap_pixels;
+        uint16_t x = (k * 37) % (800 - side), y = (k * 53) % (480 - side);
+        diablo.draw_rectangle_filled(x, y, x + side - 1, y + side - 1, k);
+        uint32_t ack = link.ack_us(link.commands() - 1);
+        KeyStats &stats = result.keys[k];
+        if (!waiting[k].empty())
+        {
+          uint32_t stale = ack - waiting[k].front();
+          result.staleness_us.record(stale);
+          stats.stale_sum_us += stale;
+          stats.stale_max_us = std::max(stats.stale_max_us, stale);
+        }
+        for (uint32_t t : waiting[k]) result.latency_us.record(ack - t);
+        waiting[k].clear();
+        stats.draws++;
+        result.draws++;
+      };
+
+      while (true)
+      {
+        uint32_t event_at = (uint32_t) std::ceil(next_event);
+        uint32_t now = std::min({event_at, next_loop, next_sample});
+        if (now >= end_us) break;
+        link.advance_to_us(now);
+        if (now == event_at)
+        {
+          for (uint16_t i = 0; i < std::max<uint16_t>(w.burst_size, 1); i++)
+          {
+            uint16_t k = std::lower_bound(cdf.begin(), cdf.end(), random.uniform() * total) - cdf.begin();
+            k = std::min<uint16_t>(k, w.keys - 1);
+            waiting[k].push_back(now);
+            result.keys[k].updates++;
+            result.updates++;
+            auto started = std::chrono::steady_clock::now();
+            diablo.defer(names[k], [&draw, k]() { draw(k); });
+            result.enqueue_ns.record((uint32_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - started).count());
+          }
+          next_event += random.exponential() / events_per_us;
+        }
+        if (now >= next_loop)
+        {
+          diablo.advance();
+          next_loop += w.loop_us;
+        }
+        if (now >= next_sample)
+        {
+          uint16_t depth = diablo.queued();
+          result.depth.record(depth);
+          uint16_t &tenth = result.depth_over_time[(uint64_t) now * 10 / end_us];
+          tenth = std::max(tenth, depth);
+          next_sample += w.sample_ms * 1000;
+        }
+      }
+      result.coalesced = diablo.coalesced_count();
+      result.wire_busy_us = link.wire_busy_us();
+      return result;
+    }
+
+    /*
+     * The standard set.  Same seed every time, so two builds can be compared line for line.
+     */
+    inline std::vector<Workload> suite()
+    {
+      std::vector<Workload> all;
+      Workload w;
+      w.name = "uniform";
+      w.keys = 64;
+      w.zipf = 0;
+      w.updates_per_second = 200;
+      all.push_back(w);
+
+      w = Workload();
+      w.name = "zipf";
+      all.push_back(w);
+
+      w = Workload();
+      w.name = "bursty";
+      w.burst_size = 32;
+      all.push_back(w);
+
+      w = Workload();
+      w.name = "mixed";
+      w.expensive_fraction = 0.1f;
+      all.push_back(w);
+
+      w = Workload();
+      w.name = "overload";
+      w.keys = 1024;
+      w.zipf = 0.8f;
+      w.updates_per_second = 5000;
+      w.expensive_fraction = 0.1f;
+      all.push_back(w);
+      return all;
+    }
+
+    inline void run_suite(const Logger &out, LogLevel level = LOG_LEVEL_INFO)
+    {
+      for (const Workload &w : suite()) run(w).print(out, level);
+    }
+  }
+}
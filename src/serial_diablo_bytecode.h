@@ -0,0 +1,511 @@
+#pragma once
+
+#include "serial_diablo.h"
+#include <map>
+
+namespace diablo
+{
+  /*
+   * Compact drawing bytecode, for when the serial command set is the bottleneck.
+   *
+   * The serial environment spends 2 bytes per coordinate, a 2 byte opcode and an ACK round trip on every
+   *   primitive.  Bytecode mode runs a little interpreter on the Diablo16 (4dgl/drawvm.4dg) and streams
+   *   it batches of:
+   *
+   *   - 8 bit opcodes
+   *   - points as zigzag varint deltas from the previous point: 1 byte each for anything within 63px
+   *   - sizes and counts as varints
+   *   - colors as a 1 byte palette index; the palette is filled in on the fly with PALETTE ops
+   *
+   * and one ACK per batch instead of one per primitive.  A small circle goes from 10 bytes + an ACK to ~6.
+   *
+   * Batch on the wire:  [length high] [length low] [length bytes of ops]  ->  0x06 once it's all drawn.
+   * The pen starts at 0, 0 for every batch so each one decodes on its own.  The palette carries over, but
+   *   the Encoder only leans on entries it's been told made it (delivered()): a color whose PALETTE op
+   *   is still in flight goes out again in the next batch that uses it.
+   *
+   * Ops (p = point, v = varint, c = palette index):
+   *   END                        leave the interpreter, back to the serial environment
+   *   CLEAR
+   *   PALETTE index color_hi color_lo
+   *   ORIGIN p                   move_origin
+   *   CIRCLE p v(radius) c, CIRCLE_FILLED
+   *   LINE p p c, RECTANGLE p p c, RECTANGLE_FILLED
+   *   TRIANGLE p p p c, TRIANGLE_FILLED
+   *   POLYLINE v(n) p*n c, POLYGON, POLYGON_FILLED
+   *
+   * Encoder and Interpreter here are plain C++ and mirror each other, so the encoding can be checked
+   *   on the host: encode, interpret, compare against the serial commands you'd have sent.
+   */
+  namespace bytecode
+  {
+    enum Op : uint8_t
+    {
+      END = 0x00,
+      CLEAR = 0x01,
+      PALETTE = 0x02,
+      ORIGIN = 0x03,
+      CIRCLE = 0x10,
+      CIRCLE_FILLED = 0x11,
+      LINE = 0x12,
+      RECTANGLE = 0x13,
+      RECTANGLE_FILLED = 0x14,
+      TRIANGLE = 0x15,
+      TRIANGLE_FILLED = 0x16,
+      POLYLINE = 0x17,
+      POLYGON = 0x18,
+      POLYGON_FILLED = 0x19
+    };
+
+    // Matches MAX_POINTS and MAX_BATCH in drawvm.4dg.
+    static const uint16_t MAX_POINTS = 64;
+    static const uint16_t MAX_BATCH = 512;
+
+    /*
+     * Serial environment commands in, bytecode out.
+     */
+    class Encoder
+    {
+    public:
+      // New batch: the pen goes back to 0, 0.  Palette entries the last one sent are in flight.
+      void start_batch()
+      {
+        pen_x = 0;
+        pen_y = 0;
+        for (uint8_t &s : sent) if (s == THIS_BATCH) s = IN_FLIGHT;
+      }
+
+      // Every batch so far was ACK'd: the palette entries they carried can be used without sending them again.
+      void delivered()
+      {
+        for (uint8_t &s : sent) if (s == IN_FLIGHT) s = DELIVERED;
+      }
+
+      // Forget the palette too, for a freshly started interpreter, or one that lost a batch.
+      void reset()
+      {
+        colors.clear();
+        next_index = 0;
+        for (uint16_t &c : palette) c = 0;
+        for (uint8_t &s : sent) s = UNSENT;
+        start_batch();
+      }
+
+      /*
+       * Appends the bytecode for one serial command (opcode first, big endian words) to out.
+       * False, and out untouched, if there's no bytecode for it.
+       */
+      bool encode(const uint8_t *command, size_t length, std::vector<uint8_t> &out)
+      {
+        if (length < 2 || length % 2 != 0) return false;
+        size_t count = length / 2;
+        auto word = [command](size_t i) -> uint16_t { return ((uint16_t) command[2 * i] << 8) | command[2 * i + 1]; };
+        size_t mark = out.size();
+        int16_t saved_x = pen_x, saved_y = pen_y;
+        bool ok = true;
+        switch (word(0))
+        {
+          case 0xFF82:
+            ok = count == 1;
+            if (ok) out.push_back(CLEAR);
+            break;
+          case 0xFF81:
+            ok = count == 3;
+            if (ok)
+            {
+              out.push_back(ORIGIN);
+              point(out, word(1), word(2));
+            }
+            break;
+          case 0xFF78:
+          case 0xFF77:
+            ok = count == 5;
+            if (ok)
+            {
+              uint8_t index = color(out, word(4));
+              out.push_back(word(0) == 0xFF78 ? CIRCLE : CIRCLE_FILLED);
+              point(out, word(1), word(2));
+              varint(out, word(3));
+              out.push_back(index);
+            }
+            break;
+          case 0xFF7D:
+          case 0xFF7A:
+          case 0xFF79:
+            ok = count == 6;
+            if (ok)
+            {
+              uint8_t index = color(out, word(5));
+              out.push_back(word(0) == 0xFF7D ? LINE : word(0) == 0xFF7A ? RECTANGLE : RECTANGLE_FILLED);
+              point(out, word(1), word(2));
+              point(out, word(3), word(4));
+              out.push_back(index);
+            }
+            break;
+          case 0xFF74:
+          case 0xFF59:
+            ok = count == 8;
+            if (ok)
+            {
+              uint8_t index = color(out, word(7));
+              out.push_back(word(0) == 0xFF74 ? TRIANGLE : TRIANGLE_FILLED);
+              for (size_t i = 0; i < 3; i++) point(out, word(1 + 2 * i), word(2 + 2 * i));
+              out.push_back(index);
+            }
+            break;
+          case 0x0015:
+          case 0x0013:
+          case 0x0014:
+          {
+            uint16_t n = count >= 2 ? word(1) : 0;
+            ok = n >= 1 && n <= MAX_POINTS && count == 3 + 2 * (size_t) n;
+            if (ok)
+            {
+              uint8_t index = color(out, word(2 + 2 * n));
+              out.push_back(word(0) == 0x0015 ? POLYLINE : word(0) == 0x0013 ? POLYGON : POLYGON_FILLED);
+              varint(out, n);
+              for (uint16_t i = 0; i < n; i++) point(out, word(2 + i), word(2 + n + i));
+              out.push_back(index);
+            }
+            break;
+          }
+          default:
+            ok = false;
+        }
+        if (!ok)
+        {
+          out.resize(mark);
+          pen_x = saved_x;
+          pen_y = saved_y;
+        }
+        return ok;
+      }
+
+    private:
+      // Where each palette slot's PALETTE op has got to.
+      enum Sent : uint8_t { UNSENT, THIS_BATCH, IN_FLIGHT, DELIVERED };
+
+      int16_t pen_x = 0;
+      int16_t pen_y = 0;
+      std::map<uint16_t, uint8_t> colors;
+      uint16_t palette[256] = {};
+      uint8_t sent[256] = {};
+      uint8_t next_index = 0;
+
+      static void varint(std::vector<uint8_t> &out, uint16_t v)
+      {
+        while (v >= 0x80)
+        {
+          out.push_back((v & 0x7F) | 0x80);
+          v >>= 7;
+        }
+        out.push_back(v);
+      }
+
+      // Deltas wrap at 16 bits on both ends, so any jump fits in 3 bytes and small ones in 1.
+      void point(std::vector<uint8_t> &out, uint16_t x, uint16_t y)
+      {
+        int16_t dx = (int16_t) (x - (uint16_t) pen_x), dy = (int16_t) (y - (uint16_t) pen_y);
+        varint(out, (uint16_t) ((uint16_t) dx << 1) ^ (uint16_t) (dx >> 15));
+        varint(out, (uint16_t) ((uint16_t) dy << 1) ^ (uint16_t) (dy >> 15));
+        pen_x = x;
+        pen_y = y;
+      }
+
+      // Palette index for color, emitting a PALETTE op first if it's new, or not known to have made it.
+      //   Slots are reused round robin.
+      uint8_t color(std::vector<uint8_t> &out, uint16_t c)
+      {
+        uint8_t index;
+        auto it = colors.find(c);
+        if (it != colors.end())
+        {
+          index = it->second;
+          if (sent[index] == THIS_BATCH || sent[index] == DELIVERED) return index;
+        }
+        else
+        {
+          index = next_index++;
+          auto old = colors.find(palette[index]);
+          if (old != colors.end() && old->second == index) colors.erase(old);
+          palette[index] = c;
+          colors[c] = index;
+        }
+        sent[index] = THIS_BATCH;
+        out.push_back(PALETTE);
+        out.push_back(index);
+        out.push_back(c >> 8);
+        out.push_back(c & 0xFF);
+        return index;
+      }
+    };
+
+    /*
+     * Host twin of drawvm.4dg: runs batches and hands out the serial commands they stand for.
+     */
+    class Interpreter
+    {
+    public:
+      typedef std::function<void(const std::vector<uint16_t> &words)> CommandHandler;
+
+      /*
+       * Runs one batch's ops.  False if it's malformed (runs off the end, unknown op, too many points).
+       * Stops at END.
+       */
+      bool run(const uint8_t *ops, size_t length, CommandHandler command)
+      {
+        bytes = ops;
+        end = length;
+        at = 0;
+        pen_x = 0;
+        pen_y = 0;
+        while (at < end)
+        {
+          uint8_t op = ops[at++];
+          std::vector<uint16_t> words;
+          switch (op)
+          {
+            case END:
+              ended = true;
+              return true;
+            case CLEAR:
+              words = {0xFF82};
+              break;
+            case PALETTE:
+            {
+              if (at + 3 > end) return false;
+              uint8_t index = bytes[at++];
+              palette[index] = ((uint16_t) bytes[at] << 8) | bytes[at + 1];
+              at += 2;
+              continue;
+            }
+            case ORIGIN:
+              point();
+              words = {0xFF81, pen_x, pen_y};
+              break;
+            case CIRCLE:
+            case CIRCLE_FILLED:
+            {
+              point();
+              uint16_t radius = varint();
+              words = {op == CIRCLE ? (uint16_t) 0xFF78 : (uint16_t) 0xFF77, pen_x, pen_y, radius, color()};
+              break;
+            }
+            case LINE:
+            case RECTANGLE:
+            case RECTANGLE_FILLED:
+            {
+              point();
+              uint16_t x1 = pen_x, y1 = pen_y;
+              point();
+              uint16_t opcode = op == LINE ? 0xFF7D : op == RECTANGLE ? 0xFF7A : 0xFF79;
+              words = {opcode, x1, y1, pen_x, pen_y, color()};
+              break;
+            }
+            case TRIANGLE:
+            case TRIANGLE_FILLED:
+              words = {op == TRIANGLE ? (uint16_t) 0xFF74 : (uint16_t) 0xFF59};
+              for (uint8_t i = 0; i < 3; i++)
+              {
+                point();
+                words.push_back(pen_x);
+                words.push_back(pen_y);
+              }
+              words.push_back(color());
+              break;
+            case POLYLINE:
+            case POLYGON:
+            case POLYGON_FILLED:
+            {
+              uint16_t n = varint();
+              if (n == 0 || n > MAX_POINTS) return false;
+              uint16_t opcode = op == POLYLINE ? 0x0015 : op == POLYGON ? 0x0013 : 0x0014;
+              words.assign(3 + 2 * n, 0);
+              words[0] = opcode;
+              words[1] = n;
+              for (uint16_t i = 0; i < n; i++)
+              {
+                point();
+                words[2 + i] = pen_x;
+                words[2 + n + i] = pen_y;
+              }
+              words[2 + 2 * n] = color();
+              break;
+            }
+            default:
+              return false;
+          }
+          if (at > end) return false;
+          command(words);
+        }
+        return true;
+      }
+
+      // Saw an END.
+      bool finished() const
+      { return ended; }
+
+    private:
+      const uint8_t *bytes = nullptr;
+      size_t end = 0;
+      size_t at = 0;
+      uint16_t pen_x = 0;
+      uint16_t pen_y = 0;
+      uint16_t palette[256] = {};
+      bool ended = false;
+
+      // Running off the end pushes `at` past `end`, which run() notices.
+      uint8_t next()
+      { return at < end ? bytes[at++] : (at++, 0); }
+
+      uint16_t varint()
+      {
+        uint16_t v = 0;
+        uint8_t shift = 0, b;
+        do
+        {
+          b = next();
+          if (shift < 16) v |= (uint16_t) (b & 0x7F) << shift;
+          shift += 7;
+        } while (b & 0x80);
+        return v;
+      }
+
+      void point()
+      {
+        uint16_t zx = varint(), zy = varint();
+        pen_x += (uint16_t) ((zx >> 1) ^ -(zx & 1));
+        pen_y += (uint16_t) ((zy >> 1) ^ -(zy & 1));
+      }
+
+      uint16_t color()
+      { return palette[next()]; }
+    };
+  }
+
+  /*
+   * Bytecode mode on a real Diablo16.  The draw methods don't change: while it's on, everything you draw
+   *   on the Diablo gets encoded into the current batch instead of going out as a serial command.
+   *
+   * Setup, once:  compile 4dgl/drawvm.4dg in Workshop and copy DRAWVM.4XE to the card.
+   *
+   * diablo::BytecodeMode bytecode(diablo16);
+   * diablo16.file_mount();
+   * if (bytecode.begin())
+   * {
+   *   for (auto &dot : dots) diablo16.draw_circle_filled(dot.x, dot.y, 3, dot.color);
+   *   bytecode.flush();
+   *   bytecode.end(); // Back to the serial environment.
+   * }
+   *
+   * Batches go out when they fill up, on flush(), or from advance() whenever the link is idle - so
+   *   while the Diablo is busy drawing one batch, the next one is filling up.
+   *
+   * NOTE:  Only drawing commands have bytecode.  Anything else (text, media, GPIO, anything that answers
+   *   with a value) is dropped with an error while bytecode mode is on.  end() first.
+   */
+  class BytecodeMode : public CommandEncoder
+  {
+  public:
+    BytecodeMode(Diablo &diablo, const char *program = "DRAWVM.4XE", uint16_t batch_bytes = 256) :
+        log("app.diablo.bytecode"),
+        diablo(&diablo),
+        program(program),
+        batch_bytes(std::min(batch_bytes, bytecode::MAX_BATCH))
+    {}
+
+    // Starts the interpreter and routes drawing to it.  False if it didn't come up.
+    bool begin()
+    {
+      if (running) return true;
+      if (!diablo->file_run(program))
+      {
+        log.error("%s didn't start", program);
+        return false;
+      }
+      encoder.reset();
+      start_batch();
+      last_batch = 0;
+      running = true;
+      diablo->encode_with(this);
+      return true;
+    }
+
+    // Sends whatever's in the current batch.
+    void flush(bool blocking = false)
+    {
+      if (!running || batch.size() <= 2) return;
+      uint16_t length = batch.size() - 2;
+      batch[0] = length >> 8;
+      batch[1] = length & 0xFF;
+      // Sending this one collects the last one's ACK, so both are accounted for after.
+      bool sent = diablo->write_raw("bytecode_batch", batch.data(), batch.size(), LOG_LEVEL_TRACE, blocking);
+      check(sent);
+      start_batch();
+      last_batch = sent ? diablo->commands_sent() : 0;
+      if (blocking && last_batch) check(sent);
+    }
+
+    // Call from loop(): ships a partial batch whenever the link has nothing better to do.
+    void advance()
+    {
+      if (running && batch.size() > 2 && !diablo->busy()) flush();
+    }
+
+    // Flushes, stops the interpreter and hands the wire back to the serial environment.
+    bool end()
+    {
+      if (!running) return true;
+      flush();
+      batch.push_back(bytecode::END);
+      flush(true);
+      running = false;
+      diablo->encode_with(nullptr);
+      return diablo->file_run_result() != 0xDEAD;
+    }
+
+    bool active() const
+    { return running; }
+
+    bool encode(const uint8_t *command, size_t length) override
+    {
+      // Worst case every word is a 3 byte varint, plus the op and a PALETTE op.  If that might not fit,
+      //   ship the batch first: encoding moves the pen and the palette, so there's no taking it back.
+      if (batch.size() - 2 + (length / 2) * 3 + 5 > batch_bytes) flush();
+      return encoder.encode(command, length, batch);
+    }
+
+  private:
+    Logger log;
+    Diablo *diablo;
+    const char *program;
+    uint16_t batch_bytes;
+    bytecode::Encoder encoder;
+    std::vector<uint8_t> batch;
+    bool running = false;
+    uint32_t last_batch = 0; // Sequence number of the last batch sent, 0 if it's accounted for.
+
+    /*
+     * A batch that was NAK'd or never answered may have taken PALETTE ops with it: forget the palette,
+     *   so the colors go out again as they're used.  Otherwise what the sent batches carried is in.
+     */
+    void check(bool sent)
+    {
+      if (!sent || (last_batch && (int32_t) (diablo->last_failed_command() - last_batch) >= 0))
+      {
+        log.error("Lost a batch, sending the palette again");
+        encoder.reset();
+        last_batch = 0;
+        return;
+      }
+      encoder.delivered();
+    }
+
+    void start_batch()
+    {
+      batch.assign(2, 0);
+      batch.reserve(batch_bytes + 2);
+      encoder.start_batch();
+    }
+  };
+}
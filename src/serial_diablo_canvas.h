@@ -0,0 +1,414 @@
+#pragma once
+
+#include "serial_diablo.h"
+
+namespace diablo
+{
+  /*
+   * One physical screen in a video wall.
+   * x, y = where the panel's top left corner lives on the big logical canvas.
+   */
+  struct Panel
+  {
+    Diablo *diablo;
+    int16_t x;
+    int16_t y;
+    uint16_t width;
+    uint16_t height;
+  };
+
+  /*
+   * A logical canvas spanning several panels, each on its own serial link.
+   *
+   * Draw calls take global coordinates.  Each primitive is clipped and translated for every panel
+   *   it touches and queued for that panel only - a circle in the top left corner of a 2x2 wall
+   *   never costs the other 3 links a single byte.
+   *
+   * Every panel gets its own queue.  advance() hands a panel its next command only when that panel's
+   *   link has its ACK back, so a slow fill on one panel doesn't hold up the other 3.  With N panels
+   *   you get (roughly) N times the throughput of a single screen, as long as the drawing is spread out.
+   *
+   * Example 2x2 wall of uLCD-70Ds:
+   * diablo::Canvas wall({
+   *   {&top_left,    0,   0, 800, 480}, {&top_right,    800,   0, 800, 480},
+   *   {&bottom_left, 0, 480, 800, 480}, {&bottom_right, 800, 480, 800, 480}
+   * });
+   * wall.draw_circle_filled(800, 480, 100, red); // Lands on all four panels.
+   * wall.flush();
+   *
+   * NOTE:  Circles aren't split, they're just translated.  The Diablo16 clips whatever hangs off its own
+   *   edges, so each touched panel draws its own slice.
+   */
+  class Canvas
+  {
+  public:
+    Canvas(std::vector<Panel> panels) :
+        panels(panels),
+        queues(panels.size())
+    {}
+
+    void clear()
+    {
+      for (size_t i = 0; i < panels.size(); i++)
+      {
+        Diablo *d = panels[i].diablo;
+        queues[i].push_back([d]() { d->clear(); });
+      }
+      advance();
+    }
+
+    void draw_circle(uint16_t x, uint16_t y, uint16_t radius, uint16_t color = 0xFFFF)
+    {
+      circle(x, y, radius, color, false);
+    }
+
+    void draw_circle_filled(uint16_t x, uint16_t y, uint16_t radius, uint16_t color = 0xFFFF)
+    {
+      circle(x, y, radius, color, true);
+    }
+
+    void draw_line(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2, uint16_t color = 0xFFFF)
+    {
+      for (size_t i = 0; i < panels.size(); i++)
+      {
+        int32_t ax = x1, ay = y1, bx = x2, by = y2;
+        if (clip_line(panels[i], ax, ay, bx, by))
+        {
+          line(i, ax, ay, bx, by, color);
+        }
+      }
+      advance();
+    }
+
+    void draw_rectangle(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2, uint16_t color = 0xFFFF)
+    {
+      for (size_t i = 0; i < panels.size(); i++)
+      {
+        const Panel &p = panels[i];
+        if (!touches(p, std::min(x1, x2), std::min(y1, y2), std::max(x1, x2), std::max(y1, y2)))
+        { continue; }
+        if (inside(p, x1, y1) && inside(p, x2, y2))
+        {
+          Diablo *d = p.diablo;
+          uint16_t lx1 = local_x(p, x1), ly1 = local_y(p, y1), lx2 = local_x(p, x2), ly2 = local_y(p, y2);
+          queues[i].push_back([=]() { d->draw_rectangle(lx1, ly1, lx2, ly2, color); });
+          continue;
+        }
+        // Straddling an edge: only the visible sides go out, no fake sides along the panel border.
+        int32_t edges[4][4] = {
+            {x1, y1, x2, y1}, {x2, y1, x2, y2},
+            {x2, y2, x1, y2}, {x1, y2, x1, y1}
+        };
+        for (auto &e : edges)
+        {
+          if (clip_line(p, e[0], e[1], e[2], e[3]))
+          { line(i, e[0], e[1], e[2], e[3], color); }
+        }
+      }
+      advance();
+    }
+
+    void draw_rectangle_filled(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2, uint16_t color = 0xFFFF)
+    {
+      int32_t left = std::min(x1, x2), top = std::min(y1, y2);
+      int32_t right = std::max(x1, x2), bottom = std::max(y1, y2);
+      for (size_t i = 0; i < panels.size(); i++)
+      {
+        const Panel &p = panels[i];
+        if (!touches(p, left, top, right, bottom))
+        { continue; }
+        Diablo *d = p.diablo;
+        uint16_t lx1 = local_x(p, std::max(left, (int32_t) p.x));
+        uint16_t ly1 = local_y(p, std::max(top, (int32_t) p.y));
+        uint16_t lx2 = local_x(p, std::min(right, p.x + p.width - 1));
+        uint16_t ly2 = local_y(p, std::min(bottom, p.y + p.height - 1));
+        queues[i].push_back([=]() { d->draw_rectangle_filled(lx1, ly1, lx2, ly2, color); });
+      }
+      advance();
+    }
+
+    void draw_triangle(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2, uint16_t x3, uint16_t y3,
+                       uint16_t color = 0xFFFF)
+    {
+      outline({x1, x2, x3, y1, y2, y3}, color, true);
+    }
+
+    void draw_triangle_filled(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2, uint16_t x3, uint16_t y3,
+                              uint16_t color = 0xFFFF)
+    {
+      filled({x1, x2, x3, y1, y2, y3}, color);
+    }
+
+    /*
+     * vertices:  x1, x2, [...], xn, y1, y2, [...], yn.  Same as Diablo::draw_polyline().
+     */
+    void draw_polyline(const std::vector<uint16_t> &vertices, uint16_t color = 0xFFFF)
+    {
+      outline(vertices, color, false);
+    }
+
+    /*
+     * vertices:  x1, x2, [...], xn, y1, y2, [...], yn.  Same as Diablo::draw_polygon().
+     */
+    void draw_polygon(const std::vector<uint16_t> &vertices, uint16_t color = 0xFFFF)
+    {
+      outline(vertices, color, true);
+    }
+
+    /*
+     * vertices:  x1, x2, [...], xn, y1, y2, [...], yn.  Same as Diablo::draw_polygon_filled().
+     * Polygons crossing a panel border are split at the border, each panel gets its own piece.
+     */
+    void draw_polygon_filled(const std::vector<uint16_t> &vertices, uint16_t color = 0xFFFF)
+    {
+      filled(vertices, color);
+    }
+
+    /**
+     * Hands each idle panel its next queued command.  Never waits on an ACK.
+     * Call it from loop() as often as you like.
+     */
+    void advance()
+    {
+      for (size_t i = 0; i < panels.size(); i++)
+      {
+        std::deque<Diablo::Runnable> &queue = queues[i];
+        if (queue.empty() || panels[i].diablo->busy())
+        { continue; }
+        Diablo::Runnable next = queue.front();
+        queue.pop_front();
+        next();
+      }
+    }
+
+    /**
+     * Spins on advance() until every panel's queue is drained.
+     */
+    void flush()
+    {
+      while (pending() > 0)
+      { advance(); }
+    }
+
+    // Commands queued across all panels.
+    size_t pending()
+    {
+      size_t total = 0;
+      for (auto &queue : queues) total += queue.size();
+      return total;
+    }
+
+  private:
+    // Polygon-ish working form: one global vertex at a time.
+    typedef std::pair<int32_t, int32_t> vertex;
+
+    std::vector<Panel> panels;
+    std::vector<std::deque<Diablo::Runnable>> queues;
+
+    static uint16_t local_x(const Panel &p, int32_t x)
+    { return (uint16_t) (x - p.x); }
+
+    static uint16_t local_y(const Panel &p, int32_t y)
+    { return (uint16_t) (y - p.y); }
+
+    static bool inside(const Panel &p, int32_t x, int32_t y)
+    {
+      return x >= p.x && x < p.x + p.width && y >= p.y && y < p.y + p.height;
+    }
+
+    static bool touches(const Panel &p, int32_t left, int32_t top, int32_t right, int32_t bottom)
+    {
+      return right >= p.x && left < p.x + p.width && bottom >= p.y && top < p.y + p.height;
+    }
+
+    void circle(uint16_t x, uint16_t y, uint16_t radius, uint16_t color, bool fill)
+    {
+      for (size_t i = 0; i < panels.size(); i++)
+      {
+        const Panel &p = panels[i];
+        // Closest point of the panel to the center, then a plain distance check.
+        int32_t cx = std::max((int32_t) p.x, std::min((int32_t) x, p.x + p.width - 1));
+        int32_t cy = std::max((int32_t) p.y, std::min((int32_t) y, p.y + p.height - 1));
+        int32_t dx = cx - x, dy = cy - y;
+        if (dx * dx + dy * dy > (int32_t) radius * radius)
+        { continue; }
+        Diablo *d = p.diablo;
+        // Negative local centers wrap to two's complement, which is what the Diablo16 expects.
+        uint16_t lx = local_x(p, x), ly = local_y(p, y);
+        if (fill)
+        { queues[i].push_back([=]() { d->draw_circle_filled(lx, ly, radius, color); }); }
+        else
+        { queues[i].push_back([=]() { d->draw_circle(lx, ly, radius, color); }); }
+      }
+      advance();
+    }
+
+    void line(size_t panel, int32_t x1, int32_t y1, int32_t x2, int32_t y2, uint16_t color)
+    {
+      const Panel &p = panels[panel];
+      Diablo *d = p.diablo;
+      uint16_t lx1 = local_x(p, x1), ly1 = local_y(p, y1), lx2 = local_x(p, x2), ly2 = local_y(p, y2);
+      queues[panel].push_back([=]() { d->draw_line(lx1, ly1, lx2, ly2, color); });
+    }
+
+    // Cohen-Sutherland.  False if the line misses the panel entirely.
+    static bool clip_line(const Panel &p, int32_t &x1, int32_t &y1, int32_t &x2, int32_t &y2)
+    {
+      const int32_t left = p.x, top = p.y, right = p.x + p.width - 1, bottom = p.y + p.height - 1;
+      auto outcode = [&](int32_t x, int32_t y) -> uint8_t {
+        return (x < left ? 1 : 0) | (x > right ? 2 : 0) | (y < top ? 4 : 0) | (y > bottom ? 8 : 0);
+      };
+      uint8_t a = outcode(x1, y1), b = outcode(x2, y2);
+      while (true)
+      {
+        if (!(a | b)) return true;
+        if (a & b) return false;
+        uint8_t out = a ? a : b;
+        int32_t x, y;
+        if (out & 8)
+        { x = x1 + (x2 - x1) * (bottom - y1) / (y2 - y1); y = bottom; }
+        else if (out & 4)
+        { x = x1 + (x2 - x1) * (top - y1) / (y2 - y1); y = top; }
+        else if (out & 2)
+        { y = y1 + (y2 - y1) * (right - x1) / (x2 - x1); x = right; }
+        else
+        { y = y1 + (y2 - y1) * (left - x1) / (x2 - x1); x = left; }
+        if (out == a)
+        { x1 = x; y1 = y; a = outcode(x1, y1); }
+        else
+        { x2 = x; y2 = y; b = outcode(x2, y2); }
+      }
+    }
+
+    // Sutherland-Hodgman against one panel edge.
+    template<typename Inside, typename Cross>
+    static std::vector<vertex> clip_edge(const std::vector<vertex> &in, Inside is_inside, Cross cross)
+    {
+      std::vector<vertex> out;
+      for (size_t i = 0; i < in.size(); i++)
+      {
+        const vertex &cur = in[i];
+        const vertex &prev = in[(i + in.size() - 1) % in.size()];
+        bool cur_in = is_inside(cur), prev_in = is_inside(prev);
+        if (cur_in != prev_in) out.push_back(cross(prev, cur));
+        if (cur_in) out.push_back(cur);
+      }
+      return out;
+    }
+
+    static std::vector<vertex> clip_polygon(const Panel &p, std::vector<vertex> poly)
+    {
+      const int32_t left = p.x, top = p.y, right = p.x + p.width - 1, bottom = p.y + p.height - 1;
+      auto at_x = [](const vertex &a, const vertex &b, int32_t x) -> vertex {
+        return {x, a.second + (b.second - a.second) * (x - a.first) / (b.first - a.first)};
+      };
+      auto at_y = [](const vertex &a, const vertex &b, int32_t y) -> vertex {
+        return {a.first + (b.first - a.first) * (y - a.second) / (b.second - a.second), y};
+      };
+      poly = clip_edge(poly, [&](const vertex &v) { return v.first >= left; },
+                       [&](const vertex &a, const vertex &b) { return at_x(a, b, left); });
+      poly = clip_edge(poly, [&](const vertex &v) { return v.first <= right; },
+                       [&](const vertex &a, const vertex &b) { return at_x(a, b, right); });
+      poly = clip_edge(poly, [&](const vertex &v) { return v.second >= top; },
+                       [&](const vertex &a, const vertex &b) { return at_y(a, b, top); });
+      poly = clip_edge(poly, [&](const vertex &v) { return v.second <= bottom; },
+                       [&](const vertex &a, const vertex &b) { return at_y(a, b, bottom); });
+      return poly;
+    }
+
+    static std::vector<vertex> unpack(const std::vector<uint16_t> &vertices)
+    {
+      size_t n = vertices.size() / 2;
+      std::vector<vertex> poly;
+      poly.reserve(n);
+      for (size_t i = 0; i < n; i++) poly.push_back({vertices[i], vertices[n + i]});
+      return poly;
+    }
+
+    static void bounds(const std::vector<vertex> &poly, int32_t &left, int32_t &top, int32_t &right, int32_t &bottom)
+    {
+      left = top = INT32_MAX;
+      right = bottom = INT32_MIN;
+      for (const vertex &v : poly)
+      {
+        left = std::min(left, v.first);
+        right = std::max(right, v.first);
+        top = std::min(top, v.second);
+        bottom = std::max(bottom, v.second);
+      }
+    }
+
+    void filled(const std::vector<uint16_t> &vertices, uint16_t color)
+    {
+      std::vector<vertex> poly = unpack(vertices);
+      if (poly.size() < 3) return;
+      int32_t left, top, right, bottom;
+      bounds(poly, left, top, right, bottom);
+      for (size_t i = 0; i < panels.size(); i++)
+      {
+        const Panel &p = panels[i];
+        if (!touches(p, left, top, right, bottom))
+        { continue; }
+        std::vector<vertex> piece = clip_polygon(p, poly);
+        if (piece.size() < 3)
+        { continue; }
+        Diablo *d = p.diablo;
+        if (piece.size() == 3)
+        {
+          uint16_t ax = local_x(p, piece[0].first), ay = local_y(p, piece[0].second);
+          uint16_t bx = local_x(p, piece[1].first), by = local_y(p, piece[1].second);
+          uint16_t cx = local_x(p, piece[2].first), cy = local_y(p, piece[2].second);
+          queues[i].push_back([=]() { d->draw_triangle_filled(ax, ay, bx, by, cx, cy, color); });
+          continue;
+        }
+        std::vector<uint16_t> local(piece.size() * 2);
+        for (size_t v = 0; v < piece.size(); v++)
+        {
+          local[v] = local_x(p, piece[v].first);
+          local[piece.size() + v] = local_y(p, piece[v].second);
+        }
+        queues[i].push_back([=]() { d->draw_polygon_filled(local, color); });
+      }
+      advance();
+    }
+
+    // Polylines and polygon outlines: whole if the panel holds all of it, otherwise clipped edge by edge.
+    void outline(const std::vector<uint16_t> &vertices, uint16_t color, bool closed)
+    {
+      std::vector<vertex> poly = unpack(vertices);
+      if (poly.size() < 2) return;
+      int32_t left, top, right, bottom;
+      bounds(poly, left, top, right, bottom);
+      for (size_t i = 0; i < panels.size(); i++)
+      {
+        const Panel &p = panels[i];
+        if (!touches(p, left, top, right, bottom))
+        { continue; }
+        Diablo *d = p.diablo;
+        if (inside(p, left, top) && inside(p, right, bottom))
+        {
+          std::vector<uint16_t> local(poly.size() * 2);
+          for (size_t v = 0; v < poly.size(); v++)
+          {
+            local[v] = local_x(p, poly[v].first);
+            local[poly.size() + v] = local_y(p, poly[v].second);
+          }
+          if (closed)
+          { queues[i].push_back([=]() { d->draw_polygon(local, color); }); }
+          else
+          { queues[i].push_back([=]() { d->draw_polyline(local, color); }); }
+          continue;
+        }
+        size_t edges = closed ? poly.size() : poly.size() - 1;
+        for (size_t e = 0; e < edges; e++)
+        {
+          int32_t x1 = poly[e].first, y1 = poly[e].second;
+          int32_t x2 = poly[(e + 1) % poly.size()].first, y2 = poly[(e + 1) % poly.size()].second;
+          if (clip_line(p, x1, y1, x2, y2))
+          { line(i, x1, y1, x2, y2, color); }
+        }
+      }
+      advance();
+    }
+  };
+}
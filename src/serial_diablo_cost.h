@@ -0,0 +1,353 @@
+#pragma once
+
+#include "serial_diablo.h"
+#include <map>
+
+namespace diablo
+{
+  /*
+   * What one slice of a screen costs.  Bytes count both directions (request, ACK, response words).
+   */
+  struct Cost
+  {
+    uint32_t commands = 0;
+    uint32_t bytes = 0;
+    uint32_t acks = 0;
+    uint32_t fill_pixels = 0;
+    float frame_ms = 0;
+  };
+
+  /*
+   * Per-screen cost report, built by a RecordingStream.
+   * frame_ms is the estimate for the whole thing to land on the screen at the recorded baud:
+   *   serial time for every byte + fill time at the Diablo16's pixel rate.
+   */
+  struct CostReport
+  {
+    uint32_t baud;
+    Cost total;
+    std::map<String, Cost> by_command;
+    std::map<String, Cost> by_tag;
+
+    // Enforce a budget.  Zero means "don't care" for that dimension.
+    bool within(float frame_ms_budget, uint32_t byte_budget = 0) const
+    {
+      return (frame_ms_budget == 0 || total.frame_ms <= frame_ms_budget)
+             && (byte_budget == 0 || total.bytes <= byte_budget);
+    }
+
+    void print(const Logger &out, LogLevel level = LOG_LEVEL_INFO) const
+    {
+      out(level, "Screen cost @%lu baud: %lu commands, %lu bytes, %lu acks, %lu px, %dms",
+          (unsigned long) baud, (unsigned long) total.commands, (unsigned long) total.bytes,
+          (unsigned long) total.acks, (unsigned long) total.fill_pixels, (int) total.frame_ms);
+      for (const auto &line : by_command) print_line(out, level, "command", line.first, line.second);
+      for (const auto &line : by_tag) print_line(out, level, "tag", line.first, line.second);
+    }
+
+  private:
+    static void print_line(const Logger &out, LogLevel level, const char *kind, const String &name, const Cost &c)
+    {
+      out(level, "  %s %s: %lu commands, %lu bytes, %lu px, %dms", kind, name.c_str(),
+          (unsigned long) c.commands, (unsigned long) c.bytes, (unsigned long) c.fill_pixels, (int) c.frame_ms);
+    }
+  };
+
+  /*
+   * A fake Diablo16 on the other end of the wire.  Point a Diablo at it, run your screen's draw code,
+   *   and ask for a report() of what that would have cost the real panel.
+   * Every command is decoded as it's written, ACK'd instantly and answered with zeroes,
+   *   so blocking and deferred calls both run flat out.
+   *
+   * Tag sections of your draw code to see who's spending the budget:
+   *
+   * diablo::RecordingStream recorder(800, 480);
+   * diablo::Diablo screen(recorder);
+   * recorder.tag("header");  draw_header(screen);
+   * recorder.tag("trend");   draw_trend(screen);
+   * diablo::CostReport report = recorder.report(200000);
+   * report.print(Log);
+   * if (!report.within(50)) Log.error("Main screen blew its 50ms budget");
+   *
+   * NOTE:  Fill pixels are estimates from the command geometry.  Images only count if you tell
+   *   image_size() what lives at the sector, the recorder can't see your uSD card.
+   */
+  class RecordingStream : public Stream
+  {
+  public:
+    // Pixels per second the Diablo16 can fill.
+    static constexpr float FILL_RATE = 1220000;
+
+    RecordingStream(uint16_t screen_width, uint16_t screen_height) :
+        screen_width(screen_width),
+        screen_height(screen_height),
+        current_tag("untagged")
+    {}
+
+    // Everything recorded from here on is billed to this tag.
+    void tag(const String &name)
+    { current_tag = name; }
+
+    void image_size(uint32_t sector, uint16_t width, uint16_t height)
+    { image_pixels[sector] = (uint32_t) width * height; }
+
+    void reset()
+    {
+      records.clear();
+      pending.clear();
+      responses.clear();
+    }
+
+    CostReport report(uint32_t baud) const
+    {
+      CostReport out;
+      out.baud = baud;
+      for (const Record &r : records)
+      {
+        add(out.total, r, baud);
+        add(out.by_command[r.name], r, baud);
+        add(out.by_tag[r.tag], r, baud);
+      }
+      return out;
+    }
+
+    // Commands recorded so far.
+    size_t recorded() const
+    { return records.size(); }
+
+    // What the index'th recorded command cost on its own.
+    Cost cost(size_t index, uint32_t baud) const
+    {
+      Cost c;
+      add(c, records[index], baud);
+      return c;
+    }
+
+    ////////////////////////////////////////    Stream    ////////////////////////////////////////
+    size_t write(uint8_t b) override
+    {
+      pending.push_back(b);
+      decode();
+      return 1;
+    }
+
+    int available() override
+    { return responses.size(); }
+
+    int read() override
+    {
+      if (responses.empty()) return -1;
+      uint8_t b = responses.front();
+      responses.pop_front();
+      return b;
+    }
+
+    int peek() override
+    { return responses.empty() ? -1 : responses.front(); }
+
+    void flush() override
+    {}
+
+  private:
+    struct Record
+    {
+      const char *name;
+      String tag;
+      uint32_t bytes;
+      uint32_t fill_pixels;
+    };
+
+    uint16_t screen_width;
+    uint16_t screen_height;
+    String current_tag;
+    uint32_t sector = 0;
+    std::map<uint32_t, uint32_t> image_pixels;
+    std::vector<Record> records;
+    std::vector<uint8_t> pending;
+    std::deque<uint8_t> responses;
+
+    static void add(Cost &c, const Record &r, uint32_t baud)
+    {
+      c.commands++;
+      c.acks++;
+      c.bytes += r.bytes;
+      c.fill_pixels += r.fill_pixels;
+      // 8N1 = 10 bits on the wire per byte.
+      c.frame_ms += r.bytes * 10000.0f / baud + r.fill_pixels * 1000.0f / FILL_RATE;
+    }
+
+    uint16_t word(size_t index) const
+    { return ((uint16_t) pending[index * 2] << 8) | pending[index * 2 + 1]; }
+
+    int16_t arg(size_t index) const
+    { return (int16_t) word(index + 1); }
+
+    static uint32_t span(int32_t a, int32_t b)
+    { return (uint32_t) std::abs(b - a) + 1; }
+
+    static uint32_t length(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+    { return std::max(span(x1, x2), span(y1, y2)); }
+
+    // Vertex i of n starting at argument `first`: polys send every x then every y, triangles send x,y pairs.
+    int16_t vertex_x(size_t first, size_t /*n*/, size_t i, bool pairs) const
+    { return arg(pairs ? first + 2 * i : first + i); }
+
+    int16_t vertex_y(size_t first, size_t n, size_t i, bool pairs) const
+    { return arg(pairs ? first + 2 * i + 1 : first + n + i); }
+
+    // Shoelace area.
+    uint32_t area(size_t first, size_t n, bool pairs = false) const
+    {
+      int64_t twice = 0;
+      for (size_t i = 0; i < n; i++)
+      {
+        size_t j = (i + 1) % n;
+        twice += (int64_t) vertex_x(first, n, i, pairs) * vertex_y(first, n, j, pairs) -
+                 (int64_t) vertex_x(first, n, j, pairs) * vertex_y(first, n, i, pairs);
+      }
+      return (uint32_t) (std::abs(twice) / 2);
+    }
+
+    uint32_t perimeter(size_t first, size_t n, bool closed, bool pairs = false) const
+    {
+      uint32_t total = 0;
+      size_t edges = closed ? n : n - 1;
+      for (size_t i = 0; i < edges; i++)
+      {
+        size_t j = (i + 1) % n;
+        total += length(vertex_x(first, n, i, pairs), vertex_y(first, n, i, pairs),
+                        vertex_x(first, n, j, pairs), vertex_y(first, n, j, pairs));
+      }
+      return total;
+    }
+
+    // Once a whole command has been written, bill it and queue up its ACK + response.
+    void decode()
+    {
+      if (pending.size() < 2) return;
+      uint16_t opcode = word(0);
+      const char *name = nullptr;
+      size_t request_bytes = 0;
+      uint16_t response_words = 0;
+      uint16_t response = 0;
+      uint32_t fill = 0;
+      bool known = true;
+
+      // Blits carry their own length too: {opcode, x, y, width, height, pixels...}
+      if (opcode == 0x0023)
+      {
+        if (pending.size() < 10) return;
+        uint32_t pixels = (uint32_t) word(3) * word(4);
+        request_bytes = 2 * (5 + pixels);
+        if (pending.size() < request_bytes) return;
+        name = "blit_com_to_display";
+        fill = pixels;
+      }
+      // Strings are bytes up to a 0 terminator: {opcode, chars..., 0}
+      else if (opcode == 0x0018)
+      {
+        if (pending.back() != 0 || pending.size() < 3) return;
+        request_bytes = pending.size();
+        name = "put_string";
+        response_words = 1;
+        response = request_bytes - 3;
+      }
+      // Character metrics take the character as one byte: {opcode, char}.  The answer is a stand-in
+      //   8x12 cell; nothing here knows what font is selected.
+      else if (opcode == 0x001E || opcode == 0x001D)
+      {
+        if (pending.size() < 3) return;
+        request_bytes = 3;
+        name = opcode == 0x001E ? "char_width" : "char_height";
+        response_words = 1;
+        response = opcode == 0x001E ? 8 : 12;
+      }
+      // Polys carry their own length: {opcode, n, x1..xn, y1..yn, color}
+      else if (opcode == 0x0013 || opcode == 0x0014 || opcode == 0x0015)
+      {
+        if (pending.size() < 4) return;
+        uint16_t n = word(1);
+        request_bytes = 2 * (2 + 2 * n + 1);
+        if (pending.size() < request_bytes) return;
+        name = opcode == 0x0013 ? "draw_polygon" : opcode == 0x0014 ? "draw_polygon_filled" : "draw_polyline";
+        fill = opcode == 0x0014 ? area(1, n) : perimeter(1, n, opcode == 0x0013);
+      } else
+      {
+        size_t args = 0;
+        switch (opcode)
+        {
+          case 0xFF82: name = "clear"; break;
+          case 0xFF78: name = "draw_circle"; args = 4; break;
+          case 0xFF77: name = "draw_circle_filled"; args = 4; break;
+          case 0xFF7D: name = "draw_line"; args = 5; break;
+          case 0xFF7A: name = "draw_rectangle"; args = 5; break;
+          case 0xFF79: name = "draw_rectangle_filled"; args = 5; break;
+          case 0xFF74: name = "draw_triangle"; args = 7; break;
+          case 0xFF59: name = "draw_triangle_filled"; args = 7; break;
+          case 0xFF81: name = "move_origin"; args = 2; break;
+          case 0xFF41: name = "outline_color"; args = 1; response_words = 1; break;
+          case 0xFF40: name = "contrast"; args = 1; response_words = 1; break;
+          case 0xFF3F: name = "line_pattern"; args = 1; response_words = 1; break;
+          case 0xFF42: name = "screen_mode"; args = 1; response_words = 1; break;
+          case 0xFF44: name = "transparency"; args = 1; response_words = 1; break;
+          case 0xFF45: name = "transparent_color"; args = 1; response_words = 1; break;
+          case 0xFF83: name = "set_graphics_parameters"; args = 2; response_words = 1; break;
+          case 0xFF25: name = "media_init"; response_words = 1; response = 1; break;
+          case 0xFF2F: name = "media_set_byte"; args = 2; break;
+          case 0xFF2E: name = "media_set_sector"; args = 2; break;
+          case 0x0016: name = "media_read_sector"; response_words = 257; break;
+          case 0x0017: name = "media_write_sector"; args = 256; response_words = 1; response = 1; break;
+          case 0xFF27: name = "media_image_raw"; args = 2; break;
+          case 0xFF03: name = "file_mount"; response_words = 1; response = 1; break;
+          case 0xFFCF: name = "pin_set"; args = 2; response_words = 1; response = 1; break;
+          case 0xFFD2: name = "pin_hi"; args = 1; response_words = 1; response = 1; break;
+          case 0xFFD1: name = "pin_lo"; args = 1; response_words = 1; response = 1; break;
+          case 0xFFD0: name = "pin_read"; args = 1; response_words = 1; break;
+          case 0xFF86: name = "bus_read8"; response_words = 1; break;
+          case 0xFF87: name = "bus_write8"; args = 1; break;
+          case 0x0027: name = "peek_memory"; args = 1; response_words = 1; break;
+          case 0x0026: name = "set_baud"; args = 1; break;
+          case 0xFFF0: name = "move_cursor"; args = 2; break;
+          case 0xFFFE: name = "put_character"; args = 1; break;
+          case 0xFFE7: name = "text_foreground"; args = 1; response_words = 1; break;
+          case 0xFFE6: name = "text_background"; args = 1; response_words = 1; break;
+          case 0xFFDF: name = "text_opacity"; args = 1; response_words = 1; break;
+          case 0xFFE5: name = "text_font"; args = 1; response_words = 1; break;
+          case 0xFF39: name = "touch_detect_region"; args = 4; break;
+          case 0xFF38: name = "touch_set"; args = 1; break;
+          case 0xFF37: name = "touch_get"; args = 1; response_words = 1; break;
+          default: name = "unknown"; known = false; break;
+        }
+        request_bytes = 2 * (1 + args);
+        if (pending.size() < request_bytes) return;
+        switch (opcode)
+        {
+          case 0xFF82: fill = (uint32_t) screen_width * screen_height; break;
+          case 0xFF78: fill = (uint32_t) (6.2832f * arg(2)); break;
+          case 0xFF77: fill = (uint32_t) (3.1416f * arg(2) * arg(2)); break;
+          case 0xFF7D: fill = length(arg(0), arg(1), arg(2), arg(3)); break;
+          case 0xFF7A: fill = 2 * (span(arg(0), arg(2)) + span(arg(1), arg(3))); break;
+          case 0xFF79: fill = span(arg(0), arg(2)) * span(arg(1), arg(3)); break;
+          case 0xFF74: fill = perimeter(0, 3, true, true); break;
+          case 0xFF59: fill = area(0, 3, true); break;
+          case 0xFF2E: sector = ((uint32_t) word(1) << 16) | word(2); break;
+          case 0xFF27: fill = image_pixels.count(sector) ? image_pixels.at(sector) : 0; break;
+          case 0x0016: sector++; break;
+          case 0x0017: sector++; break;
+        }
+      }
+
+      records.push_back({name, current_tag, (uint32_t) (request_bytes + 1 + 2 * response_words), fill});
+      pending.erase(pending.begin(), pending.begin() + request_bytes);
+      responses.push_back(0x06);
+      for (uint16_t i = 0; i < response_words; i++)
+      {
+        responses.push_back(response >> 8);
+        responses.push_back(response & 0xFF);
+      }
+      // An unknown opcode has an unknown length, so there's no telling where the next command starts.
+      if (!known)
+      { pending.clear(); }
+    }
+  };
+}
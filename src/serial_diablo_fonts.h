@@ -0,0 +1,227 @@
+#pragma once
+
+#include <string.h>
+#include <vector>
+
+#include "serial_diablo.h"
+#include "serial_diablo_assets.h"
+
+namespace diablo
+{
+  /*
+   * A uSD font from tools/ttf_font.py, as much of it as the host needs: where it is on the card, and
+   *   its metrics, so text can be measured without asking the Diablo.
+   *
+   *   u8 type (2 = proportional), u8 count, u8 first character, u8 widest, u8 height
+   *   u8 width of each character
+   *   each character: height rows of (widest + 7) / 8 bytes, leftmost pixel in the top bit
+   */
+  struct Font
+  {
+    uint32_t sector = 0;
+    uint8_t first = 0;
+    uint8_t widest = 0;
+    uint8_t height = 0;
+    std::vector<uint8_t> widths;
+
+    bool valid() const
+    { return height != 0; }
+
+    // 0 for anything the font doesn't have.
+    uint8_t width(char c) const
+    {
+      uint8_t i = (uint8_t) c - first;
+      return (uint8_t) c >= first && i < widths.size() ? widths[i] : 0;
+    }
+
+    // In pixels.  length = how many characters, or -1 for all of them.
+    uint16_t width(const char *text, int16_t length = -1) const
+    {
+      uint16_t total = 0;
+      for (int16_t i = 0; length < 0 ? text[i] != 0 : i < length; i++) total += width(text[i]);
+      return total;
+    }
+
+    // The whole font file, in bytes.
+    size_t size() const
+    { return HEADER + widths.size() * (1 + (size_t) height * ((widest + 7) / 8)); }
+
+    /*
+     * Reads the header and the width table.  False if it isn't a font, or it's cut short.
+     */
+    bool parse(const uint8_t *data, size_t length)
+    {
+      height = 0;
+      widths.clear();
+      if (!data || length < HEADER || data[0] != PROPORTIONAL || data[4] == 0) return false;
+      first = data[2];
+      widest = data[3];
+      height = data[4];
+      widths.assign(data + HEADER, data + HEADER + std::min<size_t>(data[1], length - HEADER));
+      if (widths.size() < data[1] || size() > length)
+      {
+        height = 0;
+        widths.clear();
+        return false;
+      }
+      return true;
+    }
+
+  private:
+    static const uint8_t PROPORTIONAL = 2;
+    static const size_t HEADER = 5;
+  };
+
+  /*
+   * Fonts on the card, for labels that are big enough to read on a 7" panel without being images.
+   *   An image of a label is tens of KB on the wire, every time.  With the font on the card, it's the
+   *   string: a 20 character label is 2 commands and about 30 bytes.
+   *
+   *   tools/ttf_font.py DejaVuSans.ttf 24,48 fonts/sans
+   *   tools/asset_pack.py panel.pack sans24=fonts/sans-24.fnt sans48=fonts/sans-48.fnt
+   *
+   * diablo::Fonts fonts(diablo16);
+   * diablo::Fonts::Id big = fonts.upload(assets, assets.find("sans48"), 4096);  // Once; after that, add().
+   * fonts.label(big, 10, 10, "Pressure");
+   * uint16_t x = 10 + fonts[big].width("Pressure ");
+   *
+   * Fonts keeps track of which one is selected, and only switches (2 commands, each a round trip) when
+   *   the next label wants a different one.  Group labels by font to keep that down.
+   *
+   * NOTE:  The Diablo keeps the font's address from when it's selected.  Anything else that changes the
+   *   font behind our back - text_font(), a Hud printing in the system font - should be followed by
+   *   forget(), so the next label selects it again.
+   */
+  class Fonts
+  {
+  public:
+    typedef uint8_t Id;
+    static const Id NONE = 0xFF;
+    // The built-in font.  Not measurable from here: TextLayout asks the Diablo.
+    static const Id SYSTEM = 0xFE;
+
+    explicit Fonts(Diablo &diablo) :
+        log("app.diablo.fonts"),
+        diablo(&diablo)
+    {}
+
+    /*
+     * Copies a font file to the card from sector on, and adds it.  Blocks.  NONE if it isn't a font, or
+     *   the card refused a sector.
+     */
+    Id upload(const uint8_t *font, size_t length, uint32_t sector, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      Font f;
+      if (!parse(f, font, length, sector)) return NONE;
+      size_t whole = f.size() / 512 * 512;
+      diablo->media_set_sector(sector, log_level);
+      for (size_t at = 0; at < whole; at += 512)
+      {
+        if (!diablo->media_write_sector(font + at, log_level)) return refused(at / 512);
+      }
+      if (whole < f.size())
+      {
+        uint8_t tail[512] = {0};
+        memcpy(tail, font + whole, f.size() - whole);
+        if (!diablo->media_write_sector(tail, log_level)) return refused(whole / 512);
+      }
+      return add(f);
+    }
+
+    // Same, out of an asset pack.
+    Id upload(AssetPack &pack, const Asset &asset, uint32_t sector, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      Font f;
+      if (!parse(f, asset.data, asset.length, sector)) return NONE;
+      if (!pack.upload(*diablo, asset, sector, log_level)) return NONE;
+      return add(f);
+    }
+
+    /*
+     * A font that's already on the card at sector, from an earlier boot.  font is the same file, for
+     *   its metrics; nothing is sent.
+     */
+    Id add(const uint8_t *font, size_t length, uint32_t sector)
+    {
+      Font f;
+      return parse(f, font, length, sector) ? add(f) : NONE;
+    }
+
+    size_t size() const
+    { return fonts.size(); }
+
+    const Font &operator[](Id id) const
+    { return fonts[id]; }
+
+    /*
+     * Makes it the font text gets printed in, unless it already is.
+     */
+    void use(Id id, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      if (id >= fonts.size() || id == selected) return;
+      diablo->media_set_sector(fonts[id].sector, log_level);
+      diablo->text_font(Diablo::FONT_MEDIA, log_level);
+      selected = id;
+    }
+
+    // Back to the built-in font.
+    void system(LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      if (selected == SYSTEM) return;
+      diablo->text_font(Diablo::FONT_SYSTEM, log_level);
+      selected = SYSTEM;
+    }
+
+    // Whatever is selected now, it isn't what we think.
+    void forget()
+    { selected = NONE; }
+
+    /*
+     * Prints text in a font with its top left at x, y, in the current text colors.  Returns how wide it
+     *   came out, in pixels.
+     */
+    uint16_t label(Id id, uint16_t x, uint16_t y, const char *text, int16_t length = -1,
+                   LogLevel log_level = LOG_LEVEL_TRACE, bool blocking = false)
+    {
+      if (id >= fonts.size()) return 0;
+      use(id, log_level);
+      diablo->move_origin(x, y, log_level);
+      diablo->put_string(text, length, log_level, blocking);
+      return fonts[id].width(text, length);
+    }
+
+  private:
+    Logger log;
+    Diablo *diablo;
+    std::vector<Font> fonts;
+    Id selected = NONE;
+
+    bool parse(Font &f, const uint8_t *font, size_t length, uint32_t sector)
+    {
+      if (!f.parse(font, length))
+      {
+        log.error("Not a font");
+        return false;
+      }
+      f.sector = sector;
+      return true;
+    }
+
+    Id add(const Font &f)
+    {
+      if (fonts.size() >= SYSTEM)
+      {
+        log.error("Too many fonts");
+        return NONE;
+      }
+      fonts.push_back(f);
+      return fonts.size() - 1;
+    }
+
+    Id refused(size_t at)
+    {
+      log.error("Font upload failed at sector %lu", (unsigned long) at);
+      return NONE;
+    }
+  };
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include "serial_diablo.h"
+
+namespace diablo
+{
+  // 8 bits a channel in, RGB565 out.
+  constexpr uint16_t rgb565(uint8_t r, uint8_t g, uint8_t b)
+  { return ((uint16_t) (r & 0xF8) << 8) | ((uint16_t) (g & 0xFC) << 3) | (b >> 3); }
+
+  /*
+   * Values to RGB565 through a 256 entry lookup table, built once up front.
+   * Stops are spread evenly from low to high and blended in between (in 8 bit RGB, before packing),
+   *   so a lookup is a subtract, a multiply and an index.
+   */
+  class ColorMap
+  {
+  public:
+    // {r, g, b} each.
+    struct Stop
+    {
+      uint8_t r;
+      uint8_t g;
+      uint8_t b;
+    };
+
+    ColorMap(float low, float high, const std::vector<Stop> &stops) :
+        low(low),
+        scale(high > low ? 255.0f / (high - low) : 0)
+    {
+      for (uint16_t i = 0; i < 256; i++)
+      {
+        if (stops.size() < 2)
+        {
+          table[i] = stops.empty() ? 0 : rgb565(stops[0].r, stops[0].g, stops[0].b);
+          continue;
+        }
+        float at = i * (stops.size() - 1) / 255.0f;
+        size_t first = std::min((size_t) at, stops.size() - 2);
+        float t = at - first;
+        const Stop &a = stops[first], &b = stops[first + 1];
+        table[i] = rgb565((uint8_t) (a.r + (b.r - a.r) * t + 0.5f),
+                          (uint8_t) (a.g + (b.g - a.g) * t + 0.5f),
+                          (uint8_t) (a.b + (b.b - a.b) * t + 0.5f));
+      }
+    }
+
+    // Blue, cyan, green, yellow, red.
+    static ColorMap heat(float low, float high)
+    { return ColorMap(low, high, {{0, 0, 255}, {0, 255, 255}, {0, 255, 0}, {255, 255, 0}, {255, 0, 0}}); }
+
+    uint16_t operator()(float value) const
+    {
+      float index = (value - low) * scale;
+      return table[index <= 0 ? 0 : index >= 255 ? 255 : (uint8_t) index];
+    }
+
+  private:
+    float low;
+    float scale;
+    uint16_t table[256];
+  };
+
+  /*
+   * A columns x rows grid of colored cells (status matrix, heatmap) that only ever sends what changed.
+   *
+   * It remembers the color each cell has on screen.  update() walks the grid row by row and sends a
+   *   draw_rectangle_filled for each run of changed cells that want the same color - a cell whose value
+   *   moved but whose color didn't costs nothing.  A first paint of a flat grid is one rectangle per row.
+   *
+   * diablo::ColorMap heat = diablo::ColorMap::heat(0, 100);
+   * diablo::Grid status(diablo16, 10, 10, 24, 16, 30, 25, heat);
+   *
+   * void on_poll()
+   * {
+   *   for (uint8_t row = 0; row < 16; row++)
+   *     for (uint8_t column = 0; column < 24; column++) status.set(column, row, load[row][column]);
+   *   diablo16.defer("status grid", [] { status.update(); });
+   * }
+   *
+   * gap = background pixels between cells, which are never drawn.  Runs only merge when gap is 0,
+   *   since a merged rectangle would paint over the gaps.
+   */
+  class Grid
+  {
+  public:
+    Grid(Diablo &diablo,
+         uint16_t x,
+         uint16_t y,
+         uint16_t columns,
+         uint16_t rows,
+         uint16_t cell_width,
+         uint16_t cell_height,
+         const ColorMap &color_map,
+         uint16_t gap = 0) :
+        diablo(&diablo),
+        x(x),
+        y(y),
+        columns(columns),
+        rows(rows),
+        cell_width(cell_width),
+        cell_height(cell_height),
+        gap(gap),
+        color_map(color_map),
+        wanted((size_t) columns * rows, 0),
+        shown((size_t) columns * rows, 0),
+        on_screen((size_t) columns * rows, false)
+    {}
+
+    // Through the color map.
+    void set(uint16_t column, uint16_t row, float value)
+    { set_color(column, row, color_map(value)); }
+
+    void set_color(uint16_t column, uint16_t row, uint16_t color)
+    {
+      if (column < columns && row < rows) wanted[(size_t) row * columns + column] = color;
+    }
+
+    uint16_t color(uint16_t column, uint16_t row) const
+    { return wanted[(size_t) row * columns + column]; }
+
+    // Forget what's on screen (after a clear(), say); the next update() draws every cell.
+    void invalidate()
+    { std::fill(on_screen.begin(), on_screen.end(), false); }
+
+    /*
+     * Sends the changes.  Returns how many rectangles that took.
+     */
+    uint16_t update(LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      uint16_t rectangles = 0;
+      for (uint16_t row = 0; row < rows; row++)
+      {
+        size_t base = (size_t) row * columns;
+        uint16_t column = 0;
+        while (column < columns)
+        {
+          if (!changed(base + column))
+          {
+            column++;
+            continue;
+          }
+          uint16_t color = wanted[base + column];
+          uint16_t end = column + 1;
+          if (gap == 0)
+          {
+            while (end < columns && changed(base + end) && wanted[base + end] == color) end++;
+          }
+          uint16_t x1 = x + column * (cell_width + gap);
+          uint16_t y1 = y + row * (cell_height + gap);
+          uint16_t x2 = x + end * (cell_width + gap) - gap - 1;
+          diablo->draw_rectangle_filled(x1, y1, x2, y1 + cell_height - 1, color, log_level);
+          rectangles++;
+          for (uint16_t c = column; c < end; c++)
+          {
+            shown[base + c] = color;
+            on_screen[base + c] = true;
+          }
+          column = end;
+        }
+      }
+      last_rectangles = rectangles;
+      return rectangles;
+    }
+
+    // Rectangles the last update() sent.
+    uint16_t sent() const
+    { return last_rectangles; }
+
+  private:
+    Diablo *diablo;
+    uint16_t x;
+    uint16_t y;
+    uint16_t columns;
+    uint16_t rows;
+    uint16_t cell_width;
+    uint16_t cell_height;
+    uint16_t gap;
+    ColorMap color_map;
+    std::vector<uint16_t> wanted;
+    std::vector<uint16_t> shown;
+    std::vector<bool> on_screen;
+    uint16_t last_rectangles = 0;
+
+    bool changed(size_t cell) const
+    { return !on_screen[cell] || shown[cell] != wanted[cell]; }
+  };
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include "serial_diablo_metrics.h"
+#include <stdio.h>
+
+namespace diablo
+{
+  /*
+   * A little performance readout in a corner of the screen, for commissioning without a laptop.
+   *
+   * cmd/s    123   commands per second
+   * link     45%   outbound link utilization
+   * p95   12.3ms   95th percentile ACK latency over the last period
+   * queue      4   deferred things waiting
+   * dup        3   deferred updates coalesced, over the last period
+   * drop       0   commands failed + deferred things invalidated before they ran, over the last period
+   *
+   * It's text, drawn with the current font, at a line/column in character cells.  Each refresh only
+   *   sends the characters that changed, at most max_characters of them; anything over budget waits
+   *   for the next refresh.  So the worst case cost is a fixed handful of commands every period_ms.
+   * The text colors are set and put back with one burst each, not waited on, and only on a paint
+   *   that has something to send.
+   * Everything it sends is billed to the "hud" overhead in the Metrics, not the app's numbers.
+   *
+   * diablo::Metrics metrics(200000);
+   * diablo::Hud hud(diablo16, metrics, 200000, 0, 88);   // Top right of an 800px wide screen in font 0.
+   * diablo16.observe(&metrics);
+   *
+   * void loop() { hud.update(); diablo16.advance(); }
+   *
+   * NOTE:  After a clear() the HUD is gone but doesn't know it.  Call invalidate() to get it all back.
+   */
+  class Hud
+  {
+  public:
+    static const uint8_t LINES = 6;
+    static const uint8_t WIDTH = 11;
+
+    Hud(Diablo &diablo,
+        Metrics &metrics,
+        uint32_t baud,
+        uint16_t line,
+        uint16_t column,
+        uint32_t period_ms = 1000,
+        uint16_t max_characters = 24,
+        uint16_t foreground = 0xFFE0,
+        uint16_t background = 0x0000) :
+        diablo(&diablo),
+        metrics(&metrics),
+        baud(baud),
+        line(line),
+        column(column),
+        period_ms(period_ms),
+        max_characters(max_characters),
+        foreground(foreground),
+        background(background)
+    {
+      invalidate();
+    }
+
+    // Call from loop().  Cheap unless a refresh is due.
+    void update()
+    {
+      unsigned long now = millis();
+      if (now - last_refresh < period_ms) return;
+      float seconds = (now - last_refresh) / 1000.0f;
+      last_refresh = now;
+
+      const CommandStats &totals = metrics->totals();
+      uint32_t commands = totals.commands - last_commands;
+      uint32_t bytes = totals.bytes - last_bytes;
+      uint32_t failures = totals.failures - last_failures;
+      uint32_t coalesced = diablo->coalesced_count() - last_coalesced;
+      uint32_t skipped = diablo->skipped_count() - last_skipped;
+      uint32_t p95 = totals.total.since(last_latency).percentile(0.95f);
+      last_commands = totals.commands;
+      last_bytes = totals.bytes;
+      last_failures = totals.failures;
+      last_coalesced = diablo->coalesced_count();
+      last_skipped = diablo->skipped_count();
+      last_latency = totals.total;
+
+      // 8N1: 10 bits per byte.
+      uint32_t link = (uint32_t) (bytes * 10 * 100.0f / (baud * seconds));
+      format(0, "cmd/s", "%lu", (unsigned long) (commands / seconds));
+      format(1, "link", "%lu%%", (unsigned long) std::min<uint32_t>(link, 999));
+      format(2, "p95", "%lu.%lums", (unsigned long) (p95 / 1000), (unsigned long) (p95 % 1000 / 100));
+      format(3, "queue", "%lu", (unsigned long) diablo->queued());
+      format(4, "dup", "%lu", (unsigned long) coalesced);
+      format(5, "drop", "%lu", (unsigned long) (failures + skipped));
+
+      // Only one paint in line at a time, and it reads `wanted` when it runs, so it's always fresh.
+      if (paint_queued) return;
+      paint_queued = true;
+      diablo->defer("hud", [this]() { paint(); });
+    }
+
+    // The link's new rate, after a baud change (see serial_diablo_baud.h).
+    void set_baud(uint32_t new_baud)
+    { baud = new_baud; }
+
+    // Forget what's on screen; the next refresh repaints everything.
+    void invalidate()
+    {
+      for (uint8_t i = 0; i < LINES; i++)
+      {
+        memset(shown[i], 0, sizeof(shown[i]));
+        memset(wanted[i], ' ', WIDTH);
+        wanted[i][WIDTH] = 0;
+      }
+    }
+
+  private:
+    Diablo *diablo;
+    Metrics *metrics;
+    uint32_t baud;
+    uint16_t line;
+    uint16_t column;
+    uint32_t period_ms;
+    uint16_t max_characters;
+    uint16_t foreground;
+    uint16_t background;
+    unsigned long last_refresh = 0;
+    uint32_t last_commands = 0;
+    uint32_t last_bytes = 0;
+    uint32_t last_failures = 0;
+    uint32_t last_coalesced = 0;
+    uint32_t last_skipped = 0;
+    Histogram last_latency;
+    bool paint_queued = false;
+    // The app's text colors, as the last paint found them.
+    bool saved = false;
+    uint16_t saved_foreground = 0, saved_background = 0, saved_opacity = 0;
+    char shown[LINES][WIDTH + 1];
+    char wanted[LINES][WIDTH + 1];
+
+    // Label on the left, value on the right, padded out to WIDTH.
+    template<typename... Args>
+    void format(uint8_t index, const char *label, const char *value_format, Args... args)
+    {
+      char value[WIDTH + 1];
+      snprintf(value, sizeof(value), value_format, args...);
+      snprintf(wanted[index], WIDTH + 1, "%-*s%*s", (int) (WIDTH - strlen(value)), label, (int) strlen(value), value);
+    }
+
+    void paint()
+    {
+      paint_queued = false;
+      metrics->overhead("hud");
+      uint16_t budget = max_characters;
+      bool colors_set = false;
+      saved = false;
+      for (uint8_t i = 0; i < LINES && budget > 0; i++)
+      {
+        uint8_t c = 0;
+        while (c < WIDTH && budget > 0)
+        {
+          if (shown[i][c] == wanted[i][c])
+          {
+            c++;
+            continue;
+          }
+          // Stretch the run over short stretches of unchanged characters: resending a couple of
+          //   bytes is cheaper than another 6 byte move_cursor.
+          uint8_t end = c + 1, same = 0;
+          for (uint8_t k = c + 1; k < WIDTH && same <= 3; k++)
+          {
+            if (shown[i][k] == wanted[i][k]) same++;
+            else
+            {
+              end = k + 1;
+              same = 0;
+            }
+          }
+          uint8_t length = std::min<uint16_t>(end - c, budget);
+          if (!colors_set)
+          {
+            // The answers are in by the time move_cursor() goes out: it collects them first.
+            diablo->text_colors(foreground, background, 1, [this](bool ok, uint16_t f, uint16_t b, uint16_t o) {
+              saved = ok;
+              saved_foreground = f;
+              saved_background = b;
+              saved_opacity = o;
+            });
+            colors_set = true;
+          }
+          diablo->move_cursor(line + i, column + c);
+          diablo->put_string(wanted[i] + c, length);
+          memcpy(shown[i] + c, wanted[i] + c, length);
+          budget -= length;
+          c += length;
+        }
+      }
+      // If the colors never came back there's nothing to put back.
+      if (colors_set && saved) diablo->text_colors(saved_foreground, saved_background, saved_opacity);
+      metrics->overhead(nullptr);
+    }
+  };
+}
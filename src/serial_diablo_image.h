@@ -0,0 +1,725 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__linux__)
+#include <stdio.h>
+#endif
+
+#include "serial_diablo.h"
+
+namespace diablo
+{
+  /*
+   * PNG and QOI images straight onto the panel, a band of rows at a time: decode a band, convert it to
+   *   big-endian RGB565, blit it, decode the next while that one's still going out.  Nothing ever
+   *   holds the whole image - not the file, not the pixels.
+   *
+   * diablo::image::show(diablo16, diablo::image::from_file(fopen("/opt/panel/map.png", "rb")), 0, 0);
+   *
+   * What it costs in RAM, besides the band (4KB by default, and never less than a row):
+   *   QOI:  nothing worth mentioning.
+   *   PNG:  two scanlines and inflate's 32KB window.
+   *
+   * PNG: any colour type, any bit depth, not interlaced (Adam7 needs the whole image before the first
+   *   row is done).  16 bit channels lose their low byte.  Checksums aren't checked, and neither are
+   *   tRNS colour keys on grey and RGB images; palette transparency works.
+   * Alpha (PNG or QOI) is blended over a background colour, since the panel has nothing underneath
+   *   to blend with.
+   */
+  namespace image
+  {
+    // Fills into with up to most bytes of the file, and says how many.  0 means the end.
+    typedef std::function<size_t(uint8_t *into, size_t most)> Source;
+
+    inline Source from_memory(const void *data, size_t size)
+    {
+      const uint8_t *bytes = (const uint8_t *) data;
+      size_t at = 0;
+      return [bytes, size, at](uint8_t *into, size_t most) mutable -> size_t {
+        size_t n = std::min(most, size - at);
+        memcpy(into, bytes + at, n);
+        at += n;
+        return n;
+      };
+    }
+
+#if defined(__linux__)
+    // Closes the file when it's done with it.
+    inline Source from_file(FILE *file)
+    {
+      std::shared_ptr<FILE> f(file, [](FILE *f) { if (f) fclose(f); });
+      return [f](uint8_t *into, size_t most) -> size_t { return f ? fread(into, 1, most, f.get()) : 0; };
+    }
+#endif
+
+    // A Source, a few hundred bytes at a time.
+    class Input
+    {
+    public:
+      explicit Input(Source source) :
+          source(source)
+      {}
+
+      // -1 at the end.
+      int byte()
+      {
+        if (at == filled && !ensure(1)) return -1;
+        return buffer[at++];
+      }
+
+      bool read(uint8_t *into, size_t count)
+      {
+        while (count > 0)
+        {
+          if (at == filled && !ensure(1)) return false;
+          size_t n = std::min(count, filled - at);
+          memcpy(into, buffer + at, n);
+          at += n;
+          into += n;
+          count -= n;
+        }
+        return true;
+      }
+
+      bool skip(uint32_t count)
+      {
+        while (count > 0)
+        {
+          if (at == filled && !ensure(1)) return false;
+          size_t n = std::min<size_t>(count, filled - at);
+          at += n;
+          count -= n;
+        }
+        return true;
+      }
+
+      uint32_t be32()
+      {
+        uint8_t b[4] = {0};
+        read(b, 4);
+        return (uint32_t) b[0] << 24 | (uint32_t) b[1] << 16 | (uint32_t) b[2] << 8 | b[3];
+      }
+
+      // The next count bytes, without taking them.
+      bool peek(uint8_t *into, size_t count)
+      {
+        if (!ensure(count)) return false;
+        memcpy(into, buffer + at, count);
+        return true;
+      }
+
+    private:
+      Source source;
+      uint8_t buffer[512];
+      size_t at = 0;
+      size_t filled = 0;
+
+      bool ensure(size_t count)
+      {
+        if (filled - at >= count) return true;
+        memmove(buffer, buffer + at, filled - at);
+        filled -= at;
+        at = 0;
+        while (filled < count)
+        {
+          size_t n = source(buffer + filled, sizeof(buffer) - filled);
+          if (n == 0) return false;
+          filled += n;
+        }
+        return true;
+      }
+    };
+
+    /*
+     * Something that hands out rows of big-endian RGB565, top to bottom.
+     */
+    class Decoder
+    {
+    public:
+      virtual ~Decoder()
+      {}
+
+      // Reads the header.  False if it isn't an image this decoder can do.
+      virtual bool begin() = 0;
+
+      // The next row: width * 2 bytes.  False if the file is broken or ran out.
+      virtual bool row(uint8_t *out) = 0;
+
+      uint16_t width = 0;
+      uint16_t height = 0;
+
+    protected:
+      Decoder(Input &input, uint16_t background) :
+          input(input),
+          background_r((background >> 8 & 0xF8) | background >> 13),
+          background_g((background >> 3 & 0xFC) | (background >> 9 & 0x03)),
+          background_b((background << 3 & 0xF8) | (background >> 2 & 0x07))
+      {}
+
+      Input &input;
+
+      void put(uint8_t *&out, uint8_t r, uint8_t g, uint8_t b, uint8_t a = 255) const
+      {
+        if (a != 255)
+        {
+          r = blend(r, background_r, a);
+          g = blend(g, background_g, a);
+          b = blend(b, background_b, a);
+        }
+        *out++ = (r & 0xF8) | g >> 5;
+        *out++ = (g << 3 & 0xE0) | b >> 3;
+      }
+
+    private:
+      uint8_t background_r, background_g, background_b;
+
+      static uint8_t blend(uint8_t over, uint8_t under, uint8_t alpha)
+      { return (over * alpha + under * (255 - alpha) + 127) / 255; }
+    };
+
+    /*
+     * QOI: https://qoiformat.org/qoi-specification.pdf.  Made for exactly this - one pass, 64 remembered
+     *   colours, nothing else.
+     */
+    class QoiDecoder : public Decoder
+    {
+    public:
+      QoiDecoder(Input &input, uint16_t background = 0) :
+          Decoder(input, background)
+      {}
+
+      bool begin() override
+      {
+        uint8_t magic[4];
+        if (!input.read(magic, 4) || memcmp(magic, "qoif", 4) != 0) return false;
+        uint32_t w = input.be32();
+        uint32_t h = input.be32();
+        if (!input.skip(2) || w == 0 || h == 0 || w > 0xFFFF || h > 0xFFFF) return false;
+        width = w;
+        height = h;
+        return true;
+      }
+
+      bool row(uint8_t *out) override
+      {
+        for (uint16_t x = 0; x < width; x++)
+        {
+          if (run > 0) run--;
+          else if (!next()) return false;
+          put(out, px[0], px[1], px[2], px[3]);
+        }
+        return true;
+      }
+
+    private:
+      uint8_t index[64][4] = {{0}};
+      uint8_t px[4] = {0, 0, 0, 255};
+      uint8_t run = 0;
+
+      bool next()
+      {
+        int op = input.byte();
+        if (op < 0) return false;
+        if (op == 0xFE || op == 0xFF)
+        {
+          if (!input.read(px, op == 0xFE ? 3 : 4)) return false;
+        }
+        else if ((op & 0xC0) == 0x00)
+        { memcpy(px, index[op], 4); }
+        else if ((op & 0xC0) == 0x40)
+        {
+          px[0] += (op >> 4 & 3) - 2;
+          px[1] += (op >> 2 & 3) - 2;
+          px[2] += (op & 3) - 2;
+        }
+        else if ((op & 0xC0) == 0x80)
+        {
+          int b = input.byte();
+          if (b < 0) return false;
+          int dg = (op & 0x3F) - 32;
+          px[0] += dg - 8 + (b >> 4);
+          px[1] += dg;
+          px[2] += dg - 8 + (b & 0x0F);
+        }
+        else
+        { run = op & 0x3F; }
+        memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+        return true;
+      }
+    };
+
+    /*
+     * Deflate (RFC 1951), pulled a byte at a time.  Canonical Huffman codes decoded a bit at a time, the
+     *   way zlib's puff does it: small and slow, which is still tens of MB/s against a link that moves
+     *   tens of KB/s.
+     */
+    class Inflate
+    {
+    public:
+      explicit Inflate(std::function<int()> input) :
+          input(input),
+          window(WINDOW)
+      {}
+
+      // -1 at the end of the stream, or if it's broken (see failed()).
+      int next()
+      {
+        while (!broken)
+        {
+          if (match_length > 0)
+          {
+            match_length--;
+            return put(window[(position - match_distance) & (WINDOW - 1)]);
+          }
+          switch (mode)
+          {
+            case HEADER:
+              if (last) return -1;
+              if (!block()) broken = true;
+              break;
+            case STORED:
+              if (stored_left == 0)
+              {
+                mode = HEADER;
+                break;
+              }
+              {
+                int b = input();
+                if (b < 0)
+                {
+                  broken = true;
+                  break;
+                }
+                stored_left--;
+                return put(b);
+              }
+            case CODES:
+              if (!symbol()) broken = true;
+              else if (literal >= 0) return put(literal);
+              break;
+          }
+        }
+        return -1;
+      }
+
+      bool failed() const
+      { return broken; }
+
+    private:
+      static const uint32_t WINDOW = 32768;
+      enum Mode { HEADER, STORED, CODES };
+
+      struct Huffman
+      {
+        uint16_t count[16];
+        uint16_t symbol[288];
+      };
+
+      std::function<int()> input;
+      std::vector<uint8_t> window;
+      uint32_t position = 0;
+      uint32_t bit_buffer = 0;
+      uint8_t bit_count = 0;
+      bool last = false;
+      bool broken = false;
+      Mode mode = HEADER;
+      uint16_t stored_left = 0;
+      uint16_t match_length = 0;
+      uint16_t match_distance = 0;
+      int literal = -1;
+      Huffman lengths, distances;
+
+      int put(uint8_t b)
+      {
+        window[position++ & (WINDOW - 1)] = b;
+        return b;
+      }
+
+      uint32_t bits(uint8_t need)
+      {
+        while (bit_count < need)
+        {
+          int b = input();
+          if (b < 0)
+          {
+            broken = true;
+            return 0;
+          }
+          bit_buffer |= (uint32_t) b << bit_count;
+          bit_count += 8;
+        }
+        uint32_t value = bit_buffer & ((1UL << need) - 1);
+        bit_buffer >>= need;
+        bit_count -= need;
+        return value;
+      }
+
+      int decode(const Huffman &h)
+      {
+        int code = 0, first = 0, index = 0;
+        for (uint8_t length = 1; length < 16; length++)
+        {
+          code |= bits(1);
+          int count = h.count[length];
+          if (code - count < first) return h.symbol[index + (code - first)];
+          index += count;
+          first += count;
+          first <<= 1;
+          code <<= 1;
+        }
+        return -1;
+      }
+
+      // Returns how many codes are left unused: < 0 is over-subscribed, > 0 incomplete.
+      static int construct(Huffman &h, const uint16_t *length, uint16_t n)
+      {
+        memset(h.count, 0, sizeof(h.count));
+        for (uint16_t s = 0; s < n; s++) h.count[length[s]]++;
+        if (h.count[0] == n) return 0;
+        int left = 1;
+        for (uint8_t l = 1; l < 16; l++)
+        {
+          left <<= 1;
+          left -= h.count[l];
+          if (left < 0) return left;
+        }
+        uint16_t offsets[16];
+        offsets[1] = 0;
+        for (uint8_t l = 1; l < 15; l++) offsets[l + 1] = offsets[l] + h.count[l];
+        for (uint16_t s = 0; s < n; s++)
+        {
+          if (length[s]) h.symbol[offsets[length[s]]++] = s;
+        }
+        return left;
+      }
+
+      bool block()
+      {
+        last = bits(1);
+        switch (bits(2))
+        {
+          case 0:
+          {
+            bit_buffer = 0;
+            bit_count = 0;
+            uint8_t b[4];
+            for (uint8_t i = 0; i < 4; i++)
+            {
+              int v = input();
+              if (v < 0) return false;
+              b[i] = v;
+            }
+            stored_left = b[0] | b[1] << 8;
+            if ((uint16_t) ~(b[2] | b[3] << 8) != stored_left) return false;
+            mode = STORED;
+            return true;
+          }
+          case 1:
+          {
+            uint16_t length[288];
+            uint16_t s = 0;
+            for (; s < 144; s++) length[s] = 8;
+            for (; s < 256; s++) length[s] = 9;
+            for (; s < 280; s++) length[s] = 7;
+            for (; s < 288; s++) length[s] = 8;
+            construct(lengths, length, 288);
+            for (s = 0; s < 30; s++) length[s] = 5;
+            construct(distances, length, 30);
+            mode = CODES;
+            return !broken;
+          }
+          case 2:
+            mode = CODES;
+            return dynamic() && !broken;
+          default:
+            return false;
+        }
+      }
+
+      bool dynamic()
+      {
+        static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+        uint16_t length[320];
+        uint16_t literals = bits(5) + 257;
+        uint16_t dists = bits(5) + 1;
+        uint8_t codes = bits(4) + 4;
+        if (literals > 286 || dists > 30) return false;
+        memset(length, 0, sizeof(length));
+        for (uint8_t i = 0; i < codes; i++) length[order[i]] = bits(3);
+        if (construct(lengths, length, 19) != 0) return false;
+        uint16_t index = 0;
+        while (index < literals + dists)
+        {
+          int s = decode(lengths);
+          if (s < 0 || broken) return false;
+          if (s < 16)
+          {
+            length[index++] = s;
+            continue;
+          }
+          uint16_t repeat_length = 0;
+          if (s == 16)
+          {
+            if (index == 0) return false;
+            repeat_length = length[index - 1];
+            s = 3 + bits(2);
+          }
+          else if (s == 17) s = 3 + bits(3);
+          else s = 11 + bits(7);
+          if (index + s > literals + dists) return false;
+          while (s--) length[index++] = repeat_length;
+        }
+        if (length[256] == 0) return false;
+        int left = construct(lengths, length, literals);
+        if (left < 0 || (left > 0 && literals - lengths.count[0] != 1)) return false;
+        left = construct(distances, length + literals, dists);
+        return !(left < 0 || (left > 0 && dists - distances.count[0] != 1));
+      }
+
+      // One literal/length symbol: sets literal, or queues up a match, or ends the block.
+      bool symbol()
+      {
+        static const uint16_t length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                                 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                                 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        static const uint16_t distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                                   257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                                   8193, 12289, 16385, 24577};
+        static const uint8_t distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                                   7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+        literal = -1;
+        int s = decode(lengths);
+        if (s < 0 || broken) return false;
+        if (s < 256)
+        {
+          literal = s;
+          return true;
+        }
+        if (s == 256)
+        {
+          mode = HEADER;
+          return true;
+        }
+        s -= 257;
+        if (s >= 29) return false;
+        uint16_t length = length_base[s] + bits(length_extra[s]);
+        int d = decode(distances);
+        if (d < 0 || d >= 30) return false;
+        uint32_t distance = distance_base[d] + bits(distance_extra[d]);
+        if (distance > position || distance > WINDOW) return false;
+        match_length = length;
+        match_distance = distance;
+        return !broken;
+      }
+    };
+
+    /*
+     * PNG, one scanline at a time: IDAT chunks -> inflate -> unfilter against the previous line -> RGB565.
+     */
+    class PngDecoder : public Decoder
+    {
+    public:
+      PngDecoder(Input &input, uint16_t background = 0) :
+          Decoder(input, background),
+          inflate([this]() -> int { return idat_byte(); })
+      {}
+
+      bool begin() override
+      {
+        static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+        uint8_t magic[8];
+        if (!input.read(magic, 8) || memcmp(magic, signature, 8) != 0) return false;
+        if (!chunk() || type != IHDR || chunk_left != 13) return false;
+        uint32_t w = input.be32();
+        uint32_t h = input.be32();
+        uint8_t header[5];
+        if (!input.read(header, 5) || !input.skip(4)) return false;
+        depth = header[0];
+        colour = header[1];
+        if (w == 0 || h == 0 || w > 0xFFFF || h > 0xFFFF || header[2] != 0 || header[3] != 0) return false;
+        if (header[4] != 0) return false; // Interlaced.
+        channels = colour == 0 ? 1 : colour == 2 ? 3 : colour == 3 ? 1 : colour == 4 ? 2 : colour == 6 ? 4 : 0;
+        bool depth_ok = depth == 8 || (depth == 16 && colour != 3) || (depth < 8 && (colour == 0 || colour == 3) &&
+                                                                       (depth == 1 || depth == 2 || depth == 4));
+        if (channels == 0 || !depth_ok) return false;
+        width = w;
+        height = h;
+        pixel_bytes = std::max(1, channels * depth / 8);
+        line_bytes = ((uint32_t) width * channels * depth + 7) / 8;
+        line.assign(line_bytes, 0);
+        previous.assign(line_bytes, 0);
+        if (colour == 3) palette.assign(256 * 4, 255);
+
+        // Everything up to the first IDAT: PLTE and tRNS are the only ones that matter.
+        while (chunk() && type != IDAT)
+        {
+          if (type == PLTE && colour == 3)
+          {
+            for (uint32_t i = 0; i < 256 && chunk_left >= 3; i++, chunk_left -= 3) input.read(&palette[i * 4], 3);
+          }
+          else if (type == TRNS && colour == 3)
+          {
+            for (uint32_t i = 0; i < 256 && chunk_left >= 1; i++, chunk_left--) input.read(&palette[i * 4 + 3], 1);
+          }
+          if (!input.skip(chunk_left + 4)) return false;
+        }
+        if (type != IDAT) return false;
+        // zlib's two byte header: deflate, no preset dictionary.
+        int cmf = idat_byte();
+        int flg = idat_byte();
+        return cmf >= 0 && flg >= 0 && (cmf & 0x0F) == 8 && (cmf << 8 | flg) % 31 == 0 && !(flg & 0x20);
+      }
+
+      bool row(uint8_t *out) override
+      {
+        int filter = inflate.next();
+        if (filter < 0 || filter > 4) return false;
+        for (uint32_t i = 0; i < line_bytes; i++)
+        {
+          int b = inflate.next();
+          if (b < 0) return false;
+          uint8_t a = i >= pixel_bytes ? line[i - pixel_bytes] : 0;
+          uint8_t up = previous[i];
+          uint8_t corner = i >= pixel_bytes ? previous[i - pixel_bytes] : 0;
+          switch (filter)
+          {
+            case 1: b += a; break;
+            case 2: b += up; break;
+            case 3: b += (a + up) / 2; break;
+            case 4: b += paeth(a, up, corner); break;
+          }
+          line[i] = b;
+        }
+        convert(out);
+        line.swap(previous);
+        return true;
+      }
+
+    private:
+      static const uint32_t IHDR = 0x49484452;
+      static const uint32_t PLTE = 0x504C5445;
+      static const uint32_t TRNS = 0x74524E53;
+      static const uint32_t IDAT = 0x49444154;
+
+      Inflate inflate;
+      uint32_t type = 0;
+      uint32_t chunk_left = 0;
+      uint8_t depth = 0;
+      uint8_t colour = 0;
+      uint8_t channels = 0;
+      uint8_t pixel_bytes = 1;
+      uint32_t line_bytes = 0;
+      std::vector<uint8_t> line, previous, palette;
+
+      bool chunk()
+      {
+        chunk_left = input.be32();
+        type = input.be32();
+        return chunk_left < 0x80000000UL && type != 0;
+      }
+
+      // The compressed stream carries on from one IDAT into the next.
+      int idat_byte()
+      {
+        if (type != IDAT) return -1;
+        while (chunk_left == 0)
+        {
+          if (!input.skip(4) || !chunk() || type != IDAT) return -1;
+        }
+        chunk_left--;
+        return input.byte();
+      }
+
+      static uint8_t paeth(uint8_t a, uint8_t b, uint8_t c)
+      {
+        int p = a + b - c;
+        int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+        if (pa <= pb && pa <= pc) return a;
+        return pb <= pc ? b : c;
+      }
+
+      // Sample i of the line, scaled to 8 bits.
+      uint8_t sample(uint32_t i) const
+      {
+        if (depth == 8) return line[i];
+        if (depth == 16) return line[i * 2];
+        uint8_t packed = line[i * depth / 8];
+        uint8_t shift = 8 - depth - (i * depth) % 8;
+        uint8_t value = packed >> shift & ((1 << depth) - 1);
+        return colour == 3 ? value : value * 255 / ((1 << depth) - 1);
+      }
+
+      void convert(uint8_t *out) const
+      {
+        for (uint32_t x = 0, i = 0; x < width; x++, i += channels)
+        {
+          switch (colour)
+          {
+            case 0: { uint8_t v = sample(i); put(out, v, v, v); break; }
+            case 2: put(out, sample(i), sample(i + 1), sample(i + 2)); break;
+            case 3: { const uint8_t *p = &palette[sample(i) * 4]; put(out, p[0], p[1], p[2], p[3]); break; }
+            case 4: { uint8_t v = sample(i); put(out, v, v, v, sample(i + 1)); break; }
+            case 6: put(out, sample(i), sample(i + 1), sample(i + 2), sample(i + 3)); break;
+          }
+        }
+      }
+    };
+
+    /*
+     * Decodes and blits, band by band, with the top left corner at x, y.  The band is as many rows as
+     *   fit in band_bytes.  False if it's not a PNG or QOI, or it's broken; in that case whatever decoded
+     *   before the damage is already on screen.
+     */
+    inline bool show(Diablo &diablo,
+                     Source source,
+                     uint16_t x,
+                     uint16_t y,
+                     uint16_t background = 0,
+                     size_t band_bytes = 4096,
+                     LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      Logger log("app.diablo.image");
+      Input input(source);
+      uint8_t magic[4];
+      if (!input.peek(magic, 4))
+      {
+        log.error("Empty image");
+        return false;
+      }
+      std::unique_ptr<Decoder> decoder;
+      if (memcmp(magic, "qoif", 4) == 0) decoder.reset(new QoiDecoder(input, background));
+      else if (memcmp(magic, "\x89PNG", 4) == 0) decoder.reset(new PngDecoder(input, background));
+      if (!decoder || !decoder->begin())
+      {
+        log.error("Not an image I can stream: PNG (not interlaced) or QOI");
+        return false;
+      }
+      size_t row_bytes = (size_t) decoder->width * 2;
+      uint16_t band = (uint16_t) std::max<size_t>(1, std::min<size_t>(decoder->height, band_bytes / row_bytes));
+      std::vector<uint8_t> pixels(band * row_bytes);
+      for (uint16_t row = 0; row < decoder->height; row += band)
+      {
+        uint16_t rows = std::min<uint16_t>(band, decoder->height - row);
+        for (uint16_t r = 0; r < rows; r++)
+        {
+          if (!decoder->row(&pixels[r * row_bytes]))
+          {
+            log.error("Image broken at row %u", row + r);
+            if (r > 0) diablo.blit_com_to_display(x, y + row, decoder->width, r, pixels.data(), log_level);
+            return false;
+          }
+        }
+        // Doesn't wait for the ACK: the next band decodes while this one's on the wire.
+        diablo.blit_com_to_display(x, y + row, decoder->width, rows, pixels.data(), log_level);
+      }
+      return true;
+    }
+  }
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <atomic>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include "serial_diablo.h"
+
+namespace diablo
+{
+  /*
+   * Logging that stays off the draw path.
+   *
+   * With app.diablo at TRACE, every command formats and writes a few lines to USB serial before the
+   *   next one goes out - the latencies you're logging are mostly the logging.  Hook a LogRing up and
+   *   the Diablo only copies a small record into a ring: format pointer, arguments, logger, micros().
+   *   No formatting, no I/O, no locks.  drain() does the printing later, when you've got time for it.
+   *
+   * diablo::LogRing log_ring(256);
+   *
+   * void setup()
+   * {
+   *   diablo16.log_to(&log_ring);
+   * }
+   *
+   * void loop()
+   * {
+   *   diablo16.advance();
+   *   log_ring.drain(8); // A few at a time, or all of them from another thread.
+   * }
+   *
+   * Printed lines carry the micros() of the event, since the Logger's own timestamp is drain time:
+   * 0000012345 [app.diablo] TRACE: [12.344817] Latency draw_circle: 0ms
+   *
+   * When the ring is full new records are dropped and counted, never waited for.  The next drain()
+   *   says how many went missing.
+   *
+   * One producer, one consumer: one thread records (all the Diablos on it can share a ring), one drains.
+   */
+  class LogRing : public LogRecorder
+  {
+  public:
+    // capacity gets rounded up to a power of two.
+    explicit LogRing(uint16_t capacity = 128)
+    {
+      uint32_t size = 1;
+      while (size < capacity) size <<= 1;
+      records.resize(size);
+      mask = size - 1;
+    }
+
+    bool record(const Logger &logger, LogLevel level, const char *format, const intptr_t *values, uint8_t count) override
+    {
+      uint32_t h = head.load(std::memory_order_relaxed);
+      if (h - tail.load(std::memory_order_acquire) > mask)
+      {
+        dropped_records.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      Record &r = records[h & mask];
+      r.at = micros();
+      r.logger = &logger;
+      r.level = level;
+      r.format = format;
+      r.count = std::min<uint8_t>(count, MAX_VALUES);
+      for (uint8_t i = 0; i < r.count; i++) r.values[i] = values[i];
+      head.store(h + 1, std::memory_order_release);
+      return true;
+    }
+
+    /*
+     * Formats and prints up to max_records (0 = everything that's there).  Returns how many it printed.
+     */
+    uint16_t drain(uint16_t max_records = 0)
+    {
+      uint16_t printed = 0;
+      uint32_t t = tail.load(std::memory_order_relaxed);
+      uint32_t h = head.load(std::memory_order_acquire);
+      char line[LINE_LENGTH];
+      while (t != h && (max_records == 0 || printed < max_records))
+      {
+        const Record &r = records[t & mask];
+        format(r, line);
+        last_logger = r.logger;
+        (*r.logger)(r.level, "[%lu.%06lu] %s", (unsigned long) (r.at / 1000000), (unsigned long) (r.at % 1000000), line);
+        tail.store(++t, std::memory_order_release);
+        printed++;
+      }
+      // Whatever got dropped came after what's been printed, so it's reported last.
+      uint32_t dropped_now = dropped_records.load(std::memory_order_relaxed);
+      if (dropped_now != reported_dropped && last_logger)
+      {
+        (*last_logger)(LOG_LEVEL_WARN, "Log ring dropped %lu records", (unsigned long) (dropped_now - reported_dropped));
+        reported_dropped = dropped_now;
+      }
+      return printed;
+    }
+
+    // Records waiting for drain().
+    uint16_t pending() const
+    { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire); }
+
+    // Records thrown away because the ring was full, ever.
+    uint32_t dropped() const
+    { return dropped_records.load(std::memory_order_relaxed); }
+
+    uint16_t capacity() const
+    { return mask + 1; }
+
+  private:
+    static const uint8_t MAX_VALUES = 3; // As many as any Diablo log line takes.
+    static const size_t LINE_LENGTH = 128;
+
+    struct Record
+    {
+      uint32_t at;
+      const Logger *logger;
+      const char *format;
+      intptr_t values[MAX_VALUES];
+      LogLevel level;
+      uint8_t count;
+    };
+
+    std::vector<Record> records;
+    uint32_t mask;
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+    std::atomic<uint32_t> dropped_records{0};
+    uint32_t reported_dropped = 0;
+    const Logger *last_logger = nullptr;
+
+    /*
+     * printf, one conversion at a time: the argument types went in as intptr_t, so they come back out
+     *   by what the format asks for.  %d %i %u %x %X %c %s, with l, flags, width and precision.
+     */
+    static void format(const Record &r, char *out)
+    {
+      size_t used = 0;
+      uint8_t next = 0;
+      for (const char *f = r.format; *f && used + 1 < LINE_LENGTH;)
+      {
+        if (*f != '%')
+        {
+          out[used++] = *f++;
+          continue;
+        }
+        if (f[1] == '%')
+        {
+          out[used++] = '%';
+          f += 2;
+          continue;
+        }
+        char spec[16];
+        size_t length = 0;
+        bool is_long = false;
+        spec[length++] = *f++;
+        while (*f && !strchr("diuxXcs", *f) && length < sizeof(spec) - 2)
+        {
+          if (*f == 'l') is_long = true;
+          spec[length++] = *f++;
+        }
+        if (!*f) break;
+        char conversion = *f++;
+        spec[length++] = conversion;
+        spec[length] = 0;
+        intptr_t value = next < r.count ? r.values[next] : 0;
+        next++;
+        size_t room = LINE_LENGTH - used;
+        int wrote;
+        switch (conversion)
+        {
+          case 's':
+            wrote = snprintf(out + used, room, spec, value ? (const char *) value : "(null)");
+            break;
+          case 'd':
+          case 'i':
+            wrote = is_long ? snprintf(out + used, room, spec, (long) value) : snprintf(out + used, room, spec, (int) value);
+            break;
+          case 'c':
+            wrote = snprintf(out + used, room, spec, (int) value);
+            break;
+          default:
+            wrote = is_long ? snprintf(out + used, room, spec, (unsigned long) value) : snprintf(out + used, room, spec, (unsigned) value);
+            break;
+        }
+        if (wrote > 0) used = std::min(used + wrote, LINE_LENGTH - 1);
+      }
+      out[used] = 0;
+    }
+  };
+}
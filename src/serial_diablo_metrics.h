@@ -0,0 +1,392 @@
+#pragma once
+
+#include "serial_diablo.h"
+#include <map>
+#include <string.h>
+
+namespace diablo
+{
+  /*
+   * Log2 bucketed latency histogram, in microseconds.
+   * Bucket i holds [2^i, 2^(i+1)) us, so percentiles are good to within a factor of 2 before
+   *   interpolation and it costs 32 counters no matter how many samples you throw at it.
+   */
+  class Histogram
+  {
+  public:
+    void record(uint32_t us)
+    {
+      uint8_t bucket = 0;
+      while (bucket < BUCKETS - 1 && (us >> (bucket + 1)) != 0) bucket++;
+      buckets[bucket]++;
+      samples++;
+      sum += us;
+      if (us > maximum) maximum = us;
+    }
+
+    uint32_t count() const
+    { return samples; }
+
+    uint32_t max() const
+    { return maximum; }
+
+    uint32_t mean() const
+    { return samples ? (uint32_t) (sum / samples) : 0; }
+
+    // p in [0, 1].  Linear interpolation inside the bucket.
+    uint32_t percentile(float p) const
+    {
+      if (samples == 0) return 0;
+      uint32_t rank = (uint32_t) (p * (samples - 1)) + 1;
+      uint32_t seen = 0;
+      for (uint8_t i = 0; i < BUCKETS; i++)
+      {
+        if (seen + buckets[i] >= rank)
+        {
+          uint32_t low = i == 0 ? 0 : (1UL << i);
+          uint32_t high = i == BUCKETS - 1 ? maximum : (2UL << i);
+          uint32_t estimate = low + (uint32_t) ((uint64_t) (high - low) * (rank - seen) / buckets[i]);
+          return std::min(estimate, maximum);
+        }
+        seen += buckets[i];
+      }
+      return maximum;
+    }
+
+    void reset()
+    { *this = Histogram(); }
+
+    // What's been recorded since `earlier` (a copy of this one from a while back).
+    // max() stays the all-time max, there's no un-maxing.
+    Histogram since(const Histogram &earlier) const
+    {
+      Histogram out = *this;
+      for (uint8_t i = 0; i < BUCKETS; i++) out.buckets[i] -= earlier.buckets[i];
+      out.samples -= earlier.samples;
+      out.sum -= earlier.sum;
+      return out;
+    }
+
+  private:
+    static const uint8_t BUCKETS = 32;
+    uint32_t buckets[BUCKETS] = {};
+    uint32_t samples = 0;
+    uint64_t sum = 0;
+    uint32_t maximum = 0;
+  };
+
+  /*
+   * Everything we know about one command name.
+   *
+   * total: write start to ACK noticed, as seen from the host.  For non-blocking commands "noticed"
+   *   is whenever the library next came looking, so this one includes your loop's slack.
+   * The split below needs a synced ClockSync and only covers sampled commands:
+   *   queueing:      defer() to write start (deferred commands only)
+   *   transmission:  request bytes on the wire at the configured baud
+   *   execution:     wire done to the Diablo finishing, on the Diablo's own clock
+   *   ack_return:    the Diablo finishing to its answer (ACK, response words, the timer read) being
+   *                  in hand.  Measured, so for non-blocking commands it includes however long the
+   *                  host took to come looking.
+   */
+  struct CommandStats
+  {
+    uint32_t commands = 0;
+    uint32_t bytes = 0;
+    uint32_t failures = 0;
+    Histogram total;
+    Histogram queueing;
+    Histogram transmission;
+    Histogram execution;
+    Histogram ack_return;
+  };
+
+  /*
+   * Lines the Diablo16's millisecond system timer up against the host's micros().
+   *
+   * Every period it reads the device timer (high, low, high - one pipelined burst, so one round trip)
+   *   and pairs it with the midpoint of the host time around the read.  A least squares fit over the
+   *   last few samples gives offset and drift; the sample with the tightest round trip is trusted most.
+   *
+   * The device timer only ticks in milliseconds, so anything mapped through here is good to ~1ms.
+   * That's still plenty to tell 40 bytes of UART time from a 30ms circle fill.
+   */
+  class ClockSync
+  {
+  public:
+    ClockSync(Diablo &diablo, uint32_t period_ms = 10000) :
+        diablo(&diablo),
+        period_ms(period_ms)
+    {}
+
+    // Call from loop().  Only touches the wire once per period.
+    void update()
+    {
+      if (count > 0 && millis() - last_sample < period_ms) return;
+      sample();
+    }
+
+    // Takes a sample right now.  False if the Diablo didn't answer.
+    bool sample()
+    {
+      last_sample = millis();
+      uint16_t lo = Diablo::SYSTEM_TIMER_LO, hi = Diablo::SYSTEM_TIMER_HI;
+      uint32_t before = micros();
+      std::vector<uint16_t> words = diablo->peek_memory({hi, lo, hi});
+      uint32_t after = micros();
+      if (words.size() != 3) return false;
+      // If the low word rolled over between the reads, the second high word goes with it.
+      uint16_t high = words[0] == words[2] || words[1] >= 0x8000 ? words[0] : words[2];
+      Sample s = {((uint32_t) high << 16) | words[1], before + (after - before) / 2, after - before};
+      samples[next] = s;
+      next = (next + 1) % WINDOW;
+      if (count < WINDOW) count++;
+      fit();
+      return true;
+    }
+
+    bool synced() const
+    { return count >= 2; }
+
+    // Host micros() at the moment the device timer read device_ms.
+    uint32_t to_host(uint32_t device_ms) const
+    { return anchor_host + (uint32_t) (int32_t) ((int32_t) (device_ms - anchor_device) * 1000.0 * rate); }
+
+    // Device milliseconds at host time host_us.
+    uint32_t to_device(uint32_t host_us) const
+    { return anchor_device + (uint32_t) (int32_t) ((int32_t) (host_us - anchor_host) / (1000.0 * rate)); }
+
+    // Widen a 16 bit device timer read taken around host time host_us.
+    uint32_t unwrap(uint16_t device_ms_lo, uint32_t host_us) const
+    {
+      uint32_t predicted = to_device(host_us);
+      return predicted + (int16_t) (device_ms_lo - (uint16_t) predicted);
+    }
+
+    // Parts per million the device clock runs fast (+) or slow (-) against the host.
+    float drift_ppm() const
+    { return (float) ((1.0 / rate - 1.0) * 1e6); }
+
+    // Round trip of the best sample in the window; the offset is good to about half of this.
+    uint32_t best_rtt() const
+    {
+      uint32_t best = UINT32_MAX;
+      for (uint8_t i = 0; i < count; i++) best = std::min(best, samples[i].rtt);
+      return best;
+    }
+
+  private:
+    static const uint8_t WINDOW = 16;
+
+    struct Sample
+    {
+      uint32_t device_ms;
+      uint32_t host_us;
+      uint32_t rtt;
+    };
+
+    Diablo *diablo;
+    uint32_t period_ms;
+    unsigned long last_sample = 0;
+    Sample samples[WINDOW];
+    uint8_t next = 0;
+    uint8_t count = 0;
+    uint32_t anchor_device = 0;
+    uint32_t anchor_host = 0;
+    double rate = 1.0; // Host microseconds per device microsecond.
+
+    void fit()
+    {
+      // Anchor at the tightest sample, then least squares the slope through it.
+      uint8_t best = 0;
+      for (uint8_t i = 1; i < count; i++)
+        if (samples[i].rtt < samples[best].rtt) best = i;
+      anchor_device = samples[best].device_ms;
+      anchor_host = samples[best].host_us;
+      if (count < 2) return;
+      double sxx = 0, sxy = 0;
+      for (uint8_t i = 0; i < count; i++)
+      {
+        double x = (int32_t) (samples[i].device_ms - anchor_device) * 1000.0;
+        double y = (int32_t) (samples[i].host_us - anchor_host);
+        sxx += x * x;
+        sxy += x * y;
+      }
+      // A minute or so of samples before we believe in drift; until then assume the crystals agree.
+      if (sxx > 60e6 * 60e6) rate = sxy / sxx;
+    }
+  };
+
+  /*
+   * Per-command latency histograms.  Hook it up with diablo.observe(&metrics).
+   *
+   * With a ClockSync attached it also samples: every sample_ms, one command gets a timer read
+   *   pipelined right behind it, and its latency is split into queueing, transmission, device
+   *   execution and ACK return.  That's 4 extra bytes out and 3 back once per sample, nothing else.
+   *
+   * diablo::Metrics metrics(200000);
+   * diablo::ClockSync clock(diablo16);
+   * metrics.attribute(&clock);
+   * diablo16.observe(&metrics);
+   *
+   * void loop() { clock.update(); ... }
+   * metrics.print(Log);
+   */
+  class Metrics : public CommandObserver
+  {
+    // Command names are string literals, but compare them by content anyway.
+    struct NameLess
+    {
+      bool operator()(const char *a, const char *b) const
+      { return strcmp(a, b) < 0; }
+    };
+
+  public:
+    Metrics(uint32_t baud, uint32_t sample_ms = 1000) :
+        baud(baud),
+        sample_ms(sample_ms)
+    {}
+
+    void attribute(ClockSync *clock_sync)
+    { clock = clock_sync; }
+
+    // The link's new rate, after a baud change: transmission times are worked out from it.
+    void set_baud(uint32_t new_baud)
+    { baud = new_baud; }
+
+    const CommandStats &stats(const char *name)
+    { return by_command[name]; }
+
+    const std::map<const char *, CommandStats, NameLess> &commands() const
+    { return by_command; }
+
+    // Every command that wasn't overhead, lumped together.
+    const CommandStats &totals() const
+    { return all; }
+
+    /*
+     * Bills everything sent from here on to `tag` instead of the app, until overhead(nullptr).
+     * For the library's own chatter (the HUD, say), so it doesn't skew the numbers it's reporting.
+     */
+    void overhead(const char *tag)
+    { overhead_tag = tag; }
+
+    const std::map<const char *, CommandStats, NameLess> &overheads() const
+    { return by_overhead; }
+
+    void reset()
+    {
+      by_command.clear();
+      by_overhead.clear();
+      all = CommandStats();
+    }
+
+    void print(const Logger &out, LogLevel level = LOG_LEVEL_INFO) const
+    {
+      print_stats(out, level, "", by_command);
+      print_stats(out, level, "overhead ", by_overhead);
+    }
+
+    ////////////////////////////////////    CommandObserver    ////////////////////////////////////
+    void sent(const char *name, uint32_t bytes, uint32_t queued_at, uint32_t write_start, uint32_t /*write_end*/) override
+    {
+      in_flight = {name, overhead_tag, bytes, queued_at, write_start};
+      each_stats([bytes](CommandStats &c) {
+        c.commands++;
+        c.bytes += bytes;
+      });
+    }
+
+    void acked(const char *name, bool ok, uint32_t at) override
+    {
+      if (name != in_flight.name) return;
+      uint32_t total = at - in_flight.write_start;
+      each_stats([ok, total](CommandStats &c) {
+        if (ok) c.total.record(total);
+        else c.failures++;
+      });
+    }
+
+    bool want_device_time(const char * /*name*/) override
+    {
+      if (!clock || !clock->synced() || millis() - last_sample < sample_ms) return false;
+      last_sample = millis();
+      return true;
+    }
+
+    void device_time(const char *name, uint16_t device_ms) override
+    {
+      if (!clock || name != in_flight.name) return;
+      uint32_t done = clock->to_host(clock->unwrap(device_ms, in_flight.write_start));
+      uint32_t wire = wire_us(in_flight.bytes);
+      // The Diablo's clock ticks in ms, so "done" can land a hair before the wire finished.
+      int32_t execution = (int32_t) (done - in_flight.write_start) - (int32_t) wire;
+      uint32_t queueing = in_flight.queued_at ? in_flight.write_start - in_flight.queued_at : 0;
+      int32_t ack_return = (int32_t) (micros() - done);
+      bool deferred = in_flight.queued_at != 0;
+      each_stats([=](CommandStats &c) {
+        if (deferred) c.queueing.record(queueing);
+        c.transmission.record(wire);
+        c.execution.record(execution > 0 ? execution : 0);
+        c.ack_return.record(ack_return > 0 ? ack_return : 0);
+      });
+    }
+
+  private:
+    struct InFlight
+    {
+      const char *name;
+      const char *overhead;
+      uint32_t bytes;
+      uint32_t queued_at;
+      uint32_t write_start;
+    };
+
+    typedef std::map<const char *, CommandStats, NameLess> StatsMap;
+
+    uint32_t baud;
+    uint32_t sample_ms;
+    unsigned long last_sample = 0;
+    ClockSync *clock = nullptr;
+    const char *overhead_tag = nullptr;
+    InFlight in_flight = {nullptr, nullptr, 0, 0, 0};
+    StatsMap by_command;
+    StatsMap by_overhead;
+    CommandStats all;
+
+    // 8N1: 10 bits per byte.
+    uint32_t wire_us(uint32_t bytes) const
+    { return (uint32_t) ((uint64_t) bytes * 10000000 / baud); }
+
+    // The in-flight command's own stats, and the app totals unless it's overhead.
+    template<typename Update>
+    void each_stats(Update update)
+    {
+      if (in_flight.overhead)
+      {
+        update(by_overhead[in_flight.overhead]);
+        return;
+      }
+      update(by_command[in_flight.name]);
+      update(all);
+    }
+
+    static void print_stats(const Logger &out, LogLevel level, const char *prefix, const StatsMap &stats)
+    {
+      for (const auto &entry : stats)
+      {
+        const CommandStats &c = entry.second;
+        out(level, "%s%s: %lu sent, %lu bytes, %lu failed, total p50/p95/max %lu/%lu/%luus",
+            prefix, entry.first, (unsigned long) c.commands, (unsigned long) c.bytes, (unsigned long) c.failures,
+            (unsigned long) c.total.percentile(0.5f), (unsigned long) c.total.percentile(0.95f),
+            (unsigned long) c.total.max());
+        if (c.execution.count() > 0)
+        {
+          out(level, "  p50 queue %lu, wire %lu, exec %lu, ack %luus (%lu samples)",
+              (unsigned long) c.queueing.percentile(0.5f), (unsigned long) c.transmission.percentile(0.5f),
+              (unsigned long) c.execution.percentile(0.5f), (unsigned long) c.ack_return.percentile(0.5f),
+              (unsigned long) c.execution.count());
+        }
+      }
+    }
+  };
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include "serial_diablo.h"
+
+namespace diablo
+{
+  /*
+   * How much detail widgets should spend on the screen right now.
+   */
+  enum Detail : uint8_t
+  {
+    DETAIL_FULL = 0,
+    DETAIL_REDUCED = 1,
+    DETAIL_MINIMAL = 2
+  };
+
+  /*
+   * When to give up detail.  A level kicks in when either the queue depth or the lag crosses its line.
+   * Lag is the worse of how stale the oldest deferred thing is and how long the current queue
+   *   would take to drain at the rate it's been draining.
+   */
+  struct OverloadThresholds
+  {
+    size_t reduced_depth = 8;
+    uint32_t reduced_lag_ms = 150;
+    size_t minimal_depth = 24;
+    uint32_t minimal_lag_ms = 500;
+    // Load has to sit below half of the current level's lines this long before we step back up one.
+    uint32_t recover_ms = 2000;
+  };
+
+  /*
+   * Watches a Diablo's deferral queue and trades detail for freshness when it backs up.
+   *
+   * Detail drops the moment the queue crosses a line, and creeps back one level at a time once it's
+   *   stayed quiet for recover_ms.  A stale screen is worse than a plain one, so we'd rather flap
+   *   down quickly than climb back up and fall over again.
+   *
+   * Widgets ask it how much to spend:
+   *
+   * diablo::OverloadController lod(diablo16);
+   *
+   * void loop()
+   * {
+   *   lod.update();
+   *   if (lod.due(last_chart, 100)) diablo16.defer("chart", [] { draw_chart(lod.resolution(200)); });
+   *   diablo16.defer("dial", [] {
+   *     diablo16.draw_polygon_filled(lod.simplify(dial.vertices(), dial.count), dial_color);
+   *     if (lod.outlines()) diablo16.draw_polygon(dial.vertices(), dial.count, black);
+   *   });
+   *   diablo16.advance();
+   * }
+   */
+  class OverloadController
+  {
+  public:
+    typedef std::function<void(Detail detail)> DetailHandler;
+
+    OverloadController(Diablo &diablo, OverloadThresholds thresholds = OverloadThresholds()) :
+        log("app.diablo.overload"),
+        diablo(&diablo),
+        thresholds(thresholds)
+    {}
+
+    // Gets told whenever the detail level changes.  Handy for forcing a full redraw on the way back up.
+    void on_change(DetailHandler handler)
+    { changed = handler; }
+
+    // Call from loop().
+    void update()
+    {
+      unsigned long now = millis();
+      uint32_t count = diablo->dispatched_count();
+      size_t depth = diablo->queued();
+      if (now - rate_since >= 100)
+      {
+        // Only learn the drain rate while there's a queue to drain; an idle link says nothing.
+        if (depth > 0 && count != rate_count)
+        {
+          float per_ms = (float) (count - rate_count) / (now - rate_since);
+          drain_per_ms = drain_per_ms == 0 ? per_ms : drain_per_ms * 0.75f + per_ms * 0.25f;
+        }
+        rate_since = now;
+        rate_count = count;
+      }
+      uint32_t lag = diablo->queue_lag_us() / 1000;
+      if (drain_per_ms > 0) lag = std::max(lag, (uint32_t) (depth / drain_per_ms));
+      current_lag_ms = lag;
+
+      Detail wanted = DETAIL_FULL;
+      if (depth >= thresholds.reduced_depth || lag >= thresholds.reduced_lag_ms) wanted = DETAIL_REDUCED;
+      if (depth >= thresholds.minimal_depth || lag >= thresholds.minimal_lag_ms) wanted = DETAIL_MINIMAL;
+
+      if (wanted > level)
+      {
+        set(wanted);
+        quiet_since = now;
+      } else if (wanted < level && calm(depth, lag))
+      {
+        if (now - quiet_since >= thresholds.recover_ms)
+        {
+          set((Detail) (level - 1));
+          quiet_since = now;
+        }
+      } else
+      {
+        quiet_since = now;
+      }
+    }
+
+    Detail detail() const
+    { return level; }
+
+    uint32_t lag_ms() const
+    { return current_lag_ms; }
+
+    //////////////////////////////////    Level of detail    //////////////////////////////////
+
+    // Decorative outlines, drop shadows, that sort of thing.  Full detail only.
+    bool outlines() const
+    { return level == DETAIL_FULL; }
+
+    // Points to spend on a chart that would like `full` of them.
+    uint16_t resolution(uint16_t full) const
+    { return std::max<uint16_t>(std::min<uint16_t>(full, 2), full >> (2 * level)); }
+
+    // Vertices to spend on a shape that would like `full` of them.  Never less than a triangle.
+    uint16_t vertices(uint16_t full) const
+    { return std::max<uint16_t>(std::min<uint16_t>(full, 3), full >> level); }
+
+    // Refresh period for a widget that would like to redraw every `full_ms`.
+    uint32_t refresh_ms(uint32_t full_ms) const
+    { return full_ms << (2 * level); }
+
+    /*
+     * Rate limiter on refresh_ms().  True (and last is bumped) when the widget is due a redraw.
+     * unsigned long last_chart = 0;
+     * if (lod.due(last_chart, 100)) ...
+     */
+    bool due(unsigned long &last, uint32_t full_ms) const
+    {
+      unsigned long now = millis();
+      if (now - last < refresh_ms(full_ms)) return false;
+      last = now;
+      return true;
+    }
+
+    /*
+     * Drops vertices from a poly (x1..xn, y1..yn layout) down to vertices(n), evenly spaced.
+     * Comes back in the same layout, ready for the vector flavors of the poly commands.
+     */
+    std::vector<uint16_t> simplify(const uint16_t *poly, uint16_t n) const
+    {
+      uint16_t keep = vertices(n);
+      std::vector<uint16_t> out(2 * keep);
+      for (uint16_t i = 0; i < keep; i++)
+      {
+        uint16_t from = (uint32_t) i * n / keep;
+        out[i] = poly[from];
+        out[keep + i] = poly[n + from];
+      }
+      return out;
+    }
+
+  private:
+    Logger log;
+    Diablo *diablo;
+    OverloadThresholds thresholds;
+    DetailHandler changed;
+    Detail level = DETAIL_FULL;
+    unsigned long quiet_since = 0;
+    unsigned long rate_since = 0;
+    uint32_t rate_count = 0;
+    float drain_per_ms = 0;
+    uint32_t current_lag_ms = 0;
+
+    // Comfortably under the lines for the current level, so stepping up won't just trip them again.
+    bool calm(size_t depth, uint32_t lag) const
+    {
+      size_t depth_line = level == DETAIL_MINIMAL ? thresholds.minimal_depth : thresholds.reduced_depth;
+      uint32_t lag_line = level == DETAIL_MINIMAL ? thresholds.minimal_lag_ms : thresholds.reduced_lag_ms;
+      return depth < depth_line / 2 && lag < lag_line / 2;
+    }
+
+    void set(Detail detail)
+    {
+      log.info("Detail %d -> %d (queue %d, lag %lums)", (int) level, (int) detail,
+               (int) diablo->queued(), (unsigned long) current_lag_ms);
+      level = detail;
+      if (changed) changed(detail);
+    }
+  };
+}
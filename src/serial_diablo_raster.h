@@ -0,0 +1,633 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+namespace diablo
+{
+  /*
+   * Host-side rasterizer for framebuffer-mode rendering on a beefier gateway (Linux, say):
+   *   draw rich screens into an RGB565 framebuffer on the host, then push only what changed to the panel
+   *   with Diablo::blit_com_to_display().
+   *
+   * The screen is cut into tiles.  Each frame, every tile is rendered from the scene's display list by a
+   *   work-stealing thread pool, then compared against what the panel already shows.  Tiles that changed
+   *   come back as merged dirty rectangles.
+   *
+   * Fills and alpha blends are SWAR ("SIMD within a register"): 4 pixels per 64 bit store for fills,
+   *   2 pixels per 64 bit multiply for blends.  Portable, no intrinsics, so the same code runs on the
+   *   gateway and on an ARM MCU if you ever get desperate.
+   *
+   * diablo::raster::Scene scene;
+   * diablo::raster::Rasterizer raster(800, 480, 4);
+   *
+   * scene.clear(background);
+   * scene.line(10.5f, 20.0f, 700.25f, 300.0f, white); // Anti-aliased
+   * scene.mask(100, 100, glyph_w, glyph_h, glyph_coverage, white); // Text: 8 bit coverage per pixel
+   * raster.render(scene);
+   * raster.push_dirty(diablo16);
+   *
+   * NOTE:  No font engine in here.  Text comes in as coverage masks (one byte per pixel) from whatever
+   *   rasterizes your glyphs, and gets blended like anything else.
+   */
+  namespace raster
+  {
+    struct Rect
+    {
+      uint16_t x;
+      uint16_t y;
+      uint16_t width;
+      uint16_t height;
+    };
+
+    /*
+     * Runs a batch of numbered tasks across a fixed set of threads.
+     * Tasks are dealt round robin into per-worker deques; a worker pops from the back of its own
+     *   deque and, when that runs dry, steals from the front of somebody else's.
+     * The calling thread works too, so WorkStealingPool(1) is just a plain loop.
+     */
+    class WorkStealingPool
+    {
+    public:
+      explicit WorkStealingPool(size_t threads) :
+          workers(std::max<size_t>(threads, 1))
+      {
+        for (size_t i = 1; i < workers.size(); i++)
+        {
+          threads_.emplace_back([this, i]() { work_loop(i); });
+        }
+      }
+
+      ~WorkStealingPool()
+      {
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread &t : threads_) t.join();
+      }
+
+      size_t size() const
+      { return workers.size(); }
+
+      // Blocks until body(0) ... body(tasks - 1) have all run.
+      void run(size_t tasks, const std::function<void(size_t)> &body)
+      {
+        if (tasks == 0) return;
+        {
+          std::lock_guard<std::mutex> guard(lock);
+          for (size_t t = 0; t < tasks; t++)
+          {
+            Worker &w = workers[t % workers.size()];
+            std::lock_guard<std::mutex> worker_guard(w.lock);
+            w.tasks.push_back(t);
+          }
+          job = &body;
+          remaining = tasks;
+          generation++;
+        }
+        wake.notify_all();
+        drain(0);
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [this]() { return remaining == 0; });
+        job = nullptr;
+      }
+
+    private:
+      struct Worker
+      {
+        std::mutex lock;
+        std::deque<size_t> tasks;
+      };
+
+      std::vector<Worker> workers;
+      std::vector<std::thread> threads_;
+      std::mutex lock;
+      std::condition_variable wake;
+      std::condition_variable done;
+      const std::function<void(size_t)> *job = nullptr;
+      size_t remaining = 0;
+      uint64_t generation = 0;
+      bool stopping = false;
+
+      bool take(size_t self, size_t &task)
+      {
+        {
+          Worker &mine = workers[self];
+          std::lock_guard<std::mutex> guard(mine.lock);
+          if (!mine.tasks.empty())
+          {
+            task = mine.tasks.back();
+            mine.tasks.pop_back();
+            return true;
+          }
+        }
+        for (size_t i = 1; i < workers.size(); i++)
+        {
+          Worker &victim = workers[(self + i) % workers.size()];
+          std::lock_guard<std::mutex> guard(victim.lock);
+          if (!victim.tasks.empty())
+          {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            return true;
+          }
+        }
+        return false;
+      }
+
+      void drain(size_t self)
+      {
+        size_t task;
+        while (take(self, task))
+        {
+          // Read the job after taking the task: a worker finishing up the last batch can pick up a task
+          //   from the next one, and it had better run it with the next batch's body.
+          const std::function<void(size_t)> *body;
+          {
+            std::lock_guard<std::mutex> guard(lock);
+            body = job;
+          }
+          (*body)(task);
+          std::lock_guard<std::mutex> guard(lock);
+          if (--remaining == 0) done.notify_all();
+        }
+      }
+
+      void work_loop(size_t self)
+      {
+        uint64_t seen = 0;
+        while (true)
+        {
+          {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [this, seen]() { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+          }
+          drain(self);
+        }
+      }
+    };
+
+    /*
+     * Pixel kernels.  RGB565 in host byte order; Diablo::write_word() handles the big endian part.
+     * Alpha is 0 - 32 in here (5 bits of blend is all RGB565 can show anyway).
+     */
+    namespace kernels
+    {
+      // R, G and B spread apart with room for a 5 bit multiply in each: 00000gggggg00000rrrrr000000bbbbb
+      static inline uint32_t spread(uint16_t c)
+      { return (c | ((uint32_t) c << 16)) & 0x07E0F81F; }
+
+      static inline uint16_t unspread(uint32_t c)
+      {
+        c &= 0x07E0F81F;
+        return (uint16_t) (c | (c >> 16));
+      }
+
+      static inline uint16_t blend(uint16_t under, uint32_t over_spread, uint32_t alpha)
+      { return unspread((spread(under) * (32 - alpha) + over_spread * alpha) >> 5); }
+
+      // 4 pixels per 64 bit store once the destination is aligned.
+      static inline void fill(uint16_t *dst, size_t count, uint16_t color)
+      {
+        while (count > 0 && ((uintptr_t) dst & 7) != 0)
+        {
+          *dst++ = color;
+          count--;
+        }
+        // memcpy, not a uint64_t *: the buffer is uint16_t, and the compiler turns it into the one store.
+        uint64_t quad = color * 0x0001000100010001ULL;
+        for (; count >= 4; count -= 4, dst += 4) memcpy(dst, &quad, 8);
+        while (count-- > 0) *dst++ = color;
+      }
+
+      // 2 pixels per 64 bit multiply: each 32 bit lane holds one spread pixel with headroom to spare.
+      static inline void blend_span(uint16_t *dst, size_t count, uint16_t color, uint32_t alpha)
+      {
+        if (alpha >= 32)
+        {
+          fill(dst, count, color);
+          return;
+        }
+        const uint64_t mask = 0x07E0F81F07E0F81FULL;
+        const uint64_t over = ((uint64_t) spread(color) | ((uint64_t) spread(color) << 32)) * alpha;
+        const uint64_t keep = 32 - alpha;
+        for (; count >= 2; count -= 2, dst += 2)
+        {
+          uint32_t pair;
+          memcpy(&pair, dst, 4);
+          uint64_t under = (uint64_t) spread(pair & 0xFFFF) | ((uint64_t) spread(pair >> 16) << 32);
+          uint64_t mixed = ((under * keep + over) >> 5) & mask;
+          pair = (uint32_t) unspread((uint32_t) mixed) | ((uint32_t) unspread((uint32_t) (mixed >> 32)) << 16);
+          memcpy(dst, &pair, 4);
+        }
+        if (count) *dst = blend(*dst, spread(color), alpha);
+      }
+    }
+
+    /*
+     * A frame's worth of drawing, in order.  Nothing is rasterized until Rasterizer::render().
+     * Image and mask pointers are borrowed: keep them alive until render() returns.
+     */
+    class Scene
+    {
+    public:
+      void reset()
+      { ops.clear(); }
+
+      void clear(uint16_t color)
+      {
+        ops.clear();
+        fill(0, 0, 0xFFFF, 0xFFFF, color);
+      }
+
+      void fill(int32_t x, int32_t y, int32_t width, int32_t height, uint16_t color)
+      { ops.push_back(Op(Op::FILL, x, y, width, height, color, 32)); }
+
+      // alpha 0 - 255
+      void blend(int32_t x, int32_t y, int32_t width, int32_t height, uint16_t color, uint8_t alpha)
+      { ops.push_back(Op(Op::BLEND, x, y, width, height, color, to_alpha(alpha))); }
+
+      // Anti-aliased (Wu) line between sub-pixel endpoints.
+      void line(float x1, float y1, float x2, float y2, uint16_t color)
+      {
+        Op op(Op::LINE, (int32_t) std::min(x1, x2) - 1, (int32_t) std::min(y1, y2) - 1,
+              (int32_t) std::abs(x2 - x1) + 3, (int32_t) std::abs(y2 - y1) + 3, color, 32);
+        op.fx1 = x1;
+        op.fy1 = y1;
+        op.fx2 = x2;
+        op.fy2 = y2;
+        ops.push_back(op);
+      }
+
+      // Opaque (alpha 255) or uniformly translucent RGB565 image, row-major, tightly packed.
+      void image(int32_t x, int32_t y, int32_t width, int32_t height, const uint16_t *pixels, uint8_t alpha = 255)
+      {
+        Op op(Op::IMAGE, x, y, width, height, 0, to_alpha(alpha));
+        op.pixels = pixels;
+        ops.push_back(op);
+      }
+
+      // Solid color through a coverage mask, one byte per pixel.  This is how text gets drawn.
+      void mask(int32_t x, int32_t y, int32_t width, int32_t height, const uint8_t *coverage, uint16_t color)
+      {
+        Op op(Op::MASK, x, y, width, height, color, 32);
+        op.coverage = coverage;
+        ops.push_back(op);
+      }
+
+    private:
+      friend class Rasterizer;
+
+      struct Op
+      {
+        enum Kind { FILL, BLEND, LINE, IMAGE, MASK };
+
+        // C++11 won't aggregate initialize a struct with default member initializers.
+        Op(Kind kind, int32_t x, int32_t y, int32_t width, int32_t height, uint16_t color, uint32_t alpha) :
+            kind(kind), x(x), y(y), width(width), height(height), color(color), alpha(alpha)
+        {}
+
+        Kind kind;
+        int32_t x, y, width, height;
+        uint16_t color;
+        uint32_t alpha;
+        float fx1 = 0, fy1 = 0, fx2 = 0, fy2 = 0;
+        const uint16_t *pixels = nullptr;
+        const uint8_t *coverage = nullptr;
+      };
+
+      std::vector<Op> ops;
+
+      static uint32_t to_alpha(uint8_t alpha)
+      { return (alpha * 32 + 127) / 255; }
+    };
+
+    /*
+     * Renders Scenes into an RGB565 framebuffer and works out what the panel needs to be sent.
+     */
+    class Rasterizer
+    {
+    public:
+      static const uint16_t TILE = 32;
+
+      Rasterizer(uint16_t width, uint16_t height, size_t threads = std::thread::hardware_concurrency()) :
+          width(width),
+          height(height),
+          tiles_x((width + TILE - 1) / TILE),
+          tiles_y((height + TILE - 1) / TILE),
+          frame((size_t) width * height),
+          shown((size_t) width * height),
+          dirty_tiles((size_t) tiles_x * tiles_y),
+          bins((size_t) tiles_x * tiles_y),
+          pool(threads)
+      {
+        // Nothing has been shown yet, so the first frame is dirty everywhere.
+        std::fill(dirty_tiles.begin(), dirty_tiles.end(), 1);
+        first_frame = true;
+      }
+
+      // Rasterize the scene and return the rectangles that differ from the last frame.
+      const std::vector<Rect> &render(const Scene &scene)
+      {
+        for (auto &bin : bins) bin.clear();
+        for (size_t i = 0; i < scene.ops.size(); i++)
+        {
+          const Scene::Op &op = scene.ops[i];
+          if (op.x + op.width <= 0 || op.y + op.height <= 0 || op.x >= width || op.y >= height) continue;
+          int32_t tx1 = std::max<int32_t>(op.x, 0) / TILE, ty1 = std::max<int32_t>(op.y, 0) / TILE;
+          int32_t tx2 = std::min<int32_t>(op.x + op.width - 1, width - 1) / TILE;
+          int32_t ty2 = std::min<int32_t>(op.y + op.height - 1, height - 1) / TILE;
+          for (int32_t ty = ty1; ty <= ty2; ty++)
+            for (int32_t tx = tx1; tx <= tx2; tx++)
+              bins[ty * tiles_x + tx].push_back(i);
+        }
+        pool.run(bins.size(), [this, &scene](size_t tile) { render_tile(scene, tile); });
+        first_frame = false;
+        merge_dirty();
+        return dirty;
+      }
+
+      const std::vector<Rect> &dirty_rects() const
+      { return dirty; }
+
+      const uint16_t *pixels() const
+      { return frame.data(); }
+
+      uint16_t pixel(uint16_t x, uint16_t y) const
+      { return frame[(size_t) y * width + x]; }
+
+      /*
+       * Send every dirty rectangle to the panel, straight out of the framebuffer.
+       * Target is anything with Diablo's blit_com_to_display(x, y, width, height, pixels, stride).
+       */
+      template<typename Target>
+      void push_dirty(Target &target)
+      {
+        for (const Rect &r : dirty)
+        {
+          target.blit_com_to_display(r.x, r.y, r.width, r.height, frame.data() + (size_t) r.y * width + r.x, width);
+        }
+      }
+
+      size_t threads() const
+      { return pool.size(); }
+
+    private:
+      uint16_t width;
+      uint16_t height;
+      uint16_t tiles_x;
+      uint16_t tiles_y;
+      std::vector<uint16_t> frame;
+      std::vector<uint16_t> shown;
+      std::vector<uint8_t> dirty_tiles;
+      std::vector<std::vector<uint32_t>> bins;
+      std::vector<Rect> dirty;
+      bool first_frame;
+      WorkStealingPool pool;
+
+      struct Clip
+      {
+        int32_t left, top, right, bottom; // right, bottom exclusive
+      };
+
+      void render_tile(const Scene &scene, size_t tile)
+      {
+        Clip clip;
+        clip.left = (tile % tiles_x) * TILE;
+        clip.top = (tile / tiles_x) * TILE;
+        clip.right = std::min<int32_t>(clip.left + TILE, width);
+        clip.bottom = std::min<int32_t>(clip.top + TILE, height);
+
+        // Anything the scene doesn't cover is black.
+        for (int32_t y = clip.top; y < clip.bottom; y++)
+        { kernels::fill(&frame[(size_t) y * width + clip.left], clip.right - clip.left, 0); }
+        for (uint32_t i : bins[tile])
+        {
+          const Scene::Op &op = scene.ops[i];
+          switch (op.kind)
+          {
+            case Scene::Op::FILL: rect(op, clip, 32); break;
+            case Scene::Op::BLEND: rect(op, clip, op.alpha); break;
+            case Scene::Op::LINE: line(op, clip); break;
+            case Scene::Op::IMAGE: image(op, clip); break;
+            case Scene::Op::MASK: mask(op, clip); break;
+          }
+        }
+
+        bool changed = first_frame;
+        for (int32_t y = clip.top; y < clip.bottom; y++)
+        {
+          size_t row = (size_t) y * width + clip.left;
+          size_t bytes = (clip.right - clip.left) * sizeof(uint16_t);
+          if (memcmp(&frame[row], &shown[row], bytes) != 0)
+          {
+            changed = true;
+            memcpy(&shown[row], &frame[row], bytes);
+          }
+        }
+        dirty_tiles[tile] = changed ? 1 : 0;
+      }
+
+      void rect(const Scene::Op &op, const Clip &clip, uint32_t alpha)
+      {
+        int32_t left = std::max(op.x, clip.left), right = std::min(op.x + op.width, clip.right);
+        int32_t top = std::max(op.y, clip.top), bottom = std::min(op.y + op.height, clip.bottom);
+        if (left >= right || alpha == 0) return;
+        for (int32_t y = top; y < bottom; y++)
+        {
+          uint16_t *row = &frame[(size_t) y * width + left];
+          if (alpha >= 32) kernels::fill(row, right - left, op.color);
+          else kernels::blend_span(row, right - left, op.color, alpha);
+        }
+      }
+
+      void plot(const Clip &clip, int32_t x, int32_t y, uint32_t over, float coverage)
+      {
+        if (x < clip.left || x >= clip.right || y < clip.top || y >= clip.bottom) return;
+        uint32_t alpha = (uint32_t) (coverage * 32 + 0.5f);
+        if (alpha == 0) return;
+        uint16_t &p = frame[(size_t) y * width + x];
+        p = kernels::blend(p, over, alpha);
+      }
+
+      // Xiaolin Wu, walking only the part of the major axis that crosses this tile.
+      void line(const Scene::Op &op, const Clip &clip)
+      {
+        float x1 = op.fx1, y1 = op.fy1, x2 = op.fx2, y2 = op.fy2;
+        bool steep = std::abs(y2 - y1) > std::abs(x2 - x1);
+        if (steep)
+        {
+          std::swap(x1, y1);
+          std::swap(x2, y2);
+        }
+        if (x1 > x2)
+        {
+          std::swap(x1, x2);
+          std::swap(y1, y2);
+        }
+        float gradient = x2 == x1 ? 0 : (y2 - y1) / (x2 - x1);
+        int32_t major_min = steep ? clip.top : clip.left, major_max = steep ? clip.bottom : clip.right;
+        int32_t start = std::max((int32_t) (x1 + 0.5f), major_min);
+        int32_t end = std::min((int32_t) (x2 + 0.5f), major_max - 1);
+        uint32_t over = kernels::spread(op.color);
+        for (int32_t major = start; major <= end; major++)
+        {
+          float minor = y1 + gradient * (major - x1);
+          int32_t base = (int32_t) std::floor(minor);
+          float frac = minor - base;
+          if (steep)
+          {
+            plot(clip, base, major, over, 1 - frac);
+            plot(clip, base + 1, major, over, frac);
+          } else
+          {
+            plot(clip, major, base, over, 1 - frac);
+            plot(clip, major, base + 1, over, frac);
+          }
+        }
+      }
+
+      void image(const Scene::Op &op, const Clip &clip)
+      {
+        int32_t left = std::max(op.x, clip.left), right = std::min(op.x + op.width, clip.right);
+        int32_t top = std::max(op.y, clip.top), bottom = std::min(op.y + op.height, clip.bottom);
+        if (left >= right || op.alpha == 0) return;
+        for (int32_t y = top; y < bottom; y++)
+        {
+          uint16_t *dst = &frame[(size_t) y * width + left];
+          const uint16_t *src = op.pixels + (size_t) (y - op.y) * op.width + (left - op.x);
+          if (op.alpha >= 32)
+          {
+            memcpy(dst, src, (right - left) * sizeof(uint16_t));
+            continue;
+          }
+          for (int32_t x = 0; x < right - left; x++) dst[x] = kernels::blend(dst[x], kernels::spread(src[x]), op.alpha);
+        }
+      }
+
+      void mask(const Scene::Op &op, const Clip &clip)
+      {
+        int32_t left = std::max(op.x, clip.left), right = std::min(op.x + op.width, clip.right);
+        int32_t top = std::max(op.y, clip.top), bottom = std::min(op.y + op.height, clip.bottom);
+        uint32_t over = kernels::spread(op.color);
+        for (int32_t y = top; y < bottom; y++)
+        {
+          uint16_t *dst = &frame[(size_t) y * width];
+          const uint8_t *coverage = op.coverage + (size_t) (y - op.y) * op.width;
+          for (int32_t x = left; x < right; x++)
+          {
+            uint32_t alpha = (coverage[x - op.x] * 32 + 127) / 255;
+            if (alpha >= 32) dst[x] = op.color;
+            else if (alpha > 0) dst[x] = kernels::blend(dst[x], over, alpha);
+          }
+        }
+      }
+
+      // Dirty tiles -> horizontal runs per tile row -> runs stacked vertically when they line up.
+      void merge_dirty()
+      {
+        dirty.clear();
+        std::vector<size_t> open; // Rects from the previous tile row that could still grow downward.
+        for (uint16_t ty = 0; ty < tiles_y; ty++)
+        {
+          std::vector<size_t> next_open;
+          uint16_t tx = 0;
+          while (tx < tiles_x)
+          {
+            if (!dirty_tiles[ty * tiles_x + tx])
+            {
+              tx++;
+              continue;
+            }
+            uint16_t run = tx;
+            while (run < tiles_x && dirty_tiles[ty * tiles_x + run]) run++;
+            Rect r;
+            r.x = tx * TILE;
+            r.y = ty * TILE;
+            r.width = std::min<int32_t>(run * TILE, width) - r.x;
+            r.height = std::min<int32_t>(r.y + TILE, height) - r.y;
+            bool grown = false;
+            for (size_t index : open)
+            {
+              Rect &above = dirty[index];
+              if (above.x == r.x && above.width == r.width && above.y + above.height == r.y)
+              {
+                above.height += r.height;
+                next_open.push_back(index);
+                grown = true;
+                break;
+              }
+            }
+            if (!grown)
+            {
+              dirty.push_back(r);
+              next_open.push_back(dirty.size() - 1);
+            }
+            tx = run;
+          }
+          open.swap(next_open);
+        }
+      }
+    };
+
+    /*
+     * Frames per second for a busy 800x480-ish scene: a background, a few hundred translucent
+     *   rectangles, a couple hundred anti-aliased lines, an image and a screenful of "text" masks.
+     * Something moves every frame so the dirty tracking has work to do.  Fixed seed, so runs compare.
+     */
+    static double benchmark_fps(size_t threads, uint32_t frames = 60, uint16_t width = 800, uint16_t height = 480)
+    {
+      uint32_t seed = 12345;
+      auto random = [&seed](uint32_t range) -> int32_t {
+        seed = seed * 1664525 + 1013904223;
+        return (int32_t) ((seed >> 8) % range);
+      };
+      std::vector<uint16_t> picture(160 * 120);
+      for (size_t i = 0; i < picture.size(); i++) picture[i] = (uint16_t) (i * 37);
+      std::vector<uint8_t> glyph(12 * 16);
+      for (size_t i = 0; i < glyph.size(); i++) glyph[i] = (uint8_t) ((i * 73) & 0xFF);
+
+      struct Box { int32_t x, y, w, h; uint16_t color; uint8_t alpha; };
+      std::vector<Box> boxes;
+      for (int i = 0; i < 300; i++)
+      {
+        boxes.push_back({random(width), random(height), 8 + random(120), 8 + random(80),
+                         (uint16_t) random(0x10000), (uint8_t) random(256)});
+      }
+
+      Rasterizer raster(width, height, threads);
+      Scene scene;
+      auto started = std::chrono::steady_clock::now();
+      for (uint32_t f = 0; f < frames; f++)
+      {
+        scene.clear(0x0841);
+        for (const Box &b : boxes) scene.blend(b.x + (int32_t) (f % 7), b.y, b.w, b.h, b.color, b.alpha);
+        for (int i = 0; i < 200; i++)
+        {
+          scene.line((float) ((i * 37 + f) % width), (float) ((i * 53) % height),
+                     (float) ((i * 91) % width), (float) ((i * 17 + f) % height), 0xFFFF);
+        }
+        scene.image(320, 180, 160, 120, picture.data());
+        for (int row = 0; row < 8; row++)
+          for (int col = 0; col < 60; col++)
+            scene.mask(10 + col * 13, 300 + row * 20, 12, 16, glyph.data(), 0xFFE0);
+        raster.render(scene);
+      }
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+      return frames / seconds;
+    }
+  }
+}
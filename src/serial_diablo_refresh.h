@@ -0,0 +1,211 @@
+#pragma once
+
+#include "serial_diablo.h"
+#include "serial_diablo_metrics.h"
+
+namespace diablo
+{
+  /*
+   * How hard the screen should be working right now.
+   */
+  enum Pace : uint8_t
+  {
+    PACE_FULL = 0,    // Someone's there, or something's wrong.
+    PACE_IDLE = 1,    // Nobody's touched it in a while.
+    PACE_DORMANT = 2  // Nobody's touched it in a long while.
+  };
+
+  /*
+   * When to slow down, and by how much.
+   */
+  struct RefreshPolicy
+  {
+    uint32_t idle_after_ms = 60000;
+    uint32_t dormant_after_ms = 600000;
+    // Per-widget refresh periods get multiplied by these.
+    uint8_t idle_stretch = 4;
+    uint8_t dormant_stretch = 16;
+    // Minimum gap between deferred dispatches (Diablo::pace()).
+    uint32_t idle_dispatch_ms = 50;
+    uint32_t dormant_dispatch_ms = 250;
+  };
+
+  /*
+   * Slows the screen down while nobody's looking.
+   *
+   * Nobody's touched the panel in idle_after_ms: widget refresh periods stretch, and deferred things
+   *   get spaced out (Diablo::pace()), so a sensor that changes 10 times between dispatches costs
+   *   one redraw, not 10.  Longer still and it goes dormant: stretched more.  A touch or an alarm
+   *   snaps straight back to full rate.
+   *
+   * diablo::Metrics metrics(600000);
+   * diablo::RefreshGovernor refresh(diablo16, metrics, 600000);
+   * touch.on_touch([](uint16_t, uint16_t, uint16_t) { refresh.touched(); });
+   * refresh.on_change([](diablo::Pace) { touch.poll_every(refresh.refresh_ms(20)); });
+   *
+   * void loop()
+   * {
+   *   refresh.update();
+   *   if (refresh.due(last_temperature, 200)) diablo16.defer("temperature", draw_temperature);
+   *   if (pressure > limit) { refresh.alarm(); diablo16.defer_urgent("pressure", draw_pressure_alarm); }
+   *   touch.update();
+   *   diablo16.advance();
+   * }
+   *
+   * It learns what the link carries at full rate, and counts the difference while it's slowed down
+   *   as link time saved.  Logged every hour, and in print().
+   *
+   * Touch polls and alarms want defer_urgent(), which pacing doesn't hold back.
+   *
+   * NOTE:  Pacing leaves things waiting in the queue on purpose, so an OverloadController watching
+   *   queue lag will see it.  Give it thresholds above the dispatch gaps.
+   */
+  class RefreshGovernor
+  {
+  public:
+    typedef std::function<void(Pace pace)> PaceHandler;
+
+    RefreshGovernor(Diablo &diablo, Metrics &metrics, uint32_t baud, RefreshPolicy policy = RefreshPolicy()) :
+        log("app.diablo.refresh"),
+        diablo(&diablo),
+        metrics(&metrics),
+        baud(baud),
+        policy(policy)
+    {
+      active_at = sampled_at = hour_start = started = millis();
+    }
+
+    // Gets told whenever the pace changes.
+    void on_change(PaceHandler handler)
+    { changed = handler; }
+
+    // Someone's interacting.  Full rate, now.
+    void touched()
+    {
+      active_at = millis();
+      if (current != PACE_FULL) set(PACE_FULL, "touch");
+    }
+
+    // Something that needs seeing is about to be drawn.  Full rate, now, as if someone had touched it.
+    void alarm()
+    {
+      active_at = millis();
+      if (current != PACE_FULL) set(PACE_FULL, "alarm");
+    }
+
+    // Call from loop().
+    void update()
+    {
+      unsigned long now = millis();
+      account(now);
+      uint32_t quiet = now - active_at;
+      Pace wanted = quiet >= policy.dormant_after_ms ? PACE_DORMANT : quiet >= policy.idle_after_ms ? PACE_IDLE : PACE_FULL;
+      if (wanted != current) set(wanted, "quiet");
+    }
+
+    Pace pace() const
+    { return current; }
+
+    // Refresh period for a widget that would like to redraw every `full_ms`.
+    uint32_t refresh_ms(uint32_t full_ms) const
+    {
+      return current == PACE_DORMANT ? full_ms * policy.dormant_stretch
+             : current == PACE_IDLE ? full_ms * policy.idle_stretch : full_ms;
+    }
+
+    /*
+     * Rate limiter on refresh_ms().  True (and last is bumped) when the widget is due a redraw.
+     * Goes with OverloadController's: refresh.due(last, lod.refresh_ms(100)).
+     */
+    bool due(unsigned long &last, uint32_t full_ms) const
+    {
+      unsigned long now = millis();
+      if (now - last < refresh_ms(full_ms)) return false;
+      last = now;
+      return true;
+    }
+
+    // The link's new rate, after a baud change.
+    void set_baud(uint32_t new_baud)
+    { baud = new_baud; }
+
+    // Link time saved since boot, and in the last full hour.
+    uint32_t saved_ms() const
+    { return (uint32_t) total_saved_ms; }
+
+    uint32_t saved_last_hour_ms() const
+    { return last_hour_saved_ms; }
+
+    // Since boot, scaled to an hour.
+    uint32_t saved_ms_per_hour() const
+    {
+      uint32_t up = millis() - started;
+      return up ? (uint32_t) (total_saved_ms * 3600000.0f / up) : 0;
+    }
+
+    void print(const Logger &out, LogLevel level = LOG_LEVEL_INFO) const
+    {
+      out(level, "Refresh pace %d: link %lu ms/s at full rate, saved %lus (%lus/hour, %lus last hour)",
+          (int) current, (unsigned long) full_busy_per_s, (unsigned long) (saved_ms() / 1000),
+          (unsigned long) (saved_ms_per_hour() / 1000), (unsigned long) (last_hour_saved_ms / 1000));
+    }
+
+  private:
+    static const uint32_t SAMPLE_MS = 1000;
+    static const uint32_t HOUR_MS = 3600000;
+
+    Logger log;
+    Diablo *diablo;
+    Metrics *metrics;
+    uint32_t baud;
+    RefreshPolicy policy;
+    PaceHandler changed;
+    Pace current = PACE_FULL;
+    unsigned long active_at;
+    unsigned long sampled_at;
+    unsigned long hour_start;
+    unsigned long started;
+    uint32_t sampled_bytes = 0;
+    float full_busy_per_s = 0; // Link ms per second at full rate, smoothed.
+    float total_saved_ms = 0;
+    float hour_saved_ms = 0;
+    uint32_t last_hour_saved_ms = 0;
+
+    void set(Pace pace, const char *why)
+    {
+      log.info("Pace %d -> %d (%s)", (int) current, (int) pace, why);
+      current = pace;
+      diablo->pace(pace == PACE_DORMANT ? policy.dormant_dispatch_ms : pace == PACE_IDLE ? policy.idle_dispatch_ms : 0);
+      if (changed) changed(pace);
+    }
+
+    // Once a second: how busy the link was.  At full rate that's the baseline; slowed down, the
+    //   shortfall against it is what we saved.
+    void account(unsigned long now)
+    {
+      uint32_t elapsed = now - sampled_at;
+      if (elapsed < SAMPLE_MS) return;
+      uint32_t bytes = metrics->totals().bytes;
+      // 8N1: 10 bits per byte.
+      float busy_ms = (bytes - sampled_bytes) * 10000.0f / baud;
+      sampled_bytes = bytes;
+      sampled_at = now;
+      float per_s = busy_ms * 1000 / elapsed;
+      if (current == PACE_FULL)
+      { full_busy_per_s = full_busy_per_s == 0 ? per_s : full_busy_per_s * 0.9f + per_s * 0.1f; }
+      else if (full_busy_per_s * elapsed / 1000 > busy_ms)
+      {
+        float saved = full_busy_per_s * elapsed / 1000 - busy_ms;
+        total_saved_ms += saved;
+        hour_saved_ms += saved;
+      }
+      if (now - hour_start >= HOUR_MS)
+      {
+        last_hour_saved_ms = (uint32_t) hour_saved_ms;
+        log.info("Saved %lus of link time in the last hour", (unsigned long) (last_hour_saved_ms / 1000));
+        hour_saved_ms = 0;
+        hour_start = now;
+      }
+    }
+  };
+}
@@ -0,0 +1,430 @@
+#pragma once
+
+#include "serial_diablo.h"
+#include <unordered_map>
+
+namespace diablo
+{
+  /*
+   * Hands out uSD sectors for generated stuff (polygon caches, page snapshots, downloaded images)
+   *   so nobody has to hand-pick sector numbers anymore.
+   *
+   * The reserved region is cut into an index log followed by fixed size slots:
+   *
+   *   first_sector: [index 0] ... [index n-1] [slot 0: slot_sectors] [slot 1] ...
+   *
+   * Lookups are answered out of host RAM: find() never touches the wire, and allocate()/release() are
+   *   O(1) in RAM - a hash lookup, a free list pop, an LRU list splice.  They do write to the card
+   *   sometimes, though: whenever an index sector fills up (sync() before the next one is opened), and
+   *   when allocate() hands back a slot the card's index still says holds something (see below).
+   *   When there's no free slot, the least recently used one gets evicted.
+   * Freed slots go to the back of the free list, so writes rotate around the whole region instead of
+   *   hammering the same few sectors.
+   *
+   * The on-card index is a log: every allocate/release appends an 8 byte record to the current index
+   *   sector, and sync() writes that sector out.  The index sectors are written round robin, each with
+   *   a sequence number, so index wear is spread too.  begin() reads every index sector back in one
+   *   pipelined burst and replays them oldest to newest.
+   *
+   * A slot that gets written over is unmapped on the card first: allocate() writes a release record
+   *   for it and syncs that (blocking) before handing it out.  So a reset in the middle of writing the
+   *   new contents leaves begin() without that key, never with the half-written data under the old one.
+   *   The new mapping goes out with the next sync(), which is why it comes after the write.
+   *
+   * diablo::SectorCache cache(diablo16, 1000000, 20000, 768);  // 800x480 RGB565 snapshots are 750 sectors.
+   * cache.begin();
+   * uint32_t key = diablo::SectorCache::key("page 3");
+   * uint32_t sector = cache.find(key);
+   * if (sector == diablo::SectorCache::NONE)
+   * {
+   *   sector = cache.allocate(key);
+   *   write_snapshot(sector);
+   *   cache.sync();
+   * }
+   * diablo16.media_image_raw(0, 0, sector);
+   *
+   * NOTE:  Recency from find() lives in RAM only; writing it to the card on every read would wear it out
+   *   for no good reason.  After a reboot the LRU order is the order things were written.
+   */
+  class SectorCache
+  {
+  public:
+    static const uint32_t NONE = 0xFFFFFFFF;
+    typedef std::function<void(uint32_t key)> EvictHandler;
+
+    SectorCache(Diablo &diablo,
+                uint32_t first_sector,
+                uint32_t sector_count,
+                uint16_t slot_sectors,
+                uint8_t index_sectors = 8) :
+        log("app.diablo.sectors"),
+        diablo(&diablo),
+        first_sector(first_sector),
+        slot_sectors(slot_sectors),
+        index_sectors(index_sectors),
+        slots(slot_count(sector_count, slot_sectors, index_sectors)),
+        index(512)
+    {
+      if (slots.empty())
+      {
+        log.error("No room for slots: %lu sectors, %u per slot, %u for the index", (unsigned long) sector_count,
+                  slot_sectors, index_sectors);
+      }
+      reset();
+    }
+
+    /*
+     * Rebuilds the host index from the card.  media_init() first.
+     * False if the index couldn't be read; the cache starts empty in that case.
+     */
+    bool begin()
+    {
+      reset();
+      if (slots.empty()) return false;
+      std::vector<std::vector<uint8_t>> sectors = diablo->media_read_sectors(first_sector, index_sectors);
+      if (sectors.size() != index_sectors)
+      {
+        log.error("Couldn't read the sector cache index");
+        return false;
+      }
+      // Replay oldest to newest.
+      std::vector<uint8_t> order;
+      for (uint8_t i = 0; i < index_sectors; i++)
+      {
+        if (get32(sectors[i], 0) == MAGIC && get16(sectors[i], 8) == slot_sectors && get16(sectors[i], 10) == slots.size())
+        { order.push_back(i); }
+      }
+      std::sort(order.begin(), order.end(), [&sectors](uint8_t a, uint8_t b) {
+        return (int32_t) (get32(sectors[a], 4) - get32(sectors[b], 4)) < 0;
+      });
+      // Slots in the order their latest record was written.  Older ones are LRU, or freed longer ago.
+      std::vector<bool> seen(slots.size(), false);
+      std::vector<uint16_t> touched;
+      uint16_t last_records = 0;
+      for (uint8_t i : order)
+      {
+        last_records = 0;
+        for (uint16_t r = 0; r < RECORDS; r++)
+        {
+          size_t offset = HEADER + r * 8;
+          uint16_t slot = get16(sectors[i], offset + 4);
+          if (slot == NIL) break;
+          last_records++;
+          if (slot >= slots.size()) continue;
+          uint16_t length = get16(sectors[i], offset + 6);
+          Slot &s = slots[slot];
+          if (s.live)
+          {
+            auto mine = by_key.find(s.key);
+            if (mine != by_key.end() && mine->second == slot) by_key.erase(mine);
+          }
+          s.key = get32(sectors[i], offset);
+          s.sectors = length;
+          s.live = length != 0;
+          s.on_card = s.live;
+          s.record_sector = i;
+          if (s.live)
+          {
+            // A key can only live in one slot; the newer record wins.
+            auto old = by_key.find(s.key);
+            if (old != by_key.end() && old->second != slot) slots[old->second].live = false;
+            by_key[s.key] = slot;
+          }
+          seen[slot] = true;
+          touched.erase(std::remove(touched.begin(), touched.end(), slot), touched.end());
+          touched.push_back(slot);
+        }
+      }
+      free_slots.clear();
+      for (uint16_t i = 0; i < slots.size(); i++)
+      {
+        if (!seen[i]) free_slots.push_back(i);
+      }
+      for (uint16_t slot : touched)
+      {
+        if (slots[slot].live) push_front(slot);
+        else free_slots.push_back(slot);
+      }
+      if (!order.empty())
+      {
+        current = order.back();
+        sequence = get32(sectors[current], 4);
+        index = sectors[current];
+        records = last_records;
+      }
+      log.info("Sector cache: %d of %d slots in use", (int) size(), (int) slots.size());
+      return true;
+    }
+
+    // Forgets everything, on the card too.
+    void format()
+    {
+      reset();
+      if (slots.empty()) return;
+      std::vector<uint8_t> blank(512, 0);
+      diablo->media_set_sector(first_sector);
+      for (uint8_t i = 0; i < index_sectors; i++) diablo->media_write_sector(blank);
+      open(0);
+      sync(true);
+    }
+
+    // First sector of the key's slot, or NONE.  Counts as a use for LRU.
+    uint32_t find(uint32_t key)
+    {
+      auto it = by_key.find(key);
+      if (it == by_key.end()) return NONE;
+      unlink(it->second);
+      push_front(it->second);
+      return sector(it->second);
+    }
+
+    bool contains(uint32_t key) const
+    { return by_key.count(key) != 0; }
+
+    /*
+     * A slot for key, evicting the least recently used one if the region is full.
+     * If the key already has a slot it's handed back again (write over it).
+     * sectors = how much of the slot you'll use, up to slot_sectors; it's kept in the index.
+     */
+    uint32_t allocate(uint32_t key, uint16_t sectors = 0)
+    {
+      if (slots.empty()) return NONE;
+      if (sectors == 0 || sectors > slot_sectors) sectors = slot_sectors;
+      uint16_t slot;
+      auto it = by_key.find(key);
+      if (it != by_key.end())
+      {
+        slot = it->second;
+        unlink(slot);
+      } else if (!free_slots.empty())
+      {
+        slot = free_slots.front();
+        free_slots.pop_front();
+      } else if (tail != NIL)
+      {
+        slot = tail;
+        unlink(slot);
+        uint32_t evicted = slots[slot].key;
+        by_key.erase(evicted);
+        log.trace("Evicting %lu", (unsigned long) evicted);
+        if (evicted_handler) evicted_handler(evicted);
+      } else
+      {
+        return NONE;
+      }
+      Slot &s = slots[slot];
+      if (s.on_card)
+      {
+        // The card still maps the old contents here: unmap them before anyone writes over them.
+        if (s.live)
+        {
+          s.live = false;
+          append(slot);
+        }
+        sync(true);
+        s.on_card = false;
+      }
+      s.key = key;
+      s.sectors = sectors;
+      s.live = true;
+      s.on_card = true;
+      by_key[key] = slot;
+      push_front(slot);
+      append(slot);
+      return sector(slot);
+    }
+
+    bool release(uint32_t key)
+    {
+      auto it = by_key.find(key);
+      if (it == by_key.end()) return false;
+      uint16_t slot = it->second;
+      by_key.erase(it);
+      unlink(slot);
+      slots[slot].live = false;
+      slots[slot].sectors = 0;
+      free_slots.push_back(slot);
+      append(slot);
+      return true;
+    }
+
+    // How many sectors of its slot the key is using, 0 if it has none.
+    uint16_t sectors_used(uint32_t key) const
+    {
+      auto it = by_key.find(key);
+      return it == by_key.end() ? 0 : slots[it->second].sectors;
+    }
+
+    // Gets told about every key evicted to make room, so you can forget you had it.
+    void on_evict(EvictHandler handler)
+    { evicted_handler = handler; }
+
+    /*
+     * Writes the index out if it has changed.  Not blocking by default: the write's ACK is collected
+     *   like any other command's.
+     */
+    void sync(bool blocking = false)
+    {
+      if (!dirty) return;
+      diablo->media_set_sector(first_sector + current);
+      diablo->media_write_sector(index, LOG_LEVEL_TRACE, blocking);
+      dirty = false;
+    }
+
+    size_t size() const
+    { return by_key.size(); }
+
+    size_t capacity() const
+    { return slots.size(); }
+
+    // FNV-1a, for naming things by string.
+    static uint32_t key(const char *name)
+    {
+      uint32_t hash = 2166136261UL;
+      while (*name)
+      {
+        hash ^= (uint8_t) *name++;
+        hash *= 16777619UL;
+      }
+      return hash;
+    }
+
+  private:
+    static const uint16_t NIL = 0xFFFF;
+    static const uint32_t MAGIC = 0x44534331; // "DSC1"
+    // {magic, sequence, slot_sectors, slot count} then {key, slot, sectors used} records.
+    static const uint16_t HEADER = 12;
+    static const uint16_t RECORDS = (512 - HEADER) / 8;
+
+    struct Slot
+    {
+      uint32_t key = 0;
+      uint16_t sectors = 0;
+      bool live = false;
+      uint8_t record_sector = 0; // Index sector holding this slot's newest record.
+      bool on_card = false;      // The card's index might still map a key to it.
+      uint16_t prev = NIL;
+      uint16_t next = NIL;
+    };
+
+    Logger log;
+    Diablo *diablo;
+    uint32_t first_sector;
+    uint16_t slot_sectors;
+    uint8_t index_sectors;
+    std::vector<Slot> slots;
+    std::unordered_map<uint32_t, uint16_t> by_key;
+    std::deque<uint16_t> free_slots;
+    uint16_t head = NIL; // Most recently used.
+    uint16_t tail = NIL; // Next to go.
+    EvictHandler evicted_handler;
+
+    std::vector<uint8_t> index;
+    uint8_t current = 0;
+    uint32_t sequence = 0;
+    uint16_t records = 0;
+    bool dirty = false;
+
+    static uint16_t slot_count(uint32_t sector_count, uint16_t slot_sectors, uint8_t index_sectors)
+    {
+      if (slot_sectors == 0 || index_sectors == 0 || sector_count <= index_sectors) return 0;
+      return std::min<uint32_t>((sector_count - index_sectors) / slot_sectors, NIL);
+    }
+
+    uint32_t sector(uint16_t slot) const
+    { return first_sector + index_sectors + (uint32_t) slot * slot_sectors; }
+
+    void reset()
+    {
+      for (Slot &s : slots) s = Slot();
+      by_key.clear();
+      free_slots.clear();
+      for (uint16_t i = 0; i < slots.size(); i++) free_slots.push_back(i);
+      head = tail = NIL;
+      current = 0;
+      sequence = 0;
+      records = RECORDS; // Forces a fresh index sector on the first append.
+      dirty = false;
+    }
+
+    void unlink(uint16_t slot)
+    {
+      Slot &s = slots[slot];
+      if (s.prev != NIL) slots[s.prev].next = s.next;
+      else if (head == slot) head = s.next;
+      if (s.next != NIL) slots[s.next].prev = s.prev;
+      else if (tail == slot) tail = s.prev;
+      s.prev = s.next = NIL;
+    }
+
+    void push_front(uint16_t slot)
+    {
+      Slot &s = slots[slot];
+      s.prev = NIL;
+      s.next = head;
+      if (head != NIL) slots[head].prev = slot;
+      head = slot;
+      if (tail == NIL) tail = slot;
+    }
+
+    void append(uint16_t slot)
+    {
+      if (records >= RECORDS)
+      {
+        sync();
+        open((current + 1) % index_sectors);
+      }
+      write_record(slot);
+    }
+
+    /*
+     * Starts writing index sector i over.  Live slots whose newest record was in there get their
+     *   record carried over first, so nothing is lost when the log wraps around.
+     */
+    void open(uint8_t i)
+    {
+      current = i;
+      sequence++;
+      std::fill(index.begin(), index.end(), 0xFF);
+      put32(index, 0, MAGIC);
+      put32(index, 4, sequence);
+      put16(index, 8, slot_sectors);
+      put16(index, 10, slots.size());
+      records = 0;
+      dirty = true;
+      for (uint16_t slot = 0; slot < slots.size(); slot++)
+      {
+        if (slots[slot].live && slots[slot].record_sector == i) write_record(slot);
+      }
+    }
+
+    void write_record(uint16_t slot)
+    {
+      size_t offset = HEADER + records * 8;
+      put32(index, offset, slots[slot].key);
+      put16(index, offset + 4, slot);
+      put16(index, offset + 6, slots[slot].live ? slots[slot].sectors : 0);
+      slots[slot].record_sector = current;
+      records++;
+      dirty = true;
+    }
+
+    static uint32_t get32(const std::vector<uint8_t> &b, size_t at)
+    { return ((uint32_t) get16(b, at) << 16) | get16(b, at + 2); }
+
+    static uint16_t get16(const std::vector<uint8_t> &b, size_t at)
+    { return ((uint16_t) b[at] << 8) | b[at + 1]; }
+
+    static void put32(std::vector<uint8_t> &b, size_t at, uint32_t v)
+    {
+      put16(b, at, v >> 16);
+      put16(b, at + 2, v & 0xFFFF);
+    }
+
+    static void put16(std::vector<uint8_t> &b, size_t at, uint16_t v)
+    {
+      b[at] = v >> 8;
+      b[at + 1] = v & 0xFF;
+    }
+  };
+}
@@ -0,0 +1,337 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "serial_diablo.h"
+
+namespace diablo
+{
+  /*
+   * What's on screen, kept somewhere that survives a Photon reset, so a warm restart (OTA, watchdog)
+   *   can skip clear() and only repaint what's different.  The panel doesn't reset with the Photon;
+   *   it's still showing the last frame.
+   *
+   * It's a table of key -> value hashes: a widget's key and a hash of whatever state it last drew,
+   *   the BootSettings that were applied, and so on.  Any memory block will do: retained RAM on
+   *   a Photon, a MappedFile on Linux.
+   *
+   * STARTUP(System.enableFeature(FEATURE_RETAINED_MEMORY));
+   * retained uint32_t shadow_memory[256]; // 4 byte aligned, please.
+   * diablo::ShadowState shadow(diablo16, shadow_memory, sizeof(shadow_memory));
+   *
+   * void setup()
+   * {
+   *   if (!shadow.begin()) diablo16.clear(); // Cold: nothing on screen we know about.
+   *   if (shadow.stale("boot", settings.hash())) { diablo16.boot(settings); shadow.shown("boot", settings.hash()); }
+   * }
+   *
+   * void draw_temperature(int16_t tenths)
+   * {
+   *   uint32_t state = diablo::ShadowState::hash(&tenths, sizeof(tenths));
+   *   if (!shadow.stale("temperature", state)) return; // Already showing that.
+   *   ...draw it...
+   *   shadow.shown("temperature", state);
+   * }
+   *
+   * void loop()
+   * {
+   *   diablo16.advance();
+   *   shadow.sync();
+   * }
+   *
+   * Safe across a reset at any moment: shown() forgets the key in the shadow right away, and sync()
+   *   only records the new hash once the Diablo has ACK'd the commands that drew it - the ones sent
+   *   since the previous shown().  So call shown() right after drawing; for a deferred draw, at the end
+   *   of the deferred function.  A reset mid-draw leaves the key unknown, so it's redrawn.  A command
+   *   that failed leaves it unknown too.  A reset mid-write leaves the checksum wrong, so the whole
+   *   thing starts cold.
+   *
+   * NOTE:  If the display can lose power without the Photon, begin() can't tell.  invalidate_all()
+   *   after you notice.
+   */
+  class ShadowState
+  {
+  public:
+    ShadowState(Diablo &diablo, void *memory, size_t size) :
+        diablo(&diablo),
+        header((Header *) memory),
+        entries((Entry *) ((uint8_t *) memory + sizeof(Header))),
+        capacity(size > sizeof(Header) ? (uint16_t) std::min<size_t>((size - sizeof(Header)) / sizeof(Entry), 0xFFFF) : 0)
+    {}
+
+    /*
+     * True if the memory holds a valid shadow from before the reset: the screen still shows it.
+     * Otherwise formats it empty and returns false: clear and repaint everything.
+     */
+    bool begin()
+    {
+      pending.clear();
+      last_mark = diablo->commands_sent();
+      if (capacity == 0) return false;
+      was_warm = header->magic == MAGIC && header->capacity == capacity && header->checksum == checksum();
+      if (!was_warm) format();
+      return was_warm;
+    }
+
+    bool warm() const
+    { return was_warm; }
+
+    /*
+     * True unless key is known to show value, or is already on its way to: draw it, then shown().
+     */
+    bool stale(const char *key, uint32_t value) const
+    { return stale(hash(key), value); }
+
+    bool stale(uint32_t key, uint32_t value) const
+    {
+      int32_t slot = find(normal(key));
+      if (slot < 0) return true;
+      for (const Pending &p : pending)
+      {
+        if (p.slot == slot) return p.value != normal(value);
+      }
+      return entries[slot].value != normal(value);
+    }
+
+    /*
+     * key now shows value (or will, once the commands that drew it are ACK'd; see sync()).
+     */
+    void shown(const char *key, uint32_t value)
+    { shown(hash(key), value); }
+
+    void shown(uint32_t key, uint32_t value)
+    {
+      // The commands since the last shown() are the ones that drew this.
+      uint32_t from = last_mark;
+      uint32_t to = last_mark = diablo->commands_sent();
+      key = normal(key);
+      int32_t slot = find(key);
+      if (slot < 0) slot = claim(key);
+      if (slot < 0) return; // Full: it just won't survive a reset.
+      set(slot, UNKNOWN);
+      for (Pending &p : pending)
+      {
+        if (p.slot == slot)
+        {
+          // Drawn again before the last one was ACK'd: it rides on both lots of commands.
+          p.value = normal(value);
+          p.to = to;
+          return;
+        }
+      }
+      pending.push_back({(uint16_t) slot, normal(value), from, to});
+    }
+
+    /*
+     * Records what shown() was told, key by key, as soon as the commands that drew each one have been
+     *   ACK'd.  A key whose commands failed stays unknown.  Call it every loop.
+     */
+    void sync()
+    {
+      if (pending.empty()) return;
+      uint32_t completed = diablo->commands_completed();
+      size_t kept = 0;
+      for (size_t i = 0; i < pending.size(); i++)
+      {
+        const Pending &p = pending[i];
+        if ((int32_t) (completed - p.to) < 0)
+        {
+          pending[kept++] = p; // Still on the wire.
+          continue;
+        }
+        if (!diablo->failed_between(p.from, p.to)) set(p.slot, p.value);
+      }
+      pending.resize(kept);
+    }
+
+    // Every key repaints: after a clear(), or if the display reset on its own.
+    void invalidate_all()
+    {
+      pending.clear();
+      last_mark = diablo->commands_sent();
+      for (uint16_t i = 0; i < capacity; i++)
+      {
+        if (entries[i].key != EMPTY) set(i, UNKNOWN);
+      }
+    }
+
+    // Keys remembered.
+    uint16_t size() const
+    { return capacity ? header->count : 0; }
+
+    // FNV-1a.
+    static uint32_t hash(const void *data, size_t length, uint32_t seed = 2166136261UL)
+    {
+      const uint8_t *bytes = (const uint8_t *) data;
+      for (size_t i = 0; i < length; i++)
+      {
+        seed ^= bytes[i];
+        seed *= 16777619UL;
+      }
+      return seed;
+    }
+
+    static uint32_t hash(const char *text)
+    { return hash(text, strlen(text)); }
+
+  private:
+    static const uint32_t MAGIC = 0x44534831; // "DSH1"
+    static const uint32_t EMPTY = 0;
+    static const uint32_t UNKNOWN = 0;
+
+    struct Header
+    {
+      uint32_t magic;
+      uint16_t capacity;
+      uint16_t count;
+      uint32_t checksum;
+      uint32_t reserved;
+    };
+
+    struct Entry
+    {
+      uint32_t key;
+      uint32_t value;
+    };
+
+    struct Pending
+    {
+      uint16_t slot;
+      uint32_t value;
+      uint32_t from; // Drawn by commands (from, to].
+      uint32_t to;
+    };
+
+    Diablo *diablo;
+    Header *header;
+    Entry *entries;
+    uint16_t capacity;
+    bool was_warm = false;
+    std::vector<Pending> pending;
+    uint32_t last_mark = 0;
+
+    // Keeps real keys and values off the sentinels.
+    static uint32_t normal(uint32_t x)
+    { return x == 0 ? 1 : x; }
+
+    // Open addressing, linear probing.  Keys are never removed, so there are no tombstones.
+    int32_t find(uint32_t key) const
+    {
+      if (capacity == 0) return -1;
+      for (uint16_t i = 0, slot = key % capacity; i < capacity; i++, slot = (slot + 1) % capacity)
+      {
+        if (entries[slot].key == key) return slot;
+        if (entries[slot].key == EMPTY) return -1;
+      }
+      return -1;
+    }
+
+    int32_t claim(uint32_t key)
+    {
+      if (capacity == 0 || header->count >= capacity) return -1;
+      uint16_t slot = key % capacity;
+      while (entries[slot].key != EMPTY) slot = (slot + 1) % capacity;
+      header->checksum ^= mix(slot, entries[slot]);
+      entries[slot].key = key;
+      entries[slot].value = UNKNOWN;
+      header->checksum ^= mix(slot, entries[slot]);
+      header->checksum ^= mix_count(header->count);
+      header->count++;
+      header->checksum ^= mix_count(header->count);
+      return slot;
+    }
+
+    // The checksum is an XOR of per-entry mixes, so a write is O(1) to account for: out with the old, in with the new.
+    void set(uint16_t slot, uint32_t value)
+    {
+      header->checksum ^= mix(slot, entries[slot]);
+      entries[slot].value = value;
+      header->checksum ^= mix(slot, entries[slot]);
+    }
+
+    void format()
+    {
+      memset(entries, 0, (size_t) capacity * sizeof(Entry));
+      header->magic = MAGIC;
+      header->capacity = capacity;
+      header->count = 0;
+      header->reserved = 0;
+      header->checksum = checksum();
+    }
+
+    uint32_t checksum() const
+    {
+      uint32_t sum = MAGIC ^ mix_count(header->count) ^ capacity;
+      for (uint16_t i = 0; i < capacity; i++) sum ^= mix(i, entries[i]);
+      return sum;
+    }
+
+    // Murmur3's finalizer over slot, key and value.
+    static uint32_t mix(uint16_t slot, const Entry &e)
+    {
+      uint32_t h = e.key * 0x9E3779B1UL ^ (e.value + 0x7F4A7C15UL + slot) * 0x85EBCA77UL;
+      h ^= h >> 16;
+      h *= 0x85EBCA6BUL;
+      h ^= h >> 13;
+      h *= 0xC2B2AE35UL;
+      h ^= h >> 16;
+      return h;
+    }
+
+    static uint32_t mix_count(uint16_t count)
+    { return (uint32_t) count * 0x27D4EB2FUL; }
+  };
+
+#if defined(__linux__)
+  /*
+   * A file mapped into memory, standing in for retained RAM on a Linux gateway (or in tests):
+   *   the shadow survives the process restarting.
+   *
+   * diablo::MappedFile file("/var/lib/panel/shadow", 1024);
+   * diablo::ShadowState shadow(diablo16, file.data(), file.size());
+   */
+  class MappedFile
+  {
+  public:
+    MappedFile(const char *path, size_t size) :
+        length(size)
+    {
+      int fd = open(path, O_RDWR | O_CREAT, 0644);
+      if (fd < 0) return;
+      if (ftruncate(fd, size) == 0)
+      {
+        void *mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (mapped != MAP_FAILED) memory = mapped;
+      }
+      close(fd);
+    }
+
+    ~MappedFile()
+    {
+      if (memory) munmap(memory, length);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    // nullptr if the file couldn't be mapped.
+    void *data() const
+    { return memory; }
+
+    size_t size() const
+    { return memory ? length : 0; }
+
+  private:
+    void *memory = nullptr;
+    size_t length;
+  };
+#endif
+}
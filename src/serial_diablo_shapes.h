@@ -0,0 +1,204 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace diablo
+{
+  /*
+   * Compile-time shape generators.
+   *
+   * Everything in here is constexpr, so a static shape costs zero math and zero allocation at runtime:
+   *   the vertex array is computed by the compiler and lands in flash.  Feed it to the pointer flavors
+   *   of the poly commands, which write straight out of the array.
+   *
+   * static constexpr auto badge = diablo::shapes::star<5>(400, 240, 60, 25);
+   * diablo16.draw_polygon_filled(badge.vertices(), badge.count, yellow);
+   *
+   * Angles are degrees, 0 = 3 o'clock, increasing clockwise (screen y grows downward).
+   * Vertices come out in the x1..xn, y1..yn layout the poly commands want.
+   *
+   * NOTE:  The generators loop and fill in arrays, which constexpr only allows from C++14 on.  Built as
+   *   C++11 the header stops the build with an #error saying so.
+   */
+#if __cplusplus >= 201402L
+  namespace shapes
+  {
+    // N vertices in poly-command layout.
+    template<size_t N>
+    struct Poly
+    {
+      static constexpr uint16_t count = N;
+      uint16_t words[2 * N] = {};
+
+      constexpr const uint16_t *vertices() const
+      { return words; }
+
+      constexpr void set(size_t i, double x, double y)
+      {
+        words[i] = round(x);
+        words[N + i] = round(y);
+      }
+
+      constexpr uint16_t x(size_t i) const
+      { return words[i]; }
+
+      constexpr uint16_t y(size_t i) const
+      { return words[N + i]; }
+
+    private:
+      // Negative coordinates keep their two's complement bits, same as the rest of the library.
+      static constexpr uint16_t round(double v)
+      { return (uint16_t) (int16_t) (v < 0 ? v - 0.5 : v + 0.5); }
+    };
+
+    // N separate line segments, {x1, y1, x2, y2} each.  For draw_line().
+    template<size_t N>
+    struct Lines
+    {
+      static constexpr uint16_t count = N;
+      uint16_t lines[N][4] = {};
+    };
+
+    constexpr double PI = 3.14159265358979323846;
+
+    // Taylor series after wrapping into [-pi, pi].  Plenty accurate for pixels.
+    constexpr double sin_rad(double rad)
+    {
+      while (rad > PI) rad -= 2 * PI;
+      while (rad < -PI) rad += 2 * PI;
+      double term = rad, sum = rad;
+      for (int i = 1; i < 12; i++)
+      {
+        term *= -rad * rad / ((2 * i) * (2 * i + 1));
+        sum += term;
+      }
+      return sum;
+    }
+
+    constexpr double sin_deg(double degrees)
+    { return sin_rad(degrees * PI / 180); }
+
+    constexpr double cos_deg(double degrees)
+    { return sin_rad((degrees + 90) * PI / 180); }
+
+    /*
+     * Regular N-gon around cx, cy.  The first vertex sits at `rotation` degrees.
+     */
+    template<size_t N>
+    constexpr Poly<N> regular_polygon(double cx, double cy, double radius, double rotation = -90)
+    {
+      static_assert(N >= 3, "A polygon needs at least 3 vertices");
+      Poly<N> out{};
+      for (size_t i = 0; i < N; i++)
+      {
+        double angle = rotation + 360.0 * i / N;
+        out.set(i, cx + radius * cos_deg(angle), cy + radius * sin_deg(angle));
+      }
+      return out;
+    }
+
+    /*
+     * Star with Points points, alternating between the outer and inner radius.
+     * The default rotation puts the first point straight up.
+     */
+    template<size_t Points>
+    constexpr Poly<2 * Points> star(double cx, double cy, double outer, double inner, double rotation = -90)
+    {
+      static_assert(Points >= 2, "A star needs at least 2 points");
+      Poly<2 * Points> out{};
+      for (size_t i = 0; i < 2 * Points; i++)
+      {
+        double angle = rotation + 180.0 * i / Points;
+        double r = i % 2 == 0 ? outer : inner;
+        out.set(i, cx + r * cos_deg(angle), cy + r * sin_deg(angle));
+      }
+      return out;
+    }
+
+    /*
+     * Rectangle from x1, y1 to x2, y2 (x1 < x2, y1 < y2) with corners rounded to `radius`.
+     * Each corner is a quarter circle of Segments line segments, so Segments + 1 vertices per corner.
+     * 2 or 3 segments is plenty for small radii; the Diablo16 has to fill every one of them.
+     */
+    template<size_t Segments>
+    constexpr Poly<4 * (Segments + 1)> rounded_rectangle(double x1, double y1, double x2, double y2, double radius)
+    {
+      static_assert(Segments >= 1, "Each corner needs at least 1 segment");
+      Poly<4 * (Segments + 1)> out{};
+      // Corner centers, clockwise from top right, and where each quarter arc starts.
+      const double cx[4] = {x2 - radius, x2 - radius, x1 + radius, x1 + radius};
+      const double cy[4] = {y1 + radius, y2 - radius, y2 - radius, y1 + radius};
+      const double start[4] = {-90, 0, 90, 180};
+      size_t v = 0;
+      for (size_t corner = 0; corner < 4; corner++)
+      {
+        for (size_t s = 0; s <= Segments; s++)
+        {
+          double angle = start[corner] + 90.0 * s / Segments;
+          out.set(v++, cx[corner] + radius * cos_deg(angle), cy[corner] + radius * sin_deg(angle));
+        }
+      }
+      return out;
+    }
+
+    /*
+     * Arrow pointing from the tail (x1, y1) to the tip (x2, y2).
+     *
+     * shaft_width = thickness of the shaft.
+     * head_length = distance from the tip back to where the head meets the shaft.
+     * head_width = full width of the head at its base.
+     */
+    constexpr Poly<7> arrow(double x1, double y1, double x2, double y2,
+                            double shaft_width, double head_length, double head_width)
+    {
+      Poly<7> out{};
+      double dx = x2 - x1, dy = y2 - y1;
+      double length_squared = dx * dx + dy * dy;
+      if (length_squared == 0) return out;
+      // Newton's method square root, since std::sqrt isn't constexpr.
+      double length = length_squared > 1 ? length_squared : 1;
+      for (int i = 0; i < 40; i++) length = (length + length_squared / length) / 2;
+      // Unit vector along the arrow and its normal.
+      double ux = dx / length, uy = dy / length, nx = -uy, ny = ux;
+      double bx = x2 - ux * head_length, by = y2 - uy * head_length;
+      double s = shaft_width / 2, h = head_width / 2;
+      out.set(0, x1 + nx * s, y1 + ny * s);
+      out.set(1, bx + nx * s, by + ny * s);
+      out.set(2, bx + nx * h, by + ny * h);
+      out.set(3, x2, y2);
+      out.set(4, bx - nx * h, by - ny * h);
+      out.set(5, bx - nx * s, by - ny * s);
+      out.set(6, x1 - nx * s, y1 - ny * s);
+      return out;
+    }
+
+    /*
+     * Count tick marks around cx, cy from start to end degrees (inclusive), for dials and gauges.
+     * Each tick runs from radius `inner` out to radius `outer`.
+     */
+    template<size_t Count>
+    constexpr Lines<Count> tick_marks(double cx, double cy, double inner, double outer,
+                                      double start = 135, double end = 405)
+    {
+      static_assert(Count >= 1, "Need at least 1 tick");
+      Lines<Count> out{};
+      for (size_t i = 0; i < Count; i++)
+      {
+        double angle = Count == 1 ? start : start + (end - start) * i / (Count - 1);
+        double c = cos_deg(angle), s = sin_deg(angle);
+        Poly<2> ends{};
+        ends.set(0, cx + inner * c, cy + inner * s);
+        ends.set(1, cx + outer * c, cy + outer * s);
+        out.lines[i][0] = ends.x(0);
+        out.lines[i][1] = ends.y(0);
+        out.lines[i][2] = ends.x(1);
+        out.lines[i][3] = ends.y(1);
+      }
+      return out;
+    }
+  }
+#else
+#error "serial_diablo_shapes.h needs -std=gnu++14"
+#endif
+}
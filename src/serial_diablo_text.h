@@ -0,0 +1,276 @@
+#pragma once
+
+#include <string>
+#include <string.h>
+#include <vector>
+
+#include "serial_diablo.h"
+#include "serial_diablo_fonts.h"
+
+namespace diablo
+{
+  /*
+   * One line of a Layout: a slice of its text, trailing spaces dropped.
+   */
+  struct TextLine
+  {
+    uint16_t offset;
+    uint16_t length;
+    uint16_t width;  // Pixels.
+  };
+
+  /*
+   * A paragraph broken into lines for a box width.  Nothing in it depends on color or position, so
+   *   the same Layout draws anywhere in any color.
+   */
+  struct Layout
+  {
+    std::string text;
+    Fonts::Id font = Fonts::NONE;
+    uint16_t box_width = 0;
+    uint16_t line_height = 0;
+    std::vector<TextLine> lines;
+
+    uint16_t height() const
+    { return lines.size() * line_height; }
+
+    // The widest line, which can be less than box_width.
+    uint16_t width() const
+    {
+      uint16_t widest = 0;
+      for (const TextLine &line : lines) widest = std::max(widest, line.width);
+      return widest;
+    }
+  };
+
+  /*
+   * Word wraps paragraphs (alarms, help text) into a box, and remembers the answer.
+   *
+   * Glyph widths come from the font file for Fonts it uploaded, and from char_width()/char_height() for
+   *   the system font, asked once per character and then kept.  Laying out is one pass over the text
+   *   with a table lookup per character.  Laid out paragraphs are cached by text, font and box width,
+   *   so redrawing one - moved, or in another color - is a lookup and the commands, nothing else.
+   *
+   * Breaks go at spaces; '\n' always breaks; a word too long for the box gets split where it overflows.
+   *
+   * diablo::TextLayout text(diablo16, fonts);
+   * text.print(big, 10, 60, 380, "Pump 2 pressure low.\nCheck the inlet filter and restart.", RED);
+   * ...
+   * text.print(big, 10, 60, 380, "Pump 2 pressure low.\nCheck the inlet filter and restart.", WHITE); // No layout.
+   *
+   * Or lay_out() once and draw() it: the height is known before anything's drawn, to size a box for it.
+   */
+  class TextLayout
+  {
+  public:
+    TextLayout(Diablo &diablo, Fonts &fonts, uint8_t capacity = 16) :
+        diablo(&diablo),
+        fonts(&fonts),
+        capacity(std::max<uint8_t>(capacity, 1))
+    {
+      // Layouts are handed out by reference, so they mustn't move.
+      cache.reserve(this->capacity);
+    }
+
+    /*
+     * text in font, broken into lines no wider than box_width pixels.  Cached; the reference is good
+     *   until capacity other paragraphs have been laid out since it was last used.
+     */
+    const Layout &lay_out(Fonts::Id font, const char *text, uint16_t box_width, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      size_t length = strlen(text);
+      uint32_t key = hash(font, box_width, text, length);
+      Entry *oldest = nullptr;
+      for (Entry &entry : cache)
+      {
+        if (entry.key == key && entry.layout.font == font && entry.layout.box_width == box_width &&
+            entry.layout.text.compare(0, std::string::npos, text, length) == 0)
+        {
+          entry.used = ++tick;
+          hit_count++;
+          return entry.layout;
+        }
+        if (!oldest || entry.used < oldest->used) oldest = &entry;
+      }
+      miss_count++;
+      if (cache.size() < capacity)
+      {
+        cache.push_back(Entry());
+        oldest = &cache.back();
+      }
+      oldest->key = key;
+      oldest->used = ++tick;
+      break_lines(oldest->layout, font, text, length, box_width, log_level);
+      return oldest->layout;
+    }
+
+    /*
+     * Draws a Layout with its top left at x, y, in the current text color: per line, one move and one
+     *   string.  Blank lines cost nothing.
+     */
+    void draw(const Layout &layout, uint16_t x, uint16_t y, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      if (layout.font == Fonts::SYSTEM) fonts->system(log_level);
+      else fonts->use(layout.font, log_level);
+      for (size_t i = 0; i < layout.lines.size(); i++)
+      {
+        const TextLine &line = layout.lines[i];
+        if (line.length == 0) continue;
+        diablo->move_origin(x, y + i * layout.line_height, log_level);
+        diablo->put_string(layout.text.c_str() + line.offset, line.length, log_level);
+      }
+    }
+
+    // In color.  The text color is only sent when it changes.
+    void draw(const Layout &layout, uint16_t x, uint16_t y, uint16_t color, LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      if (!color_known || color != foreground)
+      {
+        diablo->text_foreground(color, log_level);
+        foreground = color;
+        color_known = true;
+      }
+      draw(layout, x, y, log_level);
+    }
+
+    // lay_out() and draw().  Returns the layout, for its size.
+    const Layout &print(Fonts::Id font, uint16_t x, uint16_t y, uint16_t box_width, const char *text, uint16_t color,
+                        LogLevel log_level = LOG_LEVEL_TRACE)
+    {
+      const Layout &layout = lay_out(font, text, box_width, log_level);
+      draw(layout, x, y, color, log_level);
+      return layout;
+    }
+
+    // Someone else set the text color: send it again next time.
+    void forget_color()
+    { color_known = false; }
+
+    // Drops the cached layouts, and the system font's measurements (after a reset, say).
+    void clear()
+    {
+      cache.clear();
+      system_measured.assign(256, false);
+      system_height = 0;
+    }
+
+    uint32_t hits() const
+    { return hit_count; }
+
+    uint32_t misses() const
+    { return miss_count; }
+
+  private:
+    struct Entry
+    {
+      uint32_t key = 0;
+      uint32_t used = 0;
+      Layout layout;
+    };
+
+    Diablo *diablo;
+    Fonts *fonts;
+    uint8_t capacity;
+    std::vector<Entry> cache;
+    uint32_t tick = 0;
+    uint32_t hit_count = 0;
+    uint32_t miss_count = 0;
+    uint16_t foreground = 0;
+    bool color_known = false;
+    // The system font's widths, as the Diablo reports them.
+    std::vector<uint8_t> system_widths = std::vector<uint8_t>(256);
+    std::vector<bool> system_measured = std::vector<bool>(256);
+    uint16_t system_height = 0;
+
+    uint16_t width(Fonts::Id font, char c, LogLevel log_level)
+    {
+      if (font != Fonts::SYSTEM) return (*fonts)[font].width(c);
+      uint8_t i = (uint8_t) c;
+      if (!system_measured[i])
+      {
+        fonts->system(log_level);
+        system_widths[i] = (uint8_t) diablo->char_width(c, log_level);
+        system_measured[i] = true;
+      }
+      return system_widths[i];
+    }
+
+    uint16_t line_height(Fonts::Id font, LogLevel log_level)
+    {
+      if (font != Fonts::SYSTEM) return (*fonts)[font].height;
+      if (system_height == 0)
+      {
+        fonts->system(log_level);
+        system_height = diablo->char_height('A', log_level);
+      }
+      return system_height;
+    }
+
+    // Greedy: as many words as fit on each line.
+    void break_lines(Layout &layout, Fonts::Id font, const char *text, size_t length, uint16_t box_width, LogLevel log_level)
+    {
+      layout.text.assign(text, length);
+      layout.font = font;
+      layout.box_width = box_width;
+      layout.lines.clear();
+      if (font != Fonts::SYSTEM && font >= fonts->size()) return;
+      layout.line_height = line_height(font, log_level);
+
+      size_t start = 0;
+      while (start < length)
+      {
+        uint16_t w = 0;
+        size_t space = SIZE_MAX; // The last place this line could break, and how wide it is up to there.
+        uint16_t space_width = 0;
+        size_t i = start;
+        for (; i < length && text[i] != '\n'; i++)
+        {
+          if (text[i] == ' ')
+          {
+            space = i;
+            space_width = w;
+          }
+          uint16_t cw = width(font, text[i], log_level);
+          if (w + cw > box_width && i > start) break;
+          w += cw;
+        }
+        if (i == length || text[i] == '\n')
+        {
+          add_line(layout, font, start, i, w, log_level);
+          start = i + 1;
+          continue;
+        }
+        if (space != SIZE_MAX && space > start)
+        {
+          add_line(layout, font, start, space, space_width, log_level);
+          start = space + 1;
+        }
+        else
+        {
+          add_line(layout, font, start, i, w, log_level);
+          start = i;
+        }
+        // Wrapped lines don't start with the spaces they wrapped at.
+        while (start < length && text[start] == ' ') start++;
+      }
+    }
+
+    void add_line(Layout &layout, Fonts::Id font, size_t start, size_t end, uint16_t w, LogLevel log_level)
+    {
+      while (end > start && layout.text[end - 1] == ' ') w -= width(font, layout.text[--end], log_level);
+      layout.lines.push_back({(uint16_t) start, (uint16_t) (end - start), w});
+    }
+
+    // FNV-1a over the text, seeded with the font and width.
+    static uint32_t hash(Fonts::Id font, uint16_t box_width, const char *text, size_t length)
+    {
+      uint32_t h = 2166136261UL ^ ((uint32_t) font << 16 | box_width);
+      for (size_t i = 0; i < length; i++)
+      {
+        h ^= (uint8_t) text[i];
+        h *= 16777619UL;
+      }
+      return h;
+    }
+  };
+}
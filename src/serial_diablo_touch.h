@@ -0,0 +1,265 @@
+#pragma once
+
+#include "serial_diablo.h"
+
+namespace diablo
+{
+  /*
+   * Gets told about a touch on its target.
+   * status = Diablo::TOUCH_PRESSED, TOUCH_MOVING or TOUCH_RELEASED.  x, y are screen coordinates.
+   * Moves and the release go to whoever got the press, even once the finger has wandered off:
+   *   check page.contains(id, x, y) on release if you only want clicks that end on the button.
+   */
+  typedef std::function<void(uint16_t id, uint16_t status, uint16_t x, uint16_t y)> TargetHandler;
+
+  /*
+   * One page worth of touch targets, indexed by a uniform grid.
+   *
+   * The screen is cut into square cells (32px by default) and every cell keeps the targets that
+   *   overlap it, oldest first.  A hit test is a shift to find the cell and a walk over the handful of
+   *   targets in it, newest first - so finding the topmost target costs the same with 5 targets or 500.
+   * Targets added later sit on top of the ones added before them.
+   *
+   * Pick a cell size around the size of your smallest targets.  Much smaller and big targets get
+   *   copied into a lot of cells, much bigger and cells get crowded.
+   */
+  class TouchPage
+  {
+  public:
+    static const uint16_t NO_TARGET = 0xFFFF;
+
+    TouchPage(uint16_t width, uint16_t height, uint8_t cell_shift = 5) :
+        cell_shift(cell_shift),
+        columns((width + (1 << cell_shift) - 1) >> cell_shift),
+        rows((height + (1 << cell_shift) - 1) >> cell_shift),
+        cells(columns * rows)
+    {}
+
+    /*
+     * x1, y1 to x2, y2 inclusive, like draw_rectangle.  Returns the target's id.
+     */
+    uint16_t add(uint16_t x1, uint16_t y1, uint16_t x2, uint16_t y2, TargetHandler handler)
+    {
+      uint16_t id;
+      if (free_ids.empty())
+      {
+        id = targets.size();
+        targets.push_back(Target());
+      } else
+      {
+        id = free_ids.back();
+        free_ids.pop_back();
+      }
+      targets[id] = {std::min(x1, x2), std::min(y1, y2), std::max(x1, x2), std::max(y1, y2), true, true, handler};
+      // Appending keeps every cell in stacking order: this is the newest, so it goes on top.
+      each_cell(targets[id], [id](std::vector<uint16_t> &cell) { cell.push_back(id); });
+      return id;
+    }
+
+    bool remove(uint16_t id)
+    {
+      if (!valid(id)) return false;
+      each_cell(targets[id], [id](std::vector<uint16_t> &cell) {
+        cell.erase(std::find(cell.begin(), cell.end(), id));
+      });
+      targets[id].alive = false;
+      targets[id].handler = nullptr;
+      free_ids.push_back(id);
+      return true;
+    }
+
+    // A disabled target stays put but lets touches fall through to whatever's under it.
+    void enable(uint16_t id, bool enabled = true)
+    {
+      if (valid(id)) targets[id].enabled = enabled;
+    }
+
+    void clear()
+    {
+      targets.clear();
+      free_ids.clear();
+      for (std::vector<uint16_t> &cell : cells) cell.clear();
+    }
+
+    // Topmost enabled target under x, y, or NO_TARGET.
+    uint16_t hit(uint16_t x, uint16_t y) const
+    {
+      uint16_t column = x >> cell_shift, row = y >> cell_shift;
+      if (column >= columns || row >= rows) return NO_TARGET;
+      const std::vector<uint16_t> &cell = cells[row * columns + column];
+      for (auto it = cell.rbegin(); it != cell.rend(); ++it)
+      {
+        if (targets[*it].enabled && contains(*it, x, y)) return *it;
+      }
+      return NO_TARGET;
+    }
+
+    bool contains(uint16_t id, uint16_t x, uint16_t y) const
+    {
+      if (!valid(id)) return false;
+      const Target &t = targets[id];
+      return x >= t.x1 && x <= t.x2 && y >= t.y1 && y <= t.y2;
+    }
+
+    size_t size() const
+    { return targets.size() - free_ids.size(); }
+
+  private:
+    friend class TouchScreen;
+
+    struct Target
+    {
+      uint16_t x1;
+      uint16_t y1;
+      uint16_t x2;
+      uint16_t y2;
+      bool alive;
+      bool enabled;
+      TargetHandler handler;
+    };
+
+    uint8_t cell_shift;
+    uint16_t columns;
+    uint16_t rows;
+    std::vector<std::vector<uint16_t>> cells;
+    std::vector<Target> targets;
+    std::vector<uint16_t> free_ids;
+
+    bool valid(uint16_t id) const
+    { return id < targets.size() && targets[id].alive; }
+
+    template<typename Visit>
+    void each_cell(const Target &t, Visit visit)
+    {
+      uint16_t first_column = t.x1 >> cell_shift, first_row = t.y1 >> cell_shift;
+      uint16_t last_column = std::min<uint16_t>(t.x2 >> cell_shift, columns - 1);
+      uint16_t last_row = std::min<uint16_t>(t.y2 >> cell_shift, rows - 1);
+      for (uint16_t row = first_row; row <= last_row; row++)
+      {
+        for (uint16_t column = first_column; column <= last_column; column++)
+        { visit(cells[row * columns + column]); }
+      }
+    }
+  };
+
+  /*
+   * Touch targets for a whole app: a TouchPage per screen, and the polling to feed them.
+   *
+   * diablo::TouchScreen touch(diablo16, 800, 480);
+   * touch.page(KEYPAD).add(10, 300, 90, 380, [](uint16_t id, uint16_t status, uint16_t x, uint16_t y) {
+   *   if (status == diablo::Diablo::TOUCH_RELEASED) key_pressed('7');
+   * });
+   * touch.begin();
+   * touch.show(KEYPAD);
+   *
+   * void loop() { touch.update(); diablo16.advance(); }
+   *
+   * update() defers a touch_poll (status, x and y in one burst) every poll_ms, so it waits its turn
+   *   behind your drawing instead of blocking on it.  The answer comes back through advance() and is
+   *   dispatched straight to the target: one grid lookup, however many controls the page has.
+   * Switching pages is just pointing at a different index, nothing gets rebuilt.
+   */
+  class TouchScreen
+  {
+  public:
+    TouchScreen(Diablo &diablo, uint16_t width, uint16_t height, uint16_t poll_ms = 20, uint8_t cell_shift = 5) :
+        diablo(&diablo),
+        width(width),
+        height(height),
+        poll_ms(poll_ms),
+        cell_shift(cell_shift)
+    {}
+
+    // Turns the touch screen on.
+    void begin()
+    {
+      diablo->touch_set(Diablo::TOUCH_ENABLE);
+    }
+
+    // The page at index, made on first use.
+    TouchPage &page(uint8_t index)
+    {
+      while (pages.size() <= index) pages.emplace_back(width, height, cell_shift);
+      return pages[index];
+    }
+
+    /*
+     * Routes touches to another page from now on.
+     * A press in progress is dropped: its target is probably not on screen anymore.
+     */
+    void show(uint8_t index)
+    {
+      page(index);
+      current = index;
+      captured = TouchPage::NO_TARGET;
+    }
+
+    uint8_t showing() const
+    { return current; }
+
+    typedef std::function<void(uint16_t status, uint16_t x, uint16_t y)> TouchHandler;
+
+    // Gets told about every touch, target or not.  For things that care that someone's there at all.
+    void on_touch(TouchHandler handler)
+    { touched = handler; }
+
+    // How often update() polls.  Slower while nobody's about saves the link a poll every 20ms.
+    void poll_every(uint16_t ms)
+    { poll_ms = ms; }
+
+    // Call from loop().
+    void update()
+    {
+      // A poll that never answers - invalidated, replaced, dropped while the wire was taken - is given
+      //   up on after a while.  Deferring another just dedupes if the old one is still in line.
+      if (polling && millis() - last_poll < POLL_TIMEOUT_MS) return;
+      if (millis() - last_poll < poll_ms) return;
+      polling = true;
+      last_poll = millis();
+      // Urgent: a touch is what brings a paced screen back to full rate, so it can't wait out the pace.
+      diablo->defer_urgent("touch_poll", [this]() {
+        diablo->touch_poll([this](bool ok, uint16_t status, uint16_t x, uint16_t y) {
+          polling = false;
+          if (ok) dispatch(status, x, y);
+        });
+      });
+    }
+
+    /*
+     * Hands a touch to the current page.  update() calls this, but you can feed it yourself
+     *   if you're polling some other way.
+     */
+    void dispatch(uint16_t status, uint16_t x, uint16_t y)
+    {
+      if (touched && (status == Diablo::TOUCH_PRESSED || status == Diablo::TOUCH_MOVING || status == Diablo::TOUCH_RELEASED))
+      { touched(status, x, y); }
+      if (pages.empty()) return;
+      TouchPage &p = pages[current];
+      if (status == Diablo::TOUCH_PRESSED)
+      { captured = p.hit(x, y); }
+      if (captured == TouchPage::NO_TARGET || !p.valid(captured)) return;
+      if (status != Diablo::TOUCH_PRESSED && status != Diablo::TOUCH_MOVING && status != Diablo::TOUCH_RELEASED)
+      { return; }
+      uint16_t id = captured;
+      if (status == Diablo::TOUCH_RELEASED) captured = TouchPage::NO_TARGET;
+      // Copy: the handler is allowed to remove its own target.
+      TargetHandler handler = p.targets[id].handler;
+      if (handler) handler(id, status, x, y);
+    }
+
+  private:
+    static const uint16_t POLL_TIMEOUT_MS = 1000;
+
+    Diablo *diablo;
+    uint16_t width;
+    uint16_t height;
+    uint16_t poll_ms;
+    uint8_t cell_shift;
+    std::deque<TouchPage> pages;
+    uint8_t current = 0;
+    uint16_t captured = TouchPage::NO_TARGET;
+    bool polling = false;
+    unsigned long last_poll = 0;
+    TouchHandler touched;
+  };
+}
@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+"""
+Builds an asset pack for diablo::AssetPack / diablo::MappedAssetPack (src/serial_diablo_assets.h).
+
+  asset_pack.py out.pack logo=logo.png splash=splash.png font=font.bin
+
+Images (anything Pillow opens) become big-endian RGB565 pixels, ready to blit or to upload for
+media_image_raw.  Everything else goes in as it is: a uSD payload.  name=path:raw forces that for
+an image file too.
+
+Layout, little-endian:
+  sector 0   magic "DAP1", u16 version 1, u16 0, u32 entry count, u32 index offset (512)
+  index      16 bytes per entry, sorted by FNV-1a of the name:
+             u32 hash, u32 first sector, u32 length, u16 width, u16 height (0, 0 for payloads)
+  entries    each on a 512 byte boundary, zero padded to the next one
+"""
+import struct
+import sys
+
+SECTOR = 512
+IMAGE_SUFFIXES = ('.png', '.jpg', '.jpeg', '.bmp', '.gif', '.tga', '.tif', '.tiff', '.webp')
+
+
+def fnv1a(name):
+    h = 2166136261
+    for b in name.encode('utf-8'):
+        h = ((h ^ b) * 16777619) & 0xFFFFFFFF
+    return h
+
+
+def rgb565(path):
+    from PIL import Image  # Only needed for images.
+    image = Image.open(path).convert('RGB')
+    rgb = image.tobytes()
+    out = bytearray()
+    for i in range(0, len(rgb), 3):
+        r, g, b = rgb[i], rgb[i + 1], rgb[i + 2]
+        out += struct.pack('>H', (r >> 3) << 11 | (g >> 2) << 5 | b >> 3)
+    return image.width, image.height, bytes(out)
+
+
+def load(spec):
+    name, _, path = spec.partition('=')
+    if not name or not path:
+        sys.exit('expected name=path, got %s' % spec)
+    raw = path.endswith(':raw')
+    if raw:
+        path = path[:-4]
+    if not raw and path.lower().endswith(IMAGE_SUFFIXES):
+        width, height, data = rgb565(path)
+        if width > 0xFFFF or height > 0xFFFF:
+            sys.exit('%s is too big' % path)
+        return name, width, height, data
+    with open(path, 'rb') as f:
+        return name, 0, 0, f.read()
+
+
+def pad(data):
+    return data + b'\0' * (-len(data) % SECTOR)
+
+
+def build(assets):
+    by_hash = {}
+    for name, width, height, data in assets:
+        h = fnv1a(name)
+        if h in by_hash:
+            sys.exit('%s and %s hash the same, rename one' % (by_hash[h][0], name))
+        by_hash[h] = (name, width, height, data)
+    index_sectors = (len(by_hash) * 16 + SECTOR - 1) // SECTOR
+    sector = 1 + index_sectors
+    index = bytearray()
+    body = bytearray()
+    for h in sorted(by_hash):
+        name, width, height, data = by_hash[h]
+        index += struct.pack('<IIIHH', h, sector, len(data), width, height)
+        body += pad(data)
+        sector += len(pad(data)) // SECTOR
+    header = struct.pack('<4sHHII', b'DAP1', 1, 0, len(by_hash), SECTOR)
+    return pad(header) + pad(bytes(index)) + bytes(body)
+
+
+def main(argv):
+    if len(argv) < 2:
+        sys.exit(__doc__)
+    pack = build([load(spec) for spec in argv[1:]])
+    with open(argv[0], 'wb') as f:
+        f.write(pack)
+    print('%s: %d assets, %d bytes' % (argv[0], len(argv) - 1, len(pack)))
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])
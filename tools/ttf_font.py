@@ -0,0 +1,97 @@
+#!/usr/bin/env python3
+"""
+Rasterizes a TrueType font into uSD fonts for diablo::Fonts (src/serial_diablo_fonts.h).
+
+  ttf_font.py DejaVuSans.ttf 24,32,48 fonts/sans            -> fonts/sans-24.fnt, fonts/sans-32.fnt, ...
+  ttf_font.py DejaVuSans.ttf 64 fonts/digits --chars 0123456789.-%
+
+Sizes are the em in pixels, not points; the line height comes out a little taller.  The default character range is printable ASCII; --first/--last pick another
+range and --chars keeps only the ones listed (the others are still in the range, just blank and zero wide).
+Pixels are on where the antialiased glyph is at least --threshold (0-255, default 128).
+
+The .fnt files go in an asset pack as raw payloads (asset_pack.py pack big=fonts/sans-48.fnt), or onto the
+card as they are.
+
+Layout, 4D's proportional uSD font:
+  u8 type (2 = proportional), u8 character count, u8 first character, u8 widest, u8 height
+  u8 width of each character
+  each character: height rows of (widest + 7) / 8 bytes, leftmost pixel in the top bit
+"""
+import argparse
+import os
+import sys
+
+PROPORTIONAL = 2
+
+
+def rasterize(path, size, first, last, keep):
+    from PIL import Image, ImageDraw, ImageFont
+    font = ImageFont.truetype(path, size)
+    ascent, descent = font.getmetrics()
+    height = ascent + descent
+    if height > 255:
+        sys.exit('%s at %d is %d pixels high, 255 is the most a font can be' % (path, size, height))
+    glyphs = []
+    for code in range(first, last + 1):
+        ch = chr(code)
+        if keep is not None and ch not in keep:
+            glyphs.append((0, None))
+            continue
+        width = max(1, int(round(font.getlength(ch))))
+        if width > 255:
+            sys.exit('%r is %d pixels wide at %d, 255 is the most a glyph can be' % (ch, width, size))
+        image = Image.new('L', (width, height), 0)
+        # Anchored at the ascender, so every glyph sits on the same baseline.  Overhangs past the advance
+        #   get clipped: the next character's cell would draw over them anyway.
+        ImageDraw.Draw(image).text((0, 0), ch, font=font, fill=255, anchor='la')
+        glyphs.append((width, image))
+    return height, glyphs
+
+
+def encode(first, height, glyphs, threshold):
+    widest = max([width for width, _ in glyphs] + [1])
+    stride = (widest + 7) // 8
+    out = bytearray([PROPORTIONAL, len(glyphs), first, widest, height])
+    out += bytes(width for width, _ in glyphs)
+    for width, image in glyphs:
+        cell = bytearray(stride * height)
+        if image is not None:
+            pixels = image.tobytes()
+            for y in range(height):
+                for x in range(width):
+                    if pixels[y * width + x] >= threshold:
+                        cell[y * stride + x // 8] |= 0x80 >> (x % 8)
+        out += cell
+    return bytes(out)
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('ttf')
+    parser.add_argument('sizes', help='pixel heights, comma separated')
+    parser.add_argument('out', help='output prefix: -<size>.fnt is added')
+    parser.add_argument('--first', type=int, default=32)
+    parser.add_argument('--last', type=int, default=126)
+    parser.add_argument('--chars', help='only rasterize these; the rest of the range is left blank')
+    parser.add_argument('--threshold', type=int, default=128)
+    args = parser.parse_args(argv)
+    if args.chars:
+        args.first = max(args.first, min(ord(c) for c in args.chars))
+        args.last = min(args.last, max(ord(c) for c in args.chars))
+    if not 0 <= args.first <= args.last <= 255:
+        sys.exit('characters have to be in 0-255')
+    directory = os.path.dirname(args.out)
+    if directory:
+        os.makedirs(directory, exist_ok=True)
+    for size in (int(s) for s in args.sizes.split(',')):
+        height, glyphs = rasterize(args.ttf, size, args.first, args.last, args.chars)
+        font = encode(args.first, height, glyphs, args.threshold)
+        path = '%s-%d.fnt' % (args.out, size)
+        with open(path, 'wb') as f:
+            f.write(font)
+        print('%s: %d characters, %d high, %d widest, %d bytes (%d sectors)' % (
+            path, len(glyphs), height, font[3], len(font), (len(font) + 511) // 512))
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])